@@ -1,92 +1,309 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/timerfd.h>
 #include "internal/parlib.h"
 #include "internal/time.h"
-#include "internal/pthread_pool.h"
 #include "alarm.h"
+#include "event.h"
 #include "spinlock.h"
 #include "export.h"
 
-static void *__waiting_thread(void *arg)
-{
-	uint64_t wakeup_time, now;
-	struct alarm_waiter *waiter = (struct alarm_waiter*)arg;
-	spinlock_lock(&waiter->lock);
-	do {
-		wakeup_time = waiter->wakeup_time;
-		now = time_usec();
-		if (wakeup_time < now)
-			break;
-		spinlock_unlock(&waiter->lock);
-		usleep(wakeup_time-now);
-		spinlock_lock(&waiter->lock);
-	} while(waiter->wakeup_time != wakeup_time);
-	waiter->done = true;
-	spinlock_unlock(&waiter->lock);
-
-	if (!waiter->unset) {
-		struct event_msg *ev_msg = parlib_malloc(sizeof(struct event_msg));
-		ev_msg->ev_arg3 = waiter;
-		send_event(ev_msg, EV_ALARM, waiter->vcoreid);
+/* All alarms live in a single hierarchical timing wheel, with a tick of one
+ * usec.  Level L of the wheel holds the alarms whose wakeup time first differs
+ * from wheel_now in their Lth group of ALARM_WHEEL_BITS bits, in the slot
+ * given by that group.  So every alarm at level L goes off before any alarm at
+ * a higher level, and no slot ever holds alarms from two different laps of its
+ * level.  Arming or cancelling an alarm just links or unlinks it from its slot.
+ *
+ * A single pthread sleeps on a timerfd set to the start of the earliest
+ * non-empty slot.  Every time it wakes up, it moves the wheel forward to the
+ * current time: the levels below the highest bit group that changed have gone
+ * off entirely, and the slot of that group that is now current gets spread
+ * back over the lower levels.  Everything that went off is then handed to the
+ * vcores it was armed from, with a single event per vcore.  Those events chain
+ * the waiters through next_fired rather than through the link of the wheel,
+ * which is free for the waiter to be armed again right away. */
+#define ALARM_WHEEL_BITS   6
+#define ALARM_WHEEL_SIZE   (1 << ALARM_WHEEL_BITS)
+#define ALARM_WHEEL_LEVELS ((64 + ALARM_WHEEL_BITS - 1) / ALARM_WHEEL_BITS)
+
+static struct {
+	spin_pdr_lock_t lock;
+	uint64_t now;
+	uint64_t armed_time;
+	int timerfd;
+	uint64_t bitmap[ALARM_WHEEL_LEVELS];
+	struct alarm_waiter_tailq slots[ALARM_WHEEL_LEVELS][ALARM_WHEEL_SIZE];
+} wheel;
+
+static inline int __slot_digit(uint64_t time, int level)
+{
+	return (time >> (level * ALARM_WHEEL_BITS)) & (ALARM_WHEEL_SIZE - 1);
+}
+
+/* Start of the given slot at level, in the current lap of the levels above. */
+static uint64_t __slot_time(int level, int slot)
+{
+	int shift = (level + 1) * ALARM_WHEEL_BITS;
+	uint64_t above = shift < 64 ? (wheel.now >> shift) << shift : 0;
+	return above | ((uint64_t)slot << (level * ALARM_WHEEL_BITS));
+}
+
+static void __wheel_arm_timer(uint64_t time)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (time != UINT64_MAX) {
+		its.it_value.tv_sec = time / 1000000;
+		its.it_value.tv_nsec = (time % 1000000) * 1000;
 	}
-	return NULL;
+	wheel.armed_time = time;
+	timerfd_settime(wheel.timerfd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-static void init_alarm_service(void)
+/* Returns the time at which the wheel next has something to do. */
+static uint64_t __wheel_next()
+{
+	for (int level = 0; level < ALARM_WHEEL_LEVELS; level++) {
+		if (wheel.bitmap[level])
+			return __slot_time(level, __builtin_ctzll(wheel.bitmap[level]));
+	}
+	return UINT64_MAX;
+}
+
+/* Called with the wheel locked. */
+static void __wheel_insert(struct alarm_waiter *waiter)
+{
+	/* Alarms that are already due go off the next time the wheel moves. */
+	uint64_t time = MAX(waiter->wakeup_time, wheel.now + 1);
+	int level = (63 - __builtin_clzll(time ^ wheel.now)) / ALARM_WHEEL_BITS;
+	int slot = __slot_digit(time, level);
+	TAILQ_INSERT_TAIL(&wheel.slots[level][slot], waiter, link);
+	wheel.bitmap[level] |= 1ULL << slot;
+	waiter->slot = level * ALARM_WHEEL_SIZE + slot;
+
+	uint64_t slot_time = __slot_time(level, slot);
+	if (slot_time < wheel.armed_time)
+		__wheel_arm_timer(slot_time);
+}
+
+/* Called with the wheel locked. */
+static void __wheel_remove(struct alarm_waiter *waiter)
+{
+	int level = waiter->slot / ALARM_WHEEL_SIZE;
+	int slot = waiter->slot % ALARM_WHEEL_SIZE;
+	TAILQ_REMOVE(&wheel.slots[level][slot], waiter, link);
+	if (TAILQ_EMPTY(&wheel.slots[level][slot]))
+		wheel.bitmap[level] &= ~(1ULL << slot);
+	waiter->slot = -1;
+}
+
+static void __wheel_expire(struct alarm_waiter_tailq *expired, int level,
+                           uint64_t mask)
+{
+	uint64_t bits = wheel.bitmap[level] & mask;
+	wheel.bitmap[level] &= ~mask;
+	while (bits) {
+		int slot = __builtin_ctzll(bits);
+		bits &= bits - 1;
+		TAILQ_CONCAT(expired, &wheel.slots[level][slot], link);
+	}
+}
+
+/* Moves the wheel forward to time, collecting every alarm that went off in
+ * expired.  Called with the wheel locked. */
+static void __wheel_advance(uint64_t time, struct alarm_waiter_tailq *expired)
+{
+	if (time <= wheel.now)
+		return;
+	int top = (63 - __builtin_clzll(time ^ wheel.now)) / ALARM_WHEEL_BITS;
+	int from = __slot_digit(wheel.now, top);
+	int to = __slot_digit(time, top);
+
+	for (int level = 0; level < top; level++)
+		__wheel_expire(expired, level, ~0ULL);
+	__wheel_expire(expired, top, ((1ULL << to) - 1) & ~((2ULL << from) - 1));
+
+	struct alarm_waiter_tailq current = TAILQ_HEAD_INITIALIZER(current);
+	TAILQ_CONCAT(&current, &wheel.slots[top][to], link);
+	wheel.bitmap[top] &= ~(1ULL << to);
+	wheel.now = time;
+
+	struct alarm_waiter *waiter;
+	while ((waiter = TAILQ_FIRST(&current))) {
+		TAILQ_REMOVE(&current, waiter, link);
+		if (waiter->wakeup_time <= time)
+			TAILQ_INSERT_TAIL(expired, waiter, link);
+		else
+			__wheel_insert(waiter);
+	}
+}
+
+static void __handle_alarms(struct event_msg *ev_msg, unsigned int ev_type)
 {
-	void handler(struct event_msg *ev_msg, unsigned int ev_type)
-	{
-		assert(in_vcore_context());
-		assert(ev_msg);
-		struct alarm_waiter *waiter = (struct alarm_waiter*)ev_msg->ev_arg3;
-		free(ev_msg);
+	assert(in_vcore_context());
+	assert(ev_msg);
+	struct alarm_waiter *waiter = (struct alarm_waiter*)ev_msg->ev_arg3;
+	free(ev_msg);
+	while (waiter) {
+		/* Once it is no longer pending, the waiter may go off again, and
+		 * func may very well arm it again or free it. */
+		spin_pdr_lock(&wheel.lock);
+		struct alarm_waiter *next = waiter->next_fired;
+		waiter->pending = false;
+		spin_pdr_unlock(&wheel.lock);
 		waiter->func(waiter);
+		waiter = next;
+	}
+}
+
+static void *__alarm_thread(void *arg)
+{
+	struct alarm_waiter_tailq expired = TAILQ_HEAD_INITIALIZER(expired);
+	struct alarm_waiter *waiter, *fired, **tail;
+	uint64_t ticks;
+
+	while (1) {
+		if (read(wheel.timerfd, &ticks, sizeof(ticks)) < 0)
+			continue;
+
+		spin_pdr_lock(&wheel.lock);
+		/* Don't bother arming the timer for alarms that only move down a
+		 * level, we rearm it for whatever is left below anyway. */
+		wheel.armed_time = 0;
+		__wheel_advance(time_usec(), &expired);
+		fired = NULL;
+		tail = &fired;
+		while ((waiter = TAILQ_FIRST(&expired))) {
+			TAILQ_REMOVE(&expired, waiter, link);
+			waiter->slot = -1;
+			waiter->done = true;
+			/* Still waiting for its func from the last time it went off. */
+			if (waiter->pending)
+				continue;
+			waiter->pending = true;
+			waiter->next_fired = NULL;
+			*tail = waiter;
+			tail = &waiter->next_fired;
+		}
+		__wheel_arm_timer(__wheel_next());
+		spin_pdr_unlock(&wheel.lock);
+
+		/* Send off everything that went off for the same vcore at once.  Only
+		 * we get to touch next_fired until we do. */
+		while ((waiter = fired)) {
+			struct alarm_waiter *batch = NULL, **batch_tail = &batch;
+			int vcoreid = waiter->vcoreid;
+			for (tail = &fired; (waiter = *tail); ) {
+				if (waiter->vcoreid == vcoreid) {
+					*tail = waiter->next_fired;
+					waiter->next_fired = NULL;
+					*batch_tail = waiter;
+					batch_tail = &waiter->next_fired;
+				} else {
+					tail = &waiter->next_fired;
+				}
+			}
+			struct event_msg *ev_msg = parlib_malloc(sizeof(struct event_msg));
+			ev_msg->ev_arg3 = batch;
+			send_event(ev_msg, EV_ALARM, vcoreid);
+		}
 	}
-	ev_handlers[EV_ALARM] = handler;
+	return NULL;
+}
+
+static void init_alarm_service(void)
+{
+	spin_pdr_init(&wheel.lock);
+	for (int i = 0; i < ALARM_WHEEL_LEVELS; i++)
+		for (int j = 0; j < ALARM_WHEEL_SIZE; j++)
+			TAILQ_INIT(&wheel.slots[i][j]);
+	wheel.now = time_usec();
+	wheel.armed_time = UINT64_MAX;
+	wheel.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	assert(wheel.timerfd >= 0);
+
+	ev_handlers[EV_ALARM] = __handle_alarms;
+
+	/* Alarms can be set up before the vcores are, so we can't use
+	 * internal_pthread_create() here. */
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int ret = pthread_create(&thread, &attr, __alarm_thread, NULL);
+	assert(ret == 0);
+	pthread_attr_destroy(&attr);
 }
 
 void EXPORT_SYMBOL init_awaiter(struct alarm_waiter *waiter,
                                 void (*func) (struct alarm_waiter *))
 {
-	run_once_racy(init_alarm_service());
+	run_once(init_alarm_service());
 	waiter->func = func;
 	waiter->wakeup_time = 0;
 	waiter->unset = false;
 	waiter->done = false;
 	waiter->vcoreid = vcore_id();
-	spinlock_init(&waiter->lock);
+	waiter->slot = -1;
+	waiter->pending = false;
+	waiter->next_fired = NULL;
+}
+
+void EXPORT_SYMBOL set_awaiter_abs(struct alarm_waiter *waiter,
+                                   uint64_t abs_time)
+{
+	waiter->wakeup_time = abs_time;
 }
 
 void EXPORT_SYMBOL set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep)
 {
-	uint64_t now = time_usec();
-	spinlock_lock(&waiter->lock);
-	waiter->wakeup_time = now + usleep;
-	spinlock_unlock(&waiter->lock);
+	waiter->wakeup_time = time_usec() + usleep;
 }
 
 void EXPORT_SYMBOL set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 {
 	assert(waiter->wakeup_time);
-	spinlock_lock(&waiter->lock);
 	waiter->wakeup_time += usleep;
-	spinlock_unlock(&waiter->lock);
 }
 
 void EXPORT_SYMBOL set_alarm(struct alarm_waiter *waiter)
 {
-	assert(!waiter->unset);
-	pooled_pthread_start(__waiting_thread, waiter);	
+	spin_pdr_lock(&wheel.lock);
+	assert(waiter->slot == -1);
+	waiter->unset = false;
+	waiter->done = false;
+	__wheel_insert(waiter);
+	spin_pdr_unlock(&wheel.lock);
 }
 
 bool EXPORT_SYMBOL unset_alarm(struct alarm_waiter *waiter)
 {
-	spinlock_lock(&waiter->lock);
-	if (!waiter->done) {
-		waiter->unset = true;
+	bool unset = false;
+	spin_pdr_lock(&wheel.lock);
+	if (waiter->slot != -1) {
+		__wheel_remove(waiter);
+		waiter->unset = unset = true;
 	}
-	spinlock_unlock(&waiter->lock);
-	return waiter->unset;
+	spin_pdr_unlock(&wheel.lock);
+	return unset;
 }
 
+void EXPORT_SYMBOL reset_alarm_abs(struct alarm_waiter *waiter,
+                                   uint64_t abs_time)
+{
+	spin_pdr_lock(&wheel.lock);
+	if (waiter->slot != -1)
+		__wheel_remove(waiter);
+	waiter->wakeup_time = abs_time;
+	waiter->unset = false;
+	waiter->done = false;
+	__wheel_insert(waiter);
+	spin_pdr_unlock(&wheel.lock);
+}
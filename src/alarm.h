@@ -3,30 +3,38 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/queue.h>
 #include "spinlock.h"
 
 /* Specifc waiter, per alarm */
 struct alarm_waiter {
     void     (*func) (struct alarm_waiter *waiter);
-    uint64_t wakeup_time; /* in usec */  
+    uint64_t wakeup_time; /* in usec, on the CLOCK_MONOTONIC clock */
     bool     unset;
     bool     done;
     void     *data;
     int      vcoreid;
-    spinlock_t lock;
+    /* Private to the alarm service */
+    int      slot;
+    TAILQ_ENTRY(alarm_waiter) link;
+    bool     pending;     /* went off, func not called yet */
+    struct alarm_waiter *next_fired;
 };
+TAILQ_HEAD(alarm_waiter_tailq, alarm_waiter);
 
 void init_awaiter(struct alarm_waiter *waiter,
                   void (*func) (struct alarm_waiter *));
 /* Sets the time an awaiter goes off */
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
-/* Arms/disarms the alarm */
+void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
+/* Arms/disarms the alarm.  unset_alarm() returns true if the alarm was still
+ * armed, in which case its func will not run.  An alarm may be armed again at
+ * any time, even before the func of its last go has run; if it goes off again
+ * before then, func only runs once for both. */
 void set_alarm(struct alarm_waiter *waiter);
 bool unset_alarm(struct alarm_waiter *waiter);
-
-// These are defined in akaros so we may need to find a way to implement them...
-//void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
-//void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time); 
+/* Moves an alarm to go off at abs_time instead, arming it if it wasn't. */
+void reset_alarm_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 
 #endif // PARLIB_ALARM_H
@@ -26,6 +26,7 @@
 # define parlib_getcontext INTERNAL(parlib_getcontext)
 # define parlib_setcontext INTERNAL(parlib_setcontext)
 # define parlib_swapcontext INTERNAL(parlib_swapcontext)
+# define parlib_switchcontext INTERNAL(parlib_switchcontext)
 #endif
 
 #ifndef __ASSEMBLER__
@@ -60,6 +61,12 @@ extern void parlib_setcontext(struct user_context *__ucp);
 extern void parlib_swapcontext(struct user_context *__oucp,
                                struct user_context *__nucp);
 
+/* Same as above, but call FUNC(ARG) on the stack of the new context in
+   between saving the old context and setting the new one.  */
+extern void parlib_switchcontext(struct user_context *__oucp,
+                                 struct user_context *__nucp,
+                                 void (*__func)(void *), void *__arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -2,7 +2,12 @@
 /* Kevin Klues <klueska@cs.berkeley.edu>	*/
 
 #include "internal/parlib.h"
-#include <sys/queue.h>
+#include "internal/event.h"
+#include "internal/vcore.h"
+#include "internal/io_uring.h"
+#include "internal/reactor.h"
+#include "internal/topology.h"
+#include <sys/epoll.h>
 #include <stdlib.h>
 #include "parlib.h"
 #include "vcore.h"
@@ -10,15 +15,11 @@
 #include "spinlock.h"
 #include "atomic.h"
 
-struct pvc_event_msg {
-	struct event_msg *ev_msg;
-	STAILQ_ENTRY(pvc_event_msg) next;
-};
-STAILQ_HEAD(pvc_event_queue, pvc_event_msg);
-
+/* Each vcore's mailbox is an intrusive lock-free stack of event_msgs, linked
+ * through ev_next.  Any number of senders push onto it with a CAS, and the
+ * owning vcore takes everything in it at once with a single swap. */
 struct vc_mgmt {
-	struct pvc_event_queue evq;
-	spin_pdr_lock_t evq_lock;
+	atomic_t mailbox; /* struct event_msg *, newest first */
 	atomic_t notifs_enabled;
 	atomic_t notif_pending;
 } __attribute__((aligned(ARCH_CL_SIZE)));
@@ -27,11 +28,13 @@ static struct vc_mgmt *vc_mgmt;
 
 void event_lib_init()
 {
-	vc_mgmt = parlib_aligned_alloc(PGSIZE,
-	            sizeof(struct vc_mgmt) * max_vcores());
-	for (int i=0; i<max_vcores(); i++) {
-		STAILQ_INIT(&(vc_mgmt[i].evq));
-		spin_pdr_init(&(vc_mgmt[i].evq_lock));
+	/* Senders come from anywhere, but the owner polls its mailbox all the
+	 * time, so keep it on the owner's node. */
+	vc_mgmt = topology_alloc_per_vcore(sizeof(struct vc_mgmt),
+	                                   vcore_capacity());
+	assert(vc_mgmt);
+	for (int i=0; i<vcore_capacity(); i++) {
+		vc_mgmt[i].mailbox = ATOMIC_INITIALIZER(0);
 		vc_mgmt[i].notifs_enabled = ATOMIC_INITIALIZER(1);
 		vc_mgmt[i].notif_pending = ATOMIC_INITIALIZER(0);
 	}
@@ -39,12 +42,12 @@ void event_lib_init()
 
 void send_event(struct event_msg *ev_msg, unsigned ev_type, int vcoreid)
 {
-	struct pvc_event_msg *m = parlib_malloc(sizeof(struct pvc_event_msg));
-	m->ev_msg = ev_msg;
-	m->ev_msg->ev_type = ev_type;
-	spin_pdr_lock(&(vc_mgmt[vcoreid].evq_lock));
-	STAILQ_INSERT_TAIL(&(vc_mgmt[vcoreid].evq), m, next);
-	spin_pdr_unlock(&(vc_mgmt[vcoreid].evq_lock));
+	struct event_msg *head;
+	ev_msg->ev_type = ev_type;
+	do {
+		head = (struct event_msg*)atomic_read(&vc_mgmt[vcoreid].mailbox);
+		ev_msg->ev_next = head;
+	} while (!atomic_cas(&vc_mgmt[vcoreid].mailbox, (long)head, (long)ev_msg));
 
 	atomic_set(&vc_mgmt[vcoreid].notif_pending, 1);
 	if (atomic_read(&vc_mgmt[vcoreid].notifs_enabled)) {
@@ -53,21 +56,99 @@ void send_event(struct event_msg *ev_msg, unsigned ev_type, int vcoreid)
 	}
 }
 
-void handle_events()
+void dispatch_event(struct event_msg *ev_msg, unsigned ev_type)
+{
+	ev_msg->ev_type = ev_type;
+	if (ev_type != EV_NONE) {
+		handle_event_t handler = ev_handlers[ev_type];
+		handler(ev_msg, ev_type);
+	}
+}
+
+static void __handle_events(bool idle)
 {
-	struct pvc_event_msg *m;
+	struct event_msg *m, *next, *fifo;
 	int vcoreid = vcore_id();
-	/* Only we will ever dequeue, so race with m is ok. */
-	while ((m = STAILQ_FIRST(&(vc_mgmt[vcoreid].evq)))) {
-		spin_pdr_lock(&(vc_mgmt[vcoreid].evq_lock));
-		STAILQ_REMOVE_HEAD(&(vc_mgmt[vcoreid].evq), next);
-		spin_pdr_unlock(&(vc_mgmt[vcoreid].evq_lock));
-
-		if (m->ev_msg->ev_type != EV_NONE) {
-			handle_event_t handler = ev_handlers[m->ev_msg->ev_type];
-			handler(m->ev_msg, m->ev_msg->ev_type);
+	atomic_t *mailbox = &vc_mgmt[vcoreid].mailbox;
+	/* Completions on this vcore's I/O engines are dispatched directly. */
+	io_uring_reap(vcoreid);
+	reactor_poll(vcoreid, idle);
+	/* Only we will ever dequeue, so a plain read is enough to skip the swap
+	 * when there is nothing to do. */
+	while (atomic_read(mailbox)) {
+		m = (struct event_msg*)atomic_swap(mailbox, 0);
+		/* Put the batch back in the order it was sent in. */
+		for (fifo = NULL; m; m = next) {
+			next = m->ev_next;
+			m->ev_next = fifo;
+			fifo = m;
 		}
-		free(m);
+		/* Handlers may free or resend their message. */
+		for (m = fifo; m; m = next) {
+			next = m->ev_next;
+			if (m->ev_type != EV_NONE) {
+				handle_event_t handler = ev_handlers[m->ev_type];
+				handler(m, m->ev_type);
+			}
+		}
+	}
+}
+
+void handle_events()
+{
+	__handle_events(false);
+}
+
+void handle_events_idle()
+{
+	__handle_events(true);
+}
+
+void event_vcore_idle(int vcoreid)
+{
+	io_uring_idle(vcoreid);
+	reactor_idle(vcoreid);
+}
+
+/* Epoll instance and thread used to implement event_watch_fd().  Both are
+ * created the first time anyone arms a watch. */
+static int watch_epfd = -1;
+
+static void *__watch_thread(void *arg)
+{
+	struct epoll_event evs[32];
+	while (1) {
+		int n = epoll_wait(watch_epfd, evs, 32, -1);
+		for (int i = 0; i < n; i++) {
+			struct fd_watch *w = evs[i].data.ptr;
+			w->armed = false;
+			wmb();
+			vcore_signal(w->vcoreid);
+		}
+	}
+	return NULL;
+}
+
+static void __watch_init()
+{
+	watch_epfd = epoll_create1(EPOLL_CLOEXEC);
+	assert(watch_epfd >= 0);
+	internal_pthread_create(PTHREAD_STACK_MIN, __watch_thread, NULL);
+}
+
+void event_watch_fd(struct fd_watch *w)
+{
+	run_once(__watch_init());
+	if (w->armed)
+		return;
+	w->armed = true;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = w;
+	if (epoll_ctl(watch_epfd, EPOLL_CTL_MOD, w->fd, &ev) < 0) {
+		int ret = epoll_ctl(watch_epfd, EPOLL_CTL_ADD, w->fd, &ev);
+		assert(ret == 0);
 	}
 }
 
@@ -88,10 +169,12 @@ void disable_notifs(uint32_t vcoreid)
 #undef event_lib_init
 #undef send_event
 #undef handle_events
+#undef handle_events_idle
 #undef enable_notifs
 #undef disable_notifs
 EXPORT_ALIAS(INTERNAL(event_lib_init), event_lib_init)
 EXPORT_ALIAS(INTERNAL(send_event), send_event)
 EXPORT_ALIAS(INTERNAL(handle_events), handle_events)
+EXPORT_ALIAS(INTERNAL(handle_events_idle), handle_events_idle)
 EXPORT_ALIAS(INTERNAL(enable_notifs), enable_notifs)
 EXPORT_ALIAS(INTERNAL(disable_notifs), disable_notifs)
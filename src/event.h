@@ -9,6 +9,7 @@
 # define event_lib_init INTERNAL(event_lib_init)
 # define send_event INTERNAL(send_event)
 # define handle_events INTERNAL(handle_events)
+# define handle_events_idle INTERNAL(handle_events_idle)
 # define enable_notifs INTERNAL(enable_notifs)
 # define disable_notifs INTERNAL(disable_notifs)
 #endif
@@ -16,7 +17,9 @@
 // Akaros event compatibility layer
 struct syscall {
   void *u_data;
+  int flags;
 };
+#define SC_TASK 0x0001  /* u_data is a struct task, see task.h */
 struct event_msg {
   unsigned ev_type;
   uint16_t ev_arg1;
@@ -24,6 +27,9 @@ struct event_msg {
   void *ev_arg3;
   uint64_t ev_arg4;
   struct syscall sysc;
+  /* Links the message into its vcore's mailbox while it is in flight.  The
+   * same message must not be sent again before it has been handled. */
+  struct event_msg *ev_next;
 };
 
 #define EV_NONE 0
@@ -38,6 +44,9 @@ extern handle_event_t ev_handlers[MAX_NR_EVENT];
 void event_lib_init();
 void send_event(struct event_msg *ev_msg, unsigned ev_type, int vcoreid);
 void handle_events();
+/* Same as handle_events(), for a 2LS that found nothing to run: also looks
+ * for I/O that has become ready right away, instead of only every so often. */
+void handle_events_idle();
 
 void clear_notif_pending(uint32_t vcoreid);
 void enable_notifs(uint32_t vcoreid);
@@ -0,0 +1,34 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_EVENT_H
+#define PARLIB_INTERNAL_EVENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../event.h"
+
+/* A file descriptor watched on behalf of a vcore.  Once armed, the vcore is
+ * signaled the next time the fd becomes readable, and the watch is disarmed
+ * again.  Used to get a vcore back into handle_events() when it has I/O
+ * completions pending, without dedicating a thread to each one of them. */
+struct fd_watch {
+	int fd;
+	int vcoreid;
+	volatile bool armed;
+};
+
+/* Arms a one-shot watch on w->fd, unless it is already armed. */
+void event_watch_fd(struct fd_watch *w);
+
+/* Arms the fd_watches of vcoreid's I/O engines that still have requests in
+ * flight, so it gets signaled back online when they complete.  Running vcores
+ * pick their completions up from handle_events() instead.  Called by vcoreid
+ * as it goes offline. */
+void event_vcore_idle(int vcoreid);
+
+/* Runs the handler registered for ev_type on ev_msg directly.  Only valid from
+ * the vcore context of the vcore the event is destined for. */
+void dispatch_event(struct event_msg *ev_msg, unsigned ev_type);
+
+#endif // PARLIB_INTERNAL_EVENT_H
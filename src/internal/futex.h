@@ -36,6 +36,8 @@
 
 #include <errno.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -56,6 +58,18 @@ inline static void futex_wait(void *futex, int comparand)
 }
 
 
+/* Like futex_wait(), but gives up after timeout.  Returns false if it timed
+ * out before the futex changed. */
+inline static bool futex_timed_wait(void *futex, int comparand,
+                                    const struct timespec *timeout)
+{
+  if (*(int*)futex != comparand)
+    return true;
+  int r = syscall(SYS_futex, futex, FUTEX_WAIT, comparand, timeout, NULL, 0);
+  return !(r < 0 && errno == ETIMEDOUT);
+}
+
+
 inline static void futex_wakeup_one(void *futex)
 {
   int r = syscall(SYS_futex, futex, FUTEX_WAKE, 1, NULL, NULL, 0);
@@ -66,6 +80,16 @@ inline static void futex_wakeup_one(void *futex)
 }
 
 
+inline static void futex_wakeup_some(void *futex, int count)
+{
+  int r = syscall(SYS_futex, futex, FUTEX_WAKE, count, NULL, NULL, 0);
+  if (r < 0) {
+    fprintf(stderr, "futex: futex_wakeup_some failed");
+    exit(1);
+  }
+}
+
+
 inline static void futex_wakeup_all(void *futex)
 {
   int r = syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
@@ -0,0 +1,54 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_IO_H
+#define PARLIB_INTERNAL_IO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* An asynchronous wait for readiness on a file descriptor, submitted on behalf
+ * of a blocked uthread to one of the I/O engines of the calling vcore (its
+ * io_uring or its epoll reactor).  The request must stay live (it normally
+ * sits on the stack of the blocked uthread) until 'complete' has been called
+ * on it. */
+struct io_request {
+	int fd;
+	short events;          /* POLLIN / POLLOUT */
+	int vcoreid;           /* vcore the uthread blocked on */
+	uint64_t timeout_usec; /* 0 for no timeout */
+	union {
+		int64_t timeout[2];    /* io_uring: storage for the kernel's timespec */
+		struct {               /* reactor: when it times out, and its list */
+			uint64_t deadline;
+			struct io_request *next_timed;
+		};
+	};
+	bool submitted;
+	bool cancelled;        /* by the engine itself, see io_uring_submit() */
+	int res;               /* poll mask, or -errno (-ECANCELED on timeout) */
+	void (*complete)(struct io_request *req);
+	void *data;
+};
+
+/* Returns whether the I/O engine 'name' may be used.  Engines are tried in the
+ * order io_uring, epoll, thread; setting PARLIB_IO_ENGINE to one of these
+ * names skips all the engines that come before it. */
+static inline bool io_engine_enabled(const char *name)
+{
+	static const char *engines[] = { "io_uring", "epoll", "thread" };
+	const char *first = getenv("PARLIB_IO_ENGINE");
+	if (first == NULL)
+		return true;
+	for (int i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) {
+		if (strcmp(engines[i], first) == 0)
+			return true;
+		if (strcmp(engines[i], name) == 0)
+			return false;
+	}
+	return true;
+}
+
+#endif // PARLIB_INTERNAL_IO_H
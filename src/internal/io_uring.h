@@ -0,0 +1,22 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_IO_URING_H
+#define PARLIB_INTERNAL_IO_URING_H
+
+#include "io.h"
+
+/* Submits req to the io_uring of the calling vcore.  Must be called from vcore
+ * context.  Returns false if io_uring is unavailable or the ring is full, in
+ * which case the caller must fall back to some other way of waiting. */
+bool io_uring_submit(struct io_request *req);
+
+/* Reaps all completions pending on vcoreid's ring and calls req->complete()
+ * on each of them.  Must be called from vcoreid's vcore context. */
+void io_uring_reap(int vcoreid);
+
+/* Makes sure vcoreid gets signaled once its ring has completions, if it has
+ * any requests in flight.  Called by vcoreid when it goes offline. */
+void io_uring_idle(int vcoreid);
+
+#endif // PARLIB_INTERNAL_IO_URING_H
@@ -18,6 +18,7 @@ struct backing_pthread {
 	void *(*syscall) (void*);
 	void *arg;
 	void *initial_tls;
+	void *pool_next; /* next free tls region while sitting in the tls pool */
 };
 extern __thread struct backing_pthread __backing_pthread TLS_INITIAL_EXEC;
 
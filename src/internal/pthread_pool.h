@@ -1,6 +1,30 @@
 #ifndef PARLIB_TPOOL_H
 #define PARLIB_TPOOL_H
 
+#include <stdint.h>
+
+struct pooled_job {
+  void *(*func)(void*);
+  void *arg;
+};
+
 void pooled_pthread_start(void *(*start_rountine)(void*), void *arg);
 
+/* Same as calling pooled_pthread_start() on each of the count jobs, but wakes
+ * up all the pthreads needed to run them at once. */
+void pooled_pthread_start_batch(struct pooled_job *jobs, int count);
+
+/* Bounds the number of pthreads in the pool.  min pthreads are started right
+ * away, if there aren't that many already, and kept around even when idle, and
+ * no more than max are ever started (0 for no limit).  Once max is reached,
+ * jobs are queued until a pthread frees up.  Defaults to
+ * PARLIB_PTHREAD_POOL_MIN and PARLIB_PTHREAD_POOL_MAX from the environment, or
+ * 0 and 0. */
+void pthread_pool_set_size(int min, int max);
+
+/* Pthreads beyond the pool's min that have been idle for usec are retired
+ * (0 to never retire them).  Defaults to PARLIB_PTHREAD_POOL_IDLE_USEC from
+ * the environment, or 1 second. */
+void pthread_pool_set_idle_timeout(uint64_t usec);
+
 #endif
@@ -0,0 +1,34 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_REACTOR_H
+#define PARLIB_INTERNAL_REACTOR_H
+
+#include "io.h"
+
+/* Parks req on the epoll reactor of the calling vcore until req->fd becomes
+ * ready, or its timeout passes (completing it with -ECANCELED).  Must be
+ * called from vcore context.  Returns false if the reactor can't take the
+ * request, with req->res set to why: -ENOSYS if the reactor is off, -EBADF if
+ * fd is out of range, -EPERM (or whatever else epoll_ctl() said) if fd can't
+ * be polled, and -EBUSY if somebody else is already waiting on the same side
+ * of the same fd.  The caller must then fall back to some other way of
+ * waiting, or fail the request. */
+bool reactor_submit(struct io_request *req);
+
+/* Polls vcoreid's reactor without blocking and calls req->complete() on every
+ * request whose fd has become ready.  Unless idle (vcoreid has nothing else to
+ * run) or the watch armed by reactor_idle() fired, only actually looks every
+ * so often.  Must be called from vcoreid's vcore context. */
+void reactor_poll(int vcoreid, bool idle);
+
+/* Makes sure vcoreid gets signaled once one of its fds is ready, if anybody is
+ * waiting on them.  Called by vcoreid when it goes offline. */
+void reactor_idle(int vcoreid);
+
+/* Drops whatever the reactor remembers about fd.  Called whenever an fd is
+ * closed or handed out anew, so a recycled fd number doesn't inherit the
+ * registration of the file it used to refer to. */
+void reactor_forget(int fd);
+
+#endif // PARLIB_INTERNAL_REACTOR_H
@@ -15,6 +15,7 @@
 #ifdef __GLIBC__
 #define __SUPPORTED_C_LIBRARY__
 #define __internal_open __open
+#define __internal_close __close
 #define __internal_read __read
 #define __internal_write __write
 #define __internal_fopen _IO_fopen
@@ -23,6 +24,7 @@
 #define __internal_socket __real_socket
 #define __internal_accept __real_accept
 int __open(const char*, int, ...);
+int __close(int);
 FILE *_IO_fopen(const char *path, const char *mode);
 ssize_t __read(int, void*, size_t);
 ssize_t __write(int, const void*, size_t);
@@ -37,15 +39,45 @@ int __real_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 #include "parlib.h"
 #include "futex.h"
 #include "pthread_pool.h"
+#include "event.h"
+#include "io_uring.h"
+#include "reactor.h"
 #include <sys/mman.h>
+#include <poll.h>
 
 typedef struct {
   void *(*func)(void*);
   struct event_msg ev_msg;
+  struct io_request io;
 } yield_callback_arg_t;
 
+/* Called once the I/O engine a blocked uthread was parked on reports its fd
+ * ready.  Hand the uthread back to the 2LS just as if the event had been sent
+ * by its backing pthread.  The engine may be running on some other vcore than
+ * the one the uthread blocked on, or outside of vcore context altogether (if
+ * the fd was closed under it), in which case it gets a real event. */
+static void __uthread_io_complete(struct io_request *req)
+{
+  yield_callback_arg_t *arg = (yield_callback_arg_t*)req->data;
+  if (in_vcore_context() && vcore_id() == req->vcoreid)
+    dispatch_event(&arg->ev_msg, EV_SYSCALL);
+  else
+    send_event(&arg->ev_msg, EV_SYSCALL, req->vcoreid);
+}
+
+#define __uthread_io_request(__fd, __events) \
+  ((struct io_request) { \
+    .fd = (__fd), \
+    .events = (__events), \
+    .vcoreid = vcoreid, \
+    .timeout_usec = current_uthread->sysc_timeout, \
+    .submitted = false, \
+    .complete = __uthread_io_complete, \
+    .data = &arg, \
+  })
+
 #ifdef ALWAYS_BLOCK
-#define uthread_blocking_call(__func_nonblock, __func_block, ...) \
+#define uthread_blocking_call(__fd, __events, __func_nonblock, __func_block, ...) \
 ({ \
   typeof(__func_block(__VA_ARGS__)) ret; \
   yield_callback_arg_t arg = { NULL, {0} }; \
@@ -61,7 +93,12 @@ typedef struct {
   ret; \
 })
 #else
-#define uthread_blocking_call(__func_nonblock, __func_block, ...) \
+/* Try the call without blocking first.  If it would block, park the uthread
+ * until the fd is ready, preferably through the io_uring or the epoll reactor
+ * of its vcore, and retry.  If neither of them can take the request, the
+ * uthread's backing pthread performs the blocking version of the call on its
+ * behalf instead. */
+#define uthread_blocking_call(__fd, __events, __func_nonblock, __func_block, ...) \
 ({ \
   typeof(__func_block(__VA_ARGS__)) ret; \
   yield_callback_arg_t arg = { NULL, {0} }; \
@@ -72,9 +109,16 @@ typedef struct {
     return NULL; \
   } \
   ret = __func_nonblock(__VA_ARGS__); \
-  if ((ret == -1) && (errno == EWOULDBLOCK)) { \
+  while ((ret == -1) && (errno == EWOULDBLOCK)) { \
+    vcoreid = vcore_id(); \
     arg.func = &do_##__func; \
+    arg.io = __uthread_io_request(__fd, __events); \
     uthread_yield(true, __uthread_yield_callback, &arg); \
+    if (!arg.io.submitted) \
+      break; \
+    ret = __func_nonblock(__VA_ARGS__); \
+    if (arg.io.res < 0) \
+      break; \
   } \
   current_uthread->sysc_timeout = 0; \
   ret; \
@@ -90,15 +134,27 @@ static void __uthread_yield_callback(struct uthread *uthread, void *__arg) {
     assert(sched_ops->thread_paused);
     sched_ops->thread_paused(uthread);
   } else {
-    /* Otherwise, we need to invoke the magic of our backing pthread to perform
-     * the syscall as a simulated async I/O operation, and send us an event
-     * when it is complete. */
+    /* Otherwise, we need to wait for the fd to become ready and get an event
+     * sent to us when it does. */
     arg->ev_msg.ev_arg3 = &arg->ev_msg.sysc;
     uthread->sysc = &arg->ev_msg.sysc;
 
     assert(sched_ops->thread_blockon_sysc);
     sched_ops->thread_blockon_sysc(uthread, &arg->ev_msg.sysc);
 
+    /* Our vcore's io_uring is the cheapest way to do that, followed by its
+     * epoll reactor.  Neither can complete the request before we hand it
+     * over here, so they can't race with the 2LS finishing up
+     * thread_blockon_sysc() above. */
+    if (arg->io.complete) {
+      if (io_uring_submit(&arg->io))
+        return;
+      if (reactor_submit(&arg->io))
+        return;
+    }
+
+    /* Otherwise, invoke the magic of our backing pthread to perform the
+     * syscall as a simulated async I/O operation. */
     struct backing_pthread *bp = get_tls_addr(__backing_pthread, uthread->tls_desc);
     bp->syscall = arg->func;
     bp->arg = &arg->ev_msg;
@@ -0,0 +1,33 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_TOPOLOGY_H
+#define PARLIB_INTERNAL_TOPOLOGY_H
+
+#include <stddef.h>
+#include "../topology.h"
+
+/* Looks up the CPUs we may run on, and picks one for each of the nr_vcores
+ * vcores, along with its place in the machine, in vcore_pvc_data.  Called by
+ * vcore_lib_init() before creating the vcores. */
+void topology_lib_init(int nr_vcores);
+
+/* Looks up the CPUs we may run on again, for vcore_set_max(): of the first
+ * nr_created vcores, those whose CPU we may not use anymore get another one,
+ * and so do the vcores from nr_created up to nr, which are about to be
+ * created.  They go to the CPUs with the fewest of the first nr vcores, best
+ * placed first. */
+void topology_replace(int nr_created, int nr);
+
+/* Asks the kernel to back the len bytes at addr (page aligned) with memory
+ * from node, from now on.  Pages already touched stay where they are.  Does
+ * nothing on a single node, or if the kernel won't. */
+void topology_bind(void *addr, size_t len, int node);
+
+/* Maps zeroed memory for an array of nr objects of size bytes each, the i-th
+ * of which belongs to vcore i, with each page bound to the node of the vcore
+ * whose object covers the middle of it.  Only call this after
+ * topology_lib_init().  Never freed. */
+void *topology_alloc_per_vcore(size_t size, int nr);
+
+#endif // PARLIB_INTERNAL_TOPOLOGY_H
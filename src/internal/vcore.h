@@ -29,10 +29,12 @@
 #include <bits/local_lim.h>
 #include <sys/queue.h>
 #include <signal.h>
+#include <time.h>
 
 #include "arch.h"
 #include "parlib-config.h"
 #include "atomic.h"
+#include "../vcore.h"
 
 #include <pthread.h>
 #include "limits.h"
@@ -40,28 +42,50 @@
 
 #define SIGVCORE	SIGUSR1
 
-struct vcore_sigstack {
-	SLIST_ENTRY(vcore_sigstack) next;
-	void *sigstack[SIGSTKSZ - sizeof(SLIST_ENTRY(vcore_sigstack))];
-};
-SLIST_HEAD(vcore_sigstack_list, vcore_sigstack);
+#define VCORE_RUNNING 0
+#define VCORE_PARKED  1
+#define VCORE_MARKED  2
 
 struct vcore {
   /* For bookkeeping */
   atomic_t allocated;
   atomic_t requested;
+  /* VCORE_PARKED while the vcore is asleep in the kernel, waiting on this
+   * word, VCORE_MARKED once a request got it that way and still has to wake
+   * it, and VCORE_RUNNING otherwise.  A running vcore is found spinning (see
+   * vcore_set_idle_policy()), and needs no futex_wakeup_one() to get going. */
+  atomic_t parked;
+  /* The vcores that were marked by the same request, and that this one wakes
+   * up in turn once it is up, or -1 (see __vcore_request()).  wake_next is
+   * the one marked right after it, for the request to find them with. */
+  int wake_child[2];
+  int wake_next;
 
 #ifdef arch_tls_data_t
   /* Architecture-specific TLS context information, e.g. LDT on IA-32 */
   arch_tls_data_t arch_tls_data;
 #endif
 
-  /* List of sigstacks for use on this vcore. Grows, but never shrinks. */
-  struct vcore_sigstack_list sigstacklist;
-  void *activesigstack;
-
   /* Pointer to the backing pthread for this vcore */
   pthread_t pthread;
+  /* The CPU the backing pthread is pinned to, which vcore_set_max() moves it
+   * off of when vcore_map() changes. */
+  int pinned;
+
+  /* Preemption timer, see vcore_set_preempt_quantum().  Only ever touched
+   * from the vcore's own pthread. */
+  timer_t preempt_timer;
+  bool preempt_timer_valid;
+  /* Number of uthreads started by run_uthread(), and its value at the last
+   * preemption tick. */
+  unsigned long nr_switches;
+  unsigned long preempt_seen;
+  /* See vcore_get_notif_stats().  Only ever touched by the vcore itself. */
+  struct vcore_notif_stats notif_stats;
+  /* The signal stack of the vcore's pthread. */
+  stack_t sigstack;
+  /* See vcore_get_idle_stats().  Only ever touched by the vcore itself. */
+  struct vcore_idle_stats idle_stats;
 };
 
 /* Internal cache aligned, per vcore data */
@@ -72,13 +96,22 @@ struct internal_vcore_pvc_data {
 	/* Marker indicating that the vcore is not able to handle a signal
 	 * immediately */
 	atomic_t sigpending;
+
+	/* Marker indicating that the uthread running on the vcore has used up its
+	 * quantum, and should be paused the next time it gets interrupted */
+	atomic_t preempt_pending;
 } __attribute((aligned(ARCH_CL_SIZE)));
 extern struct internal_vcore_pvc_data *internal_vcore_pvc_data;
 #define __vcores(i) (internal_vcore_pvc_data[i].vcore)
 #define __vcore_sigpending(i) (internal_vcore_pvc_data[i].sigpending)
-
-void __sigstack_swap(void **sigstack);
-void __sigstack_free(void **sigstack);
+#define __vcore_preempt_pending(i) (internal_vcore_pvc_data[i].preempt_pending)
+
+/* Whether vcore_signal() rings a vcore's doorbell instead of sending it
+ * SIGVCORE.  In doorbell mode, sigpending doubles as the doorbell: a running
+ * vcore only notices it at its next safe point (entering vcore context, or
+ * uthread_safe_point()), and a parked vcore gets woken up through its futex.
+ * Set from PARLIB_VCORE_NOTIFY=doorbell in vcore_lib_init(). */
+extern bool __vcore_doorbells;
 
 pthread_t internal_pthread_create(size_t stack_size,
                                   void *(*start_routine) (void *), void *arg);
@@ -0,0 +1,14 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_INTERNAL_WSCHED_H
+#define PARLIB_INTERNAL_WSCHED_H
+
+#include "../wsched.h"
+
+/* Sets up the per-vcore deques of the work-stealing scheduler.  Called by
+ * uthread_lib_init() once the vcores are initialized, if sched_ops still
+ * points to wsched_ops. */
+void wsched_lib_init(void);
+
+#endif // PARLIB_INTERNAL_WSCHED_H
@@ -0,0 +1,311 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Per-vcore io_uring engine for blocking I/O issued by uthreads.
+ *
+ * Each vcore lazily sets up its own ring the first time one of its uthreads
+ * blocks on I/O.  Only the owning vcore ever touches its ring, and only from
+ * vcore context, so neither the submission nor the completion side needs any
+ * locking.  Requests are polls for readiness (parlib puts every fd it hands
+ * out in O_NONBLOCK mode, so the kernel would just hand back -EAGAIN for a
+ * read or write submitted directly); the uthread retries its non-blocking
+ * call once it is woken back up.  Completions are reaped from handle_events(),
+ * which only takes a look at the CQ ring, so a running vcore picks them up
+ * without any system call.
+ *
+ * A vcore that goes idle with requests still in flight arms an fd_watch on its
+ * ring fd (see io_uring_idle()), which becomes readable whenever the ring has
+ * completions waiting, and gets signaled back online through it. */
+
+#define _GNU_SOURCE
+#include "internal/parlib.h"
+#include "internal/io.h"
+#include "internal/io_uring.h"
+#include "internal/event.h"
+#include "parlib-config.h"
+#include "parlib.h"
+#include "vcore.h"
+
+#ifdef PARLIB_HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define IO_URING_ENTRIES 256
+
+struct io_ring {
+	bool initialized;
+	bool disabled;
+	int fd;
+	/* Number of CQEs we still expect the kernel to post. */
+	unsigned cqes_pending;
+	unsigned cq_entries;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct fd_watch watch;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct io_ring *io_rings;
+static bool io_uring_disabled = false;
+
+static void io_uring_lib_init()
+{
+	if (!io_engine_enabled("io_uring")) {
+		io_uring_disabled = true;
+		return;
+	}
+	io_rings = parlib_aligned_alloc(PGSIZE,
+	                                sizeof(struct io_ring) * vcore_capacity());
+	memset(io_rings, 0, sizeof(struct io_ring) * vcore_capacity());
+}
+
+/* Make sure the kernel knows every opcode we are going to submit. */
+static bool __probe_ops(int fd)
+{
+	size_t len = sizeof(struct io_uring_probe) +
+	             256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	if (probe == NULL)
+		return false;
+	bool ok = false;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	            probe, 256) == 0) {
+		ok = probe->last_op >= IORING_OP_LINK_TIMEOUT &&
+		     (probe->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+		     (probe->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return ok;
+}
+
+static bool __io_ring_init(struct io_ring *r, int vcoreid)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+	if (r->fd < 0)
+		return false;
+	if (!__probe_ops(r->fd))
+		goto fail_close;
+
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = MAX(sq_len, cq_len);
+
+	void *sq = mmap(0, sq_len, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail_close;
+	void *cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(0, cq_len, PROT_READ | PROT_WRITE,
+		          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail_sq;
+	}
+	r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	r->sq_head = sq + p.sq_off.head;
+	r->sq_tail = sq + p.sq_off.tail;
+	r->sq_mask = sq + p.sq_off.ring_mask;
+	r->sq_array = sq + p.sq_off.array;
+	r->cq_head = cq + p.cq_off.head;
+	r->cq_tail = cq + p.cq_off.tail;
+	r->cq_mask = cq + p.cq_off.ring_mask;
+	r->cqes = cq + p.cq_off.cqes;
+	r->cq_entries = p.cq_entries;
+	r->cqes_pending = 0;
+
+	r->watch.fd = r->fd;
+	r->watch.vcoreid = vcoreid;
+	r->watch.armed = false;
+	return true;
+
+fail_cq:
+	if (cq != sq)
+		munmap(cq, cq_len);
+fail_sq:
+	munmap(sq, sq_len);
+fail_close:
+	close(r->fd);
+	r->fd = -1;
+	return false;
+}
+
+static struct io_ring *__get_ring(int vcoreid)
+{
+	run_once(io_uring_lib_init());
+	if (io_uring_disabled)
+		return NULL;
+
+	struct io_ring *r = &io_rings[vcoreid];
+	if (!r->initialized) {
+		r->initialized = true;
+		r->disabled = !__io_ring_init(r, vcoreid);
+	}
+	return r->disabled ? NULL : r;
+}
+
+static struct io_uring_sqe *__get_sqe(struct io_ring *r, unsigned *tail)
+{
+	unsigned index = *tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	(*tail)++;
+	return sqe;
+}
+
+/* Hands the SQEs up to tail over to the kernel, and takes back the ones it
+ * didn't take.  Returns how many it took, or -errno. */
+static int __submit(struct io_ring *r, unsigned tail, unsigned nr)
+{
+	/* Publish the new tail before telling the kernel about it. */
+	wmb();
+	*r->sq_tail = tail;
+
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, nr, 0, 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		ret = -errno;
+	if (ret < (int)nr)
+		*r->sq_tail = tail - (nr - MAX(ret, 0));
+	return ret;
+}
+
+bool io_uring_submit(struct io_request *req)
+{
+	assert(in_vcore_context());
+	struct io_ring *r = __get_ring(vcore_id());
+	if (r == NULL)
+		return false;
+
+	/* Each request posts at most two CQEs: one for the poll, and one for its
+	 * timeout.  Never let the CQ ring overflow. */
+	unsigned ncqes = req->timeout_usec ? 2 : 1;
+	if (r->cqes_pending + ncqes + 1 > r->cq_entries)
+		return false;
+	req->cancelled = false;
+
+	unsigned tail = *r->sq_tail;
+	struct io_uring_sqe *sqe = __get_sqe(r, &tail);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = req->fd;
+	sqe->poll_events = req->events;
+	sqe->user_data = (uintptr_t)req;
+
+	if (req->timeout_usec) {
+		sqe->flags |= IOSQE_IO_LINK;
+		req->timeout[0] = req->timeout_usec / 1000000;
+		req->timeout[1] = (req->timeout_usec % 1000000) * 1000;
+		sqe = __get_sqe(r, &tail);
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (uintptr_t)req->timeout;
+		sqe->len = 1;
+		sqe->user_data = 0;
+	}
+
+	int ret = __submit(r, tail, ncqes);
+	if (ret <= 0)
+		return false;
+	req->submitted = true;
+	r->cqes_pending += ret;
+	if (ret < ncqes) {
+		/* The poll went in, but its timeout didn't, and a link doesn't carry
+		 * over to the next submission.  Cancel the poll rather than have it
+		 * wait forever; reaping turns the -ECANCELED of that into a spurious
+		 * wakeup, and the uthread blocks again with its full timeout. */
+		req->cancelled = true;
+		tail = *r->sq_tail;
+		sqe = __get_sqe(r, &tail);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->addr = (uintptr_t)req;
+		sqe->user_data = 0;
+		if (__submit(r, tail, 1) == 1)
+			r->cqes_pending++;
+	}
+	return true;
+}
+
+void io_uring_reap(int vcoreid)
+{
+	if (io_rings == NULL)
+		return;
+	struct io_ring *r = &io_rings[vcoreid];
+	if (!r->initialized || r->disabled || r->cqes_pending == 0)
+		return;
+
+	unsigned head = *r->cq_head;
+	while (1) {
+		unsigned tail = *(volatile unsigned *)r->cq_tail;
+		rmb();
+		if (head == tail)
+			break;
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			struct io_request *req = (struct io_request *)(uintptr_t)cqe->user_data;
+			r->cqes_pending--;
+			if (req == NULL)
+				continue;
+			req->res = cqe->res;
+			if (req->cancelled && req->res == -ECANCELED)
+				req->res = 0;
+			/* Release the CQE before the uthread can resubmit. */
+			*r->cq_head = head + 1;
+			req->complete(req);
+		}
+		*r->cq_head = head;
+	}
+}
+
+void io_uring_idle(int vcoreid)
+{
+	if (io_rings == NULL)
+		return;
+	struct io_ring *r = &io_rings[vcoreid];
+	if (!r->initialized || r->disabled || r->cqes_pending == 0)
+		return;
+	/* The ring fd is readable as long as the CQ ring isn't empty, so nothing
+	 * that completed before we got here goes unnoticed. */
+	event_watch_fd(&r->watch);
+}
+
+#else
+
+bool io_uring_submit(struct io_request *req)
+{
+	return false;
+}
+
+void io_uring_reap(int vcoreid)
+{
+}
+
+void io_uring_idle(int vcoreid)
+{
+}
+
+#endif
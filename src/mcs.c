@@ -97,7 +97,7 @@ void mcs_pdr_unlock(struct mcs_pdr_lock *pdr_lock, struct mcs_lock_qnode *qnode)
 // MCS dissemination barrier!
 void mcs_barrier_init(mcs_barrier_t* b, size_t np)
 {
-	assert(np <= max_vcores());
+	assert(np <= vcore_capacity());
 	b->allnodes = parlib_aligned_alloc(ARCH_CL_SIZE,
 	                  np*sizeof(mcs_dissem_flags_t));
 	memset(b->allnodes,0,np*sizeof(mcs_dissem_flags_t));
@@ -28,7 +28,12 @@
 #include "arch.h"
 #include "context.h"
 #include "vcore.h"
+#include "topology.h"
+#include "stack.h"
 #include "uthread.h"
+#include "wsched.h"
+#include "upthread.h"
+#include "task.h"
 #include "mcs.h"
 #include "tls.h"
 #include "dtls.h"
@@ -1,27 +1,70 @@
 #include "internal/parlib.h"
 #include "internal/pthread_pool.h"
 #include "internal/futex.h"
+#include "internal/time.h"
 #include "slab.h"
-#include "spinlock.h"
+#include "arch.h"
+#include "atomic.h"
 #include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <sys/queue.h>
+#include <sched.h>
+#include <sys/param.h>
+
+/* Jobs are handed to idle pthreads through a bounded lock-free MPMC ring, where
+ * each slot carries a sequence number telling producers and consumers whose
+ * turn it is to use it.  A job is only ever queued once an idle pthread has
+ * been reserved for it (num_avail), so nothing sits in the ring waiting for a
+ * pthread that is busy blocking on something else.  When no pthread is idle,
+ * or the ring is full, the job gets a brand new pthread of its own instead,
+ * which joins the pool once the job is done.
+ *
+ * The pool never grows beyond pool_max pthreads though.  Past that, jobs are
+ * queued without a reservation (driving num_avail negative) and picked up as
+ * pthreads free up, and submitters wait for room once the ring is full.  The
+ * same goes when pthread_create() fails, except that a submitter that finds
+ * the pool empty keeps trying to start a pthread until it has one.
+ *
+ * pool_min pthreads are started as soon as the size is set, and idle pthreads
+ * beyond pool_min retire themselves after idle_usec, unless they find a job
+ * queued without a reservation as they go. */
+#define JOB_QUEUE_SIZE 1024 /* must be a power of 2 */
 
 struct job {
-  SIMPLEQ_ENTRY(job) link;
   void *(*func)(void*);
   void *arg;
 };
-SIMPLEQ_HEAD(job_queue, job);
-static struct job_queue job_queue = SIMPLEQ_HEAD_INITIALIZER(job_queue);
-static spinlock_t lock = SPINLOCK_INITIALIZER;
+
+struct job_slot {
+  uint32_t seq;
+  struct job job;
+};
+
+struct job_queue {
+  uint32_t head __attribute__((aligned(ARCH_CL_SIZE)));
+  uint32_t tail __attribute__((aligned(ARCH_CL_SIZE)));
+  struct job_slot slots[JOB_QUEUE_SIZE] __attribute__((aligned(ARCH_CL_SIZE)));
+};
+static struct job_queue job_queue;
 
 static struct slab_cache *job_slab;
 static pthread_attr_t attr;
-static int num_avail = 0;
-static int num_enqueued = 0;
-static int total_enqueued = 0;
+
+/* Idle pthreads minus queued jobs.  Negative once the pool is at pool_max and
+ * jobs are queued without a reservation: that many jobs are waiting for a
+ * pthread to free up, and none can be reserved until they all have one. */
+static atomic_t num_avail = ATOMIC_INITIALIZER(0);
+/* Idle pthreads parked on wake_seq.  Submitters only make the futex syscall
+ * when somebody is actually parked. */
+static atomic_t num_sleepers = ATOMIC_INITIALIZER(0);
+static uint32_t wake_seq = 0;
+/* All pthreads in the pool, busy or not. */
+static atomic_t num_threads = ATOMIC_INITIALIZER(0);
+
+static int pool_min = 0;
+static int pool_max = INT_MAX;
+static uint64_t idle_usec = 1000000;
 
 static void __attribute__((constructor)) pthread_pool_init()
 {
@@ -31,66 +74,253 @@ static void __attribute__((constructor)) pthread_pool_init()
 
   job_slab = slab_cache_create("job_slab",
     sizeof(struct job), __alignof__(struct job), 0, NULL, NULL);
+
+  for (int i = 0; i < JOB_QUEUE_SIZE; i++)
+    job_queue.slots[i].seq = i;
+
+  char *min = getenv("PARLIB_PTHREAD_POOL_MIN");
+  char *max = getenv("PARLIB_PTHREAD_POOL_MAX");
+  char *idle = getenv("PARLIB_PTHREAD_POOL_IDLE_USEC");
+  pthread_pool_set_size(min ? atoi(min) : 0, max ? atoi(max) : 0);
+  if (idle != NULL)
+    pthread_pool_set_idle_timeout(strtoull(idle, NULL, 0));
 }
 
-static struct job *__dequeue_job(struct job_queue *q)
+static bool __enqueue_job(struct job_queue *q, struct job *job)
 {
-  struct job *j = SIMPLEQ_FIRST(q);
-  if (j) {
-    SIMPLEQ_REMOVE_HEAD(q, link);
-    num_enqueued--;
+  uint32_t pos = *(volatile uint32_t*)&q->tail;
+  while (1) {
+    struct job_slot *s = &q->slots[pos & (JOB_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(*(volatile uint32_t*)&s->seq - pos);
+    if (diff == 0) {
+      if (atomic_cas_u32(&q->tail, pos, pos + 1)) {
+        s->job = *job;
+        wmb();
+        s->seq = pos + 1;
+        return true;
+      }
+    } else if (diff < 0) {
+      /* The consumer from the last lap hasn't released this slot yet. */
+      return false;
+    }
+    pos = *(volatile uint32_t*)&q->tail;
   }
-  return j;
 }
 
-static void *__thread_wrapper(void *arg)
+static bool __dequeue_job(struct job_queue *q, struct job *job)
 {
-  int prev_total_enqueued = 0;
-  struct job_queue *q = (struct job_queue*)arg;
-  struct job job, *jobp = NULL;
-
-  while(1) {
-    spinlock_lock(&lock);
-      if (jobp != NULL)
-        num_avail++;
-
-      if ((jobp = __dequeue_job(q)) == NULL)
-        prev_total_enqueued = total_enqueued;
-      else {
-        job = *jobp;
-        slab_cache_free(job_slab, jobp);
-        num_avail--;
+  uint32_t pos = *(volatile uint32_t*)&q->head;
+  while (1) {
+    struct job_slot *s = &q->slots[pos & (JOB_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(*(volatile uint32_t*)&s->seq - (pos + 1));
+    if (diff == 0) {
+      if (atomic_cas_u32(&q->head, pos, pos + 1)) {
+        rmb();
+        *job = s->job;
+        cmb();
+        s->seq = pos + JOB_QUEUE_SIZE;
+        return true;
       }
-    spinlock_unlock(&lock);
+    } else if (diff < 0) {
+      return false;
+    }
+    pos = *(volatile uint32_t*)&q->head;
+  }
+}
+
+static bool __reserve_thread()
+{
+  long avail;
+  do {
+    avail = atomic_read(&num_avail);
+    if (avail <= 0)
+      return false;
+  } while (!atomic_cas(&num_avail, avail, avail - 1));
+  return true;
+}
+
+static bool __reserve_new_thread()
+{
+  long nr;
+  do {
+    nr = atomic_read(&num_threads);
+    if (nr >= pool_max)
+      return false;
+  } while (!atomic_cas(&num_threads, nr, nr + 1));
+  return true;
+}
 
-    if (jobp)
-      job.func(job.arg);
-    else
-      futex_wait(&total_enqueued, prev_total_enqueued);
+/* Takes an idle pthread out of the pool, so long as no queued job is counting
+ * on it and the pool stays at or above pool_min. */
+static bool __retire_thread()
+{
+  if (!__reserve_thread())
+    return false;
+  long nr;
+  do {
+    nr = atomic_read(&num_threads);
+    if (nr <= pool_min) {
+      atomic_add(&num_avail, 1);
+      return false;
+    }
+  } while (!atomic_cas(&num_threads, nr, nr - 1));
+  /* A submitter that queued a job without a reservation before we went
+   * counts on us to run it.  One that queues it after we went finds the pool
+   * empty, and starts a new pthread itself, see __submit_job(). */
+  mb();
+  if ((long)atomic_read(&num_avail) < 0) {
+    atomic_add(&num_threads, 1);
+    atomic_add(&num_avail, 1);
+    return false;
   }
+  return true;
+}
 
-  return 0;
+/* Returns false if the calling pthread should exit instead. */
+static bool __wait_for_job(struct job *job)
+{
+  uint64_t timeout = idle_usec;
+  uint64_t deadline = time_usec() + timeout;
+  while (!__dequeue_job(&job_queue, job)) {
+    uint32_t seq = *(volatile uint32_t*)&wake_seq;
+    atomic_add(&num_sleepers, 1);
+    /* A submitter that didn't see us as a sleeper yet must have queued its
+     * job before we got here, so look once more before parking. */
+    if (__dequeue_job(&job_queue, job)) {
+      atomic_add(&num_sleepers, -1);
+      return true;
+    }
+    bool timed_out = false;
+    if (timeout == 0) {
+      futex_wait(&wake_seq, seq);
+    } else {
+      uint64_t now = time_usec();
+      if (now < deadline) {
+        struct timespec ts = { (deadline - now) / 1000000,
+                               ((deadline - now) % 1000000) * 1000 };
+        timed_out = !futex_timed_wait(&wake_seq, seq, &ts);
+      } else {
+        timed_out = true;
+      }
+    }
+    atomic_add(&num_sleepers, -1);
+    if (timed_out) {
+      if (__retire_thread())
+        return false;
+      deadline = time_usec() + timeout;
+    }
+  }
+  return true;
 }
 
-void EXPORT_SYMBOL pooled_pthread_start(void *(*func)(void*), void *arg)
+/* Runs the job at arg, if any, then whatever else comes its way. */
+static void *__thread_wrapper(void *arg)
 {
-  spinlock_lock(&lock);
-    struct job *j = slab_cache_alloc(job_slab, 0);
+  struct job job;
+  if (arg != NULL) {
+    job = *(struct job*)arg;
+    slab_cache_free(job_slab, arg);
+    job.func(job.arg);
+  }
+
+  while (1) {
+    atomic_add(&num_avail, 1);
+    if (!__wait_for_job(&job))
+      return 0;
+    job.func(job.arg);
+  }
+}
+
+/* Starts a pthread in the pool, which runs job first if there is one.  The
+ * caller must have reserved a spot for it with __reserve_new_thread(). */
+static bool __start_thread(struct job *job)
+{
+  struct job *j = NULL;
+  if (job) {
+    j = slab_cache_alloc(job_slab, 0);
     assert(j);
-    j->func = func;
-    j->arg = arg;
-
-    SIMPLEQ_INSERT_HEAD(&job_queue, j, link);
-    num_enqueued++;
-    total_enqueued++;
-
-    if (num_avail < num_enqueued) {
-      assert(num_avail == num_enqueued-1);
-      pthread_t handle;
-      pthread_create(&handle, &attr, __thread_wrapper, &job_queue);
-      num_avail++;
-    }
-  spinlock_unlock(&lock);
+    *j = *job;
+  }
+  pthread_t handle;
+  if (pthread_create(&handle, &attr, __thread_wrapper, j) == 0)
+    return true;
+  if (j)
+    slab_cache_free(job_slab, j);
+  atomic_add(&num_threads, -1);
+  return false;
+}
+
+/* Queues job for an idle pthread, or starts a new pthread for it.  Returns
+ * true if somebody needs to be woken up to run it. */
+static bool __submit_job(struct job *job)
+{
+  if (__reserve_thread()) {
+    if (__enqueue_job(&job_queue, job))
+      return true;
+    atomic_add(&num_avail, 1);
+  }
+
+  /* If we are out of pthreads for now, wait for one of ours instead. */
+  if (__reserve_new_thread() && __start_thread(job))
+    return false;
+
+  /* Queue the job for the next pthread to free up. */
+  atomic_add(&num_avail, -1);
+  while (!__enqueue_job(&job_queue, job))
+    sched_yield();
+  /* Unless there is none left to: then whoever retired last didn't see our
+   * job, see __retire_thread(). */
+  while (atomic_read(&num_threads) == 0) {
+    if (__reserve_new_thread() && __start_thread(NULL))
+      break;
+    sched_yield();
+  }
+  return true;
+}
 
-  futex_wakeup_one(&total_enqueued);
+static void __wake_threads(int count)
+{
+  /* Order our enqueues before reading num_sleepers, see __wait_for_job(). */
+  mb();
+  long sleepers = atomic_read(&num_sleepers);
+  if (count == 0 || sleepers <= 0)
+    return;
+  atomic_add(&wake_seq, 1);
+  if (count == 1)
+    futex_wakeup_one(&wake_seq);
+  else
+    futex_wakeup_some(&wake_seq, MIN(count, sleepers));
+}
+
+void EXPORT_SYMBOL pthread_pool_set_size(int min, int max)
+{
+  pool_min = MAX(min, 0);
+  pool_max = max > 0 ? MAX(max, MAX(pool_min, 1)) : INT_MAX;
+  while (atomic_read(&num_threads) < pool_min) {
+    if (!__reserve_new_thread() || !__start_thread(NULL))
+      break;
+  }
+}
+
+void EXPORT_SYMBOL pthread_pool_set_idle_timeout(uint64_t usec)
+{
+  idle_usec = usec;
+}
+
+void EXPORT_SYMBOL pooled_pthread_start(void *(*func)(void*), void *arg)
+{
+  struct job job = { func, arg };
+  __wake_threads(__submit_job(&job) ? 1 : 0);
+}
+
+void EXPORT_SYMBOL pooled_pthread_start_batch(struct pooled_job *jobs,
+                                              int count)
+{
+  int queued = 0;
+  for (int i = 0; i < count; i++) {
+    struct job job = { jobs[i].func, jobs[i].arg };
+    if (__submit_job(&job))
+      queued++;
+  }
+  __wake_threads(queued);
 }
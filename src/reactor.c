@@ -0,0 +1,435 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Per-vcore epoll reactor for blocking I/O issued by uthreads.
+ *
+ * Each vcore lazily creates its own epoll set.  An fd is added to the set of
+ * the vcore whose uthread blocks on it, edge-triggered and for both directions
+ * at once, and the waiting request is recorded in the fd's slot of a global fd
+ * table.  Whenever nobody is waiting on an fd yet, it gets added again, and an
+ * EEXIST means it is still there: an fd closed behind our back (by fclose(),
+ * dup2() or libc itself) silently leaves the epoll set, and whatever file
+ * gets its number next needs adding for real.  An fd moves to another vcore's
+ * set when a uthread blocks on it from there while nobody is waiting on it.
+ *
+ * Since registrations are edge-triggered, an edge that arrives while nobody is
+ * waiting is remembered in the fd's slot, and consumed by the next request to
+ * block on that side of the fd.  At worst this makes a uthread retry its call
+ * once for nothing.
+ *
+ * A vcore with requests in flight polls its set whenever its 2LS runs out of
+ * things to run (see handle_events_idle()), and otherwise from handle_events()
+ * only every REACTOR_POLL_USEC, so a busy vcore doesn't make a system call
+ * every time it switches uthreads, but doesn't starve its fds either.  Only
+ * once it goes offline does it hand its set over to an fd_watch, just like for
+ * the io_uring engine, and gets signaled back online as soon as any of its fds
+ * is ready.
+ *
+ * Requests with a timeout also go on a list of the reactor whose set their fd
+ * is in, and a single alarm of that reactor is kept armed for the earliest of
+ * them.  It goes off on the reactor's own vcore, which completes whatever timed
+ * out with -ECANCELED.  A request is only ever on the list while it is the
+ * waiter in its fd's slot, and both change under the lock of the slot, so
+ * whoever takes it out of there gets to complete it. */
+
+#define _GNU_SOURCE
+#include "internal/parlib.h"
+#include "internal/io.h"
+#include "internal/reactor.h"
+#include "internal/event.h"
+#include "internal/time.h"
+#include "parlib.h"
+#include "vcore.h"
+#include "spinlock.h"
+#include "atomic.h"
+#include "alarm.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define REACTOR_FD_CHUNK     1024
+#define REACTOR_FD_CHUNKS    (1 << 14)
+#define REACTOR_MAX_EVENTS   64
+/* How often a vcore that never runs out of work polls anyway. */
+#define REACTOR_POLL_USEC    100
+
+/* Value of reactor_fd.vcoreid that doesn't name a vcore. */
+#define REACTOR_FD_UNREGISTERED  -1
+
+struct reactor_fd {
+	spin_pdr_lock_t lock;
+	int vcoreid;          /* vcore whose epoll set the fd is in */
+	bool rd_ready;        /* edges nobody was waiting for yet */
+	bool wr_ready;
+	struct io_request *rd;
+	struct io_request *wr;
+};
+
+struct reactor {
+	bool initialized;
+	bool disabled;
+	int epfd;
+	/* Number of requests waiting on fds in our epoll set. */
+	atomic_t nwaiters;
+	/* Whether we armed the watch as we went offline, and when we last
+	 * polled, in TSC cycles. */
+	bool watching;
+	uint64_t last_poll;
+	struct fd_watch watch;
+	/* Requests with a timeout, and the alarm armed for the earliest of them
+	 * (at alarm_time, 0 if none). */
+	spin_pdr_lock_t timed_lock;
+	struct io_request *timed;
+	struct alarm_waiter alarm;
+	uint64_t alarm_time;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct reactor *reactors;
+static bool reactor_disabled = false;
+static uint64_t reactor_poll_cycles;
+
+/* Two-level table indexed by fd, so we don't have to size it for the largest
+ * fd up front.  Chunks are allocated on first use and never freed. */
+static struct reactor_fd *reactor_fds[REACTOR_FD_CHUNKS];
+
+static void reactor_lib_init()
+{
+	if (!io_engine_enabled("epoll")) {
+		reactor_disabled = true;
+		return;
+	}
+	reactors = parlib_aligned_alloc(PGSIZE,
+	                                sizeof(struct reactor) * vcore_capacity());
+	memset(reactors, 0, sizeof(struct reactor) * vcore_capacity());
+	reactor_poll_cycles = usec2tsc(REACTOR_POLL_USEC);
+}
+
+static void __reactor_timeout(struct alarm_waiter *alarm);
+
+static struct reactor *__get_reactor(int vcoreid)
+{
+	run_once(reactor_lib_init());
+	if (reactor_disabled)
+		return NULL;
+
+	struct reactor *r = &reactors[vcoreid];
+	if (!r->initialized) {
+		r->initialized = true;
+		r->epfd = epoll_create1(EPOLL_CLOEXEC);
+		r->disabled = (r->epfd < 0);
+		r->watch.fd = r->epfd;
+		r->watch.vcoreid = vcoreid;
+		r->watch.armed = false;
+		spin_pdr_init(&r->timed_lock);
+		init_awaiter(&r->alarm, __reactor_timeout);
+		r->alarm.data = r;
+		r->alarm.vcoreid = vcoreid;
+	}
+	return r->disabled ? NULL : r;
+}
+
+static struct reactor_fd *__get_fd(int fd, bool create)
+{
+	if (fd < 0 || fd >= REACTOR_FD_CHUNK * REACTOR_FD_CHUNKS)
+		return NULL;
+
+	struct reactor_fd **chunk = &reactor_fds[fd / REACTOR_FD_CHUNK];
+	if (*chunk == NULL) {
+		if (!create)
+			return NULL;
+		size_t size = sizeof(struct reactor_fd) * REACTOR_FD_CHUNK;
+		struct reactor_fd *c = parlib_aligned_alloc(ARCH_CL_SIZE, size);
+		memset(c, 0, size);
+		for (int i = 0; i < REACTOR_FD_CHUNK; i++) {
+			spin_pdr_init(&c[i].lock);
+			c[i].vcoreid = REACTOR_FD_UNREGISTERED;
+		}
+		if (!atomic_cas((atomic_t*)chunk, 0, (long)c))
+			free(c);
+	}
+	return &(*chunk)[fd % REACTOR_FD_CHUNK];
+}
+
+/* Makes sure fd is in the epoll set of vcoreid, moving it there from the set
+ * of some other vcore if need be.  Called with e->lock held. */
+static bool __register_fd(struct reactor_fd *e, int fd, int vcoreid)
+{
+	if (e->vcoreid >= 0 && e->vcoreid != vcoreid)
+		epoll_ctl(reactors[e->vcoreid].epfd, EPOLL_CTL_DEL, fd, NULL);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = fd;
+	if (epoll_ctl(reactors[vcoreid].epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno != EEXIST) {
+			/* Regular files and the like can't be polled at all. */
+			e->vcoreid = REACTOR_FD_UNREGISTERED;
+			return false;
+		}
+		/* Still there.  Unless we knew that already, we don't know what
+		 * edges we missed either: better retry once for nothing than wait
+		 * forever. */
+		if (e->vcoreid != vcoreid) {
+			e->vcoreid = vcoreid;
+			e->rd_ready = true;
+			e->wr_ready = true;
+		}
+		return true;
+	}
+	/* The new registration reports the current state of the fd right away. */
+	e->vcoreid = vcoreid;
+	e->rd_ready = false;
+	e->wr_ready = false;
+	return true;
+}
+
+/* Puts req on r's list of requests with a timeout.  Called with the lock of
+ * req's fd held. */
+static void __time(struct reactor *r, struct io_request *req)
+{
+	req->deadline = time_usec() + req->timeout_usec;
+	spin_pdr_lock(&r->timed_lock);
+	req->next_timed = r->timed;
+	r->timed = req;
+	if (r->alarm_time == 0 || req->deadline < r->alarm_time) {
+		r->alarm_time = req->deadline;
+		reset_alarm_abs(&r->alarm, req->deadline);
+	}
+	spin_pdr_unlock(&r->timed_lock);
+}
+
+/* Takes req back off of r's list, if it has a timeout.  Called with the lock
+ * of req's fd held. */
+static void __untime(struct reactor *r, struct io_request *req)
+{
+	if (req->timeout_usec == 0)
+		return;
+	spin_pdr_lock(&r->timed_lock);
+	for (struct io_request **p = &r->timed; *p; p = &(*p)->next_timed) {
+		if (*p == req) {
+			*p = req->next_timed;
+			break;
+		}
+	}
+	spin_pdr_unlock(&r->timed_lock);
+}
+
+/* Completes everything on r's list that timed out, and arms the alarm again
+ * for whatever is left.  Runs on r's vcore. */
+static void __reactor_timeout(struct alarm_waiter *alarm)
+{
+	struct reactor *r = alarm->data;
+	uint64_t now = time_usec();
+	while (1) {
+		struct io_request *req;
+		uint64_t next = 0;
+		spin_pdr_lock(&r->timed_lock);
+		for (req = r->timed; req; req = req->next_timed) {
+			if (req->deadline <= now)
+				break;
+			if (next == 0 || req->deadline < next)
+				next = req->deadline;
+		}
+		int fd = req ? req->fd : -1;
+		if (req == NULL) {
+			r->alarm_time = next;
+			if (next)
+				reset_alarm_abs(&r->alarm, next);
+		}
+		spin_pdr_unlock(&r->timed_lock);
+		if (req == NULL)
+			return;
+
+		/* Unless it completed in the meantime, it is still waiting on fd.
+		 * Whatever request is waiting there has to have timed out too. */
+		struct reactor_fd *e = __get_fd(fd, false);
+		struct io_request **waiter = NULL;
+		spin_pdr_lock(&e->lock);
+		if (e->rd == req)
+			waiter = &e->rd;
+		else if (e->wr == req)
+			waiter = &e->wr;
+		if (waiter && req->deadline <= now) {
+			*waiter = NULL;
+			__untime(r, req);
+		} else {
+			waiter = NULL;
+		}
+		spin_pdr_unlock(&e->lock);
+		if (waiter) {
+			atomic_add(&r->nwaiters, -1);
+			req->res = -ECANCELED;
+			req->complete(req);
+		}
+	}
+}
+
+bool reactor_submit(struct io_request *req)
+{
+	assert(in_vcore_context());
+
+	int vcoreid = vcore_id();
+	struct reactor *r = __get_reactor(vcoreid);
+	if (r == NULL) {
+		req->res = -ENOSYS;
+		return false;
+	}
+	struct reactor_fd *e = __get_fd(req->fd, true);
+	if (e == NULL) {
+		req->res = -EBADF;
+		return false;
+	}
+
+	spin_pdr_lock(&e->lock);
+	if (e->rd == NULL && e->wr == NULL) {
+		if (!__register_fd(e, req->fd, vcoreid)) {
+			req->res = -errno;
+			goto fail;
+		}
+	}
+
+	bool reading = req->events & POLLIN;
+	struct io_request **waiter = reading ? &e->rd : &e->wr;
+	bool *ready = reading ? &e->rd_ready : &e->wr_ready;
+	if (*waiter != NULL) {
+		req->res = -EBUSY;
+		goto fail;
+	}
+
+	req->submitted = true;
+	if (*ready) {
+		*ready = false;
+		spin_pdr_unlock(&e->lock);
+		req->res = req->events;
+		req->complete(req);
+		return true;
+	}
+	int owner = e->vcoreid;
+	*waiter = req;
+	atomic_add(&reactors[owner].nwaiters, 1);
+	if (req->timeout_usec)
+		__time(&reactors[owner], req);
+	spin_pdr_unlock(&e->lock);
+	return true;
+
+fail:
+	spin_pdr_unlock(&e->lock);
+	return false;
+}
+
+void reactor_poll(int vcoreid, bool idle)
+{
+	if (reactors == NULL)
+		return;
+	struct reactor *r = &reactors[vcoreid];
+	if (!r->initialized || r->disabled)
+		return;
+	if (atomic_read(&r->nwaiters) == 0)
+		return;
+	uint64_t now = read_tsc();
+	if (r->watching) {
+		/* Our set hasn't become ready since we went offline. */
+		if (r->watch.armed)
+			return;
+		r->watching = false;
+	} else if (!idle && now - r->last_poll < reactor_poll_cycles) {
+		return;
+	}
+	r->last_poll = now;
+
+	struct epoll_event evs[REACTOR_MAX_EVENTS];
+	int n;
+	do {
+		n = epoll_wait(r->epfd, evs, REACTOR_MAX_EVENTS, 0);
+		for (int i = 0; i < n; i++) {
+			struct reactor_fd *e = __get_fd(evs[i].data.fd, false);
+			uint32_t events = evs[i].events;
+			struct io_request *rd = NULL, *wr = NULL;
+
+			spin_pdr_lock(&e->lock);
+			if (e->vcoreid != vcoreid) {
+				/* Moved away since the kernel queued this event. */
+				spin_pdr_unlock(&e->lock);
+				continue;
+			}
+			if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				rd = e->rd;
+				e->rd = NULL;
+				e->rd_ready = (rd == NULL);
+				if (rd)
+					__untime(r, rd);
+			}
+			if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+				wr = e->wr;
+				e->wr = NULL;
+				e->wr_ready = (wr == NULL);
+				if (wr)
+					__untime(r, wr);
+			}
+			spin_pdr_unlock(&e->lock);
+
+			if (rd) {
+				atomic_add(&r->nwaiters, -1);
+				rd->res = events;
+				rd->complete(rd);
+			}
+			if (wr) {
+				atomic_add(&r->nwaiters, -1);
+				wr->res = events;
+				wr->complete(wr);
+			}
+		}
+	} while (n == REACTOR_MAX_EVENTS);
+}
+
+void reactor_idle(int vcoreid)
+{
+	if (reactors == NULL)
+		return;
+	struct reactor *r = &reactors[vcoreid];
+	if (!r->initialized || r->disabled || atomic_read(&r->nwaiters) == 0)
+		return;
+	/* Our epoll fd stays readable as long as anything in the set is ready,
+	 * including whatever became ready since we last polled. */
+	r->watching = true;
+	event_watch_fd(&r->watch);
+}
+
+void reactor_forget(int fd)
+{
+	struct reactor_fd *e = __get_fd(fd, false);
+	if (e == NULL)
+		return;
+
+	spin_pdr_lock(&e->lock);
+	int owner = e->vcoreid;
+	if (owner >= 0)
+		epoll_ctl(reactors[owner].epfd, EPOLL_CTL_DEL, fd, NULL);
+	struct io_request *rd = e->rd, *wr = e->wr;
+	if (rd)
+		__untime(&reactors[owner], rd);
+	if (wr)
+		__untime(&reactors[owner], wr);
+	e->vcoreid = REACTOR_FD_UNREGISTERED;
+	e->rd = e->wr = NULL;
+	e->rd_ready = e->wr_ready = false;
+	spin_pdr_unlock(&e->lock);
+
+	/* Anybody still waiting on the fd would never hear from it again.  Wake
+	 * them up, so they retry their call and find out it is gone. */
+	if (rd) {
+		atomic_add(&reactors[owner].nwaiters, -1);
+		rd->res = -EBADF;
+		rd->complete(rd);
+	}
+	if (wr) {
+		atomic_add(&reactors[owner].nwaiters, -1);
+		wr->res = -EBADF;
+		wr->complete(wr);
+	}
+}
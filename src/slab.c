@@ -6,27 +6,69 @@
  *
  * Slab allocator, based on the SunOS 5.4 allocator paper.
  *
- * Note that we don't have a hash table for buf to bufctl for the large buffer
- * objects, so we use the same style for small objects: store the pointer to the
- * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
+ * Every object is followed by a pointer-sized word: for free small objects it
+ * links to the next free object, and for large objects it points back to the
+ * slab the object belongs to, so we never need a hash table to get from a
+ * buffer to its slab.
  *
  * Ported directly from the Akaros kernel's slab allocator. */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "internal/parlib.h"
+#include "internal/topology.h"
 #include <sys/mman.h>
 #include "slab.h"
+#include "uthread.h"
+#include "vcore.h"
 
 struct slab_cache_list slab_caches;
 spin_pdr_lock_t slab_caches_lock;
 
-/* Backend/internal functions, defined later.  Grab the lock before calling
- * these. */
+/* Backend/internal functions, defined later.  Call slab_cache_grow() without
+ * holding the cache lock. */
 static void slab_cache_grow(struct slab_cache *cp);
+static void __vcore_cache_flush(struct slab_cache *cp,
+                                struct slab_vcore_cache *vc);
+static void __depot_drain(struct slab_cache *cp);
 
 /* Cache of the slab_cache objects, needed for bootstrapping */
 struct slab_cache slab_cache_cache;
-struct slab_cache *slab_cache, *slab_bufctl_cache;
+
+/* Default growth policy, see slab_cache_set_grow_policy() */
+#define SLAB_GROW_MIN_DEFAULT 1
+#define SLAB_GROW_MAX_DEFAULT 16
+
+/* Magazine size requested through PARLIB_SLAB_MAGAZINE_SIZE, or -1 to pick one
+ * based on the object size of each cache. */
+static int slab_magazine_size = -1;
+
+static int __default_magazine_size(size_t obj_size)
+{
+	if (slab_magazine_size >= 0)
+		return slab_magazine_size;
+	if (obj_size <= 256)
+		return 32;
+	if (obj_size <= SLAB_LARGE_CUTOFF)
+		return 16;
+	return 8;
+}
+
+/* Same as spin_pdr_lock(), but accounts for the time spent spinning on one of
+ * cp's locks in its statistics. */
+static void __slab_lock(struct slab_cache *cp, spin_pdr_lock_t *lock)
+{
+	if (!in_vcore_context() && current_uthread)
+		uth_disable_notifs();
+	unsigned long spins = 0;
+	while (spinlock_trylock((spinlock_t*)lock)) {
+		cpu_relax();
+		spins++;
+	}
+	if (spins)
+		atomic_add(&cp->lock_spins, spins);
+}
 
 static void __slab_cache_create(struct slab_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -46,7 +88,28 @@ static void __slab_cache_create(struct slab_cache *kc, const char *name,
 	kc->ctor = ctor;
 	kc->dtor = dtor;
 	kc->nr_cur_alloc = 0;
-	
+	kc->node_caches = NULL;
+	kc->node = -1;
+	kc->mag_size = __default_magazine_size(obj_size);
+	kc->vcore_caches = NULL;
+	spin_pdr_init(&kc->depot_lock);
+	SLIST_INIT(&kc->depot_full);
+	SLIST_INIT(&kc->depot_empty);
+	kc->reap_gen = 0;
+	kc->grow_min = SLAB_GROW_MIN_DEFAULT;
+	kc->grow_max = SLAB_GROW_MAX_DEFAULT;
+	kc->grow_next = kc->grow_min;
+	kc->allocs = 0;
+	kc->frees = 0;
+	kc->grows = 0;
+	kc->reaps = 0;
+	kc->lock_spins = 0;
+	kc->max_alloc = 0;
+	kc->bytes_mapped = 0;
+}
+
+static void __slab_cache_link(struct slab_cache *kc)
+{
 	/* put in cache list based on it's size */
 	struct slab_cache *i, *prev = NULL;
 	spin_pdr_lock(&slab_caches_lock);
@@ -66,6 +129,9 @@ static void __slab_cache_create(struct slab_cache *kc, const char *name,
 
 void slab_cache_init(void)
 {
+	char *mag_size = getenv("PARLIB_SLAB_MAGAZINE_SIZE");
+	if (mag_size != NULL)
+		slab_magazine_size = atoi(mag_size);
 	spin_pdr_init(&slab_caches_lock);
 	SLIST_INIT(&slab_caches);
 	/* We need to call the __ version directly to bootstrap the global
@@ -73,12 +139,7 @@ void slab_cache_init(void)
 	__slab_cache_create(&slab_cache_cache, "slab_cache",
 	                    sizeof(struct slab_cache),
 	                    __alignof__(struct slab_cache), 0, NULL, NULL);
-	/* Build the slab and bufctl caches */
-	slab_cache = slab_cache_create("slab", sizeof(struct slab),
-	                       __alignof__(struct slab), 0, NULL, NULL); 
-	slab_bufctl_cache = slab_cache_create("slab_bufctl",
-	                         sizeof(struct slab_bufctl),
-	                         __alignof__(struct slab_bufctl), 0, NULL, NULL); 
+	__slab_cache_link(&slab_cache_cache);
 }
 
 /* Cache management */
@@ -95,6 +156,7 @@ struct slab_cache *slab_cache_create(const char *name, size_t obj_size,
 
 	struct slab_cache *kc = slab_cache_alloc(&slab_cache_cache, 0);
 	__slab_cache_create(kc, name, obj_size, align, flags, ctor, dtor);
+	__slab_cache_link(kc);
 	return kc;
 }
 
@@ -110,33 +172,36 @@ static void slab_destroy(struct slab_cache *cp, struct slab *a_slab)
 			}
 		}
 		munmap(ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		cp->bytes_mapped -= PGSIZE;
 	} else {
-		struct slab_bufctl *i;
-		void *page_start = (void*)-1;
-		// compute how many pages are allocated, given a power of two allocator
-		size_t num_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
-		                           PGSIZE;
-		TAILQ_FOREACH(i, &a_slab->bufctl_freelist, link) {
-			// Track the lowest buffer address, which is the start of the buffer
-			page_start = MIN(page_start, i->buf_addr);
-			/* Deconstruct all the objects, if necessary */
-			if (cp->dtor) // TODO: (BUF)
-				cp->dtor(i->buf_addr, cp->obj_size);
-			slab_cache_free(slab_bufctl_cache, i);
+		/* Deconstruct all the objects, if necessary */
+		if (cp->dtor) {
+			void *buf = a_slab->base;
+			for (int i = 0; i < a_slab->num_total_obj; i++) {
+				cp->dtor(buf, cp->obj_size);
+				buf += a_slab->obj_size;
+			}
 		}
-		// free the pages for the slab's buffer
-		munmap(page_start, num_pgs * PGSIZE);
-		// free the slab object
-		slab_cache_free(slab_cache, a_slab);
+		// free the pages for the slab, which include the slab struct itself
+		cp->bytes_mapped -= a_slab->size;
+		munmap(a_slab->base, a_slab->size);
 	}
 }
 
-/* Once you call destroy, never use this cache again... o/w there may be weird
- * races, and other serious issues.  */
-void slab_cache_destroy(struct slab_cache *cp)
+static void __slab_cache_destroy(struct slab_cache *cp)
 {
 	struct slab *a_slab, *next;
 
+	/* Nobody is using the cache anymore, so we can take the magazines away from
+	 * every vcore directly. */
+	if (cp->vcore_caches) {
+		for (int i = 0; i < vcore_capacity(); i++)
+			__vcore_cache_flush(cp, &cp->vcore_caches[i]);
+		free(cp->vcore_caches);
+		cp->vcore_caches = NULL;
+	}
+	__depot_drain(cp);
+
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -149,25 +214,35 @@ void slab_cache_destroy(struct slab_cache *cp)
 		slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
+	slab_cache_free(&slab_cache_cache, cp); 
+	spin_pdr_unlock(&cp->cache_lock);
+}
+
+/* Once you call destroy, never use this cache again... o/w there may be weird
+ * races, and other serious issues.  */
+void slab_cache_destroy(struct slab_cache *cp)
+{
 	spin_pdr_lock(&slab_caches_lock);
 	SLIST_REMOVE(&slab_caches, cp, slab_cache, link);
 	spin_pdr_unlock(&slab_caches_lock);
-	slab_cache_free(&slab_cache_cache, cp); 
-	spin_pdr_unlock(&cp->cache_lock);
+
+	if (cp->node_caches) {
+		for (int i = 0; i < topology_nr_nodes(); i++)
+			__slab_cache_destroy(cp->node_caches[i]);
+		free(cp->node_caches);
+	}
+	__slab_cache_destroy(cp);
 }
 
-/* Front end: clients of caches use these */
-void *slab_cache_alloc(struct slab_cache *cp, int flags)
+/* Slab layer.  Grab the cache lock before calling these. */
+static void *__slab_alloc(struct slab_cache *cp)
 {
 	void *retval = NULL;
-	spin_pdr_lock(&cp->cache_lock);
 	// look at partial list
 	struct slab *a_slab = TAILQ_FIRST(&cp->partial_slab_list);
-	// 	if none, go to empty list and get an empty and make it partial
+	// 	if none, go to empty list and get an empty and make it partial.  The
+	// 	caller made sure there is one.
 	if (!a_slab) {
-		if (TAILQ_EMPTY(&cp->empty_slab_list))
-			// TODO: think about non-sleeping flags
-			slab_cache_grow(cp);
 		// move to partial list
 		a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
@@ -181,10 +256,9 @@ void *slab_cache_alloc(struct slab_cache *cp, int flags)
 		a_slab->free_small_obj = *(uintptr_t**)(a_slab->free_small_obj +
 		                                        cp->obj_size);
 	} else {
-		// rip the first bufctl out of the partial slab's buf list
-		struct slab_bufctl *a_bufctl = TAILQ_FIRST(&a_slab->bufctl_freelist);
-		TAILQ_REMOVE(&a_slab->bufctl_freelist, a_bufctl, link);
-		retval = a_bufctl->buf_addr;
+		// pop the index of a free object off the slab's free stack
+		size_t top = a_slab->num_total_obj - a_slab->num_busy_obj - 1;
+		retval = a_slab->base + a_slab->free_idx[top] * a_slab->obj_size;
 	}
 	a_slab->num_busy_obj++;
 	// Check if we are full, if so, move to the full list
@@ -193,36 +267,31 @@ void *slab_cache_alloc(struct slab_cache *cp, int flags)
 		TAILQ_INSERT_HEAD(&cp->full_slab_list, a_slab, link);
 	}
 	cp->nr_cur_alloc++;
-	spin_pdr_unlock(&cp->cache_lock);
+	cp->max_alloc = MAX(cp->max_alloc, cp->nr_cur_alloc);
 	return retval;
 }
 
-static inline struct slab_bufctl *buf2bufctl(void *buf, size_t offset)
+static inline struct slab *buf2slab(struct slab_cache *cp, void *buf)
 {
-	// TODO: hash table for back reference (BUF)
-	return *((struct slab_bufctl**)(buf + offset));
+	if (cp->obj_size <= SLAB_LARGE_CUTOFF)
+		return (struct slab*)(ROUNDDOWN(buf, PGSIZE) + PGSIZE -
+		                      sizeof(struct slab));
+	return *((struct slab**)(buf + cp->obj_size));
 }
 
-void slab_cache_free(struct slab_cache *cp, void *buf)
+static void __slab_free(struct slab_cache *cp, void *buf)
 {
-	struct slab *a_slab;
-	struct slab_bufctl *a_bufctl;
+	struct slab *a_slab = buf2slab(cp, buf);
 
-	spin_pdr_lock(&cp->cache_lock);
 	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
-		// find its slab
-		a_slab = (struct slab*)(ROUNDDOWN(buf, PGSIZE) + PGSIZE -
-		                             sizeof(struct slab));
 		/* write location of next free small obj to the space at the end of the
 		 * buffer, then list buf as the next free small obj */
 		*(uintptr_t**)(buf + cp->obj_size) = a_slab->free_small_obj;
 		a_slab->free_small_obj = buf;
 	} else {
-		/* Give the bufctl back to the parent slab */
-		// TODO: (BUF) change the interface to not take an offset
-		a_bufctl = buf2bufctl(buf, cp->obj_size);
-		a_slab = a_bufctl->my_slab;
-		TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
+		/* Push the object's index back onto its slab's free stack */
+		size_t top = a_slab->num_total_obj - a_slab->num_busy_obj;
+		a_slab->free_idx[top] = (buf - a_slab->base) / a_slab->obj_size;
 	}
 	a_slab->num_busy_obj--;
 	cp->nr_cur_alloc--;
@@ -235,101 +304,536 @@ void slab_cache_free(struct slab_cache *cp, void *buf)
 		TAILQ_REMOVE(&cp->partial_slab_list, a_slab, link);
 		TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
 	}
+}
+
+/* Magazine layer */
+
+/* Returns the id of the vcore whose magazines we may use, or -1 if we are
+ * neither a vcore nor a uthread and have to go to the slab layer directly.
+ * Uthreads keep notifs disabled while they use the magazines, so they can't
+ * be moved off of the vcore under our feet. */
+static inline int __mag_enter(void)
+{
+	if (in_vcore_context())
+		return vcore_id();
+	if (current_uthread == NULL)
+		return -1;
+	uth_disable_notifs();
+	return vcore_id();
+}
+
+static inline void __mag_exit(int vcoreid)
+{
+	if (vcoreid >= 0 && !in_vcore_context())
+		uth_enable_notifs();
+}
+
+static struct slab_magazine *__mag_create(int size)
+{
+	struct slab_magazine *mag = parlib_malloc(sizeof(struct slab_magazine) +
+	                                          size * sizeof(void*));
+	mag->size = size;
+	mag->rounds = 0;
+	return mag;
+}
+
+/* Hands all the objects in mag back to the slab layer.  Grab the cache lock
+ * before calling this. */
+static void __mag_empty(struct slab_cache *cp, struct slab_magazine *mag)
+{
+	while (mag->rounds > 0)
+		__slab_free(cp, mag->objs[--mag->rounds]);
+}
+
+static struct slab_vcore_cache *__vcore_cache(struct slab_cache *cp,
+                                              int vcoreid)
+{
+	struct slab_vcore_cache *vcs = cp->vcore_caches;
+	if (vcs == NULL) {
+		size_t size = sizeof(struct slab_vcore_cache) * vcore_capacity();
+		vcs = parlib_aligned_alloc(ARCH_CL_SIZE, size);
+		memset(vcs, 0, size);
+		if (!atomic_cas((atomic_t*)&cp->vcore_caches, 0, (long)vcs)) {
+			free(vcs);
+			vcs = cp->vcore_caches;
+		}
+	}
+	return &vcs[vcoreid];
+}
+
+/* Gives the magazines loaded in vc back, along with their objects. */
+static void __vcore_cache_flush(struct slab_cache *cp,
+                                struct slab_vcore_cache *vc)
+{
+	struct slab_magazine *mags[2] = { vc->loaded, vc->prev };
+	vc->loaded = vc->prev = NULL;
+	vc->reap_gen = cp->reap_gen;
+
+	spin_pdr_lock(&cp->cache_lock);
+	for (int i = 0; i < 2; i++)
+		if (mags[i])
+			__mag_empty(cp, mags[i]);
+	spin_pdr_unlock(&cp->cache_lock);
+	for (int i = 0; i < 2; i++)
+		free(mags[i]);
+}
+
+/* Bonwick's allocation path.  'prev' is always either full or empty, so when
+ * 'loaded' runs dry we either swap in a full 'prev', or trade our empty 'prev'
+ * for a full magazine from the depot. */
+static void *__mag_alloc(struct slab_cache *cp, struct slab_vcore_cache *vc)
+{
+	if (vc->reap_gen != cp->reap_gen)
+		__vcore_cache_flush(cp, vc);
+
+	if (vc->loaded && vc->loaded->rounds > 0)
+		return vc->loaded->objs[--vc->loaded->rounds];
+	if (vc->prev && vc->prev->rounds > 0) {
+		struct slab_magazine *tmp = vc->loaded;
+		vc->loaded = vc->prev;
+		vc->prev = tmp;
+		return vc->loaded->objs[--vc->loaded->rounds];
+	}
+
+	if (SLIST_EMPTY(&cp->depot_full))
+		return NULL;
+	__slab_lock(cp, &cp->depot_lock);
+	struct slab_magazine *full = SLIST_FIRST(&cp->depot_full);
+	if (full) {
+		SLIST_REMOVE_HEAD(&cp->depot_full, link);
+		if (vc->prev)
+			SLIST_INSERT_HEAD(&cp->depot_empty, vc->prev, link);
+		vc->prev = vc->loaded;
+		vc->loaded = full;
+	}
+	spin_pdr_unlock(&cp->depot_lock);
+	if (full == NULL)
+		return NULL;
+	return vc->loaded->objs[--vc->loaded->rounds];
+}
+
+/* Bonwick's free path, the mirror image of __mag_alloc(). */
+static bool __mag_free(struct slab_cache *cp, struct slab_vcore_cache *vc,
+                       void *buf)
+{
+	if (vc->reap_gen != cp->reap_gen)
+		__vcore_cache_flush(cp, vc);
+
+	if (vc->loaded && vc->loaded->rounds < vc->loaded->size) {
+		vc->loaded->objs[vc->loaded->rounds++] = buf;
+		return true;
+	}
+	if (vc->prev && vc->prev->rounds == 0) {
+		struct slab_magazine *tmp = vc->loaded;
+		vc->loaded = vc->prev;
+		vc->prev = tmp;
+		vc->loaded->objs[vc->loaded->rounds++] = buf;
+		return true;
+	}
+
+	if (cp->mag_size == 0)
+		return false;
+	__slab_lock(cp, &cp->depot_lock);
+	struct slab_magazine *empty = SLIST_FIRST(&cp->depot_empty);
+	if (empty)
+		SLIST_REMOVE_HEAD(&cp->depot_empty, link);
+	spin_pdr_unlock(&cp->depot_lock);
+	if (empty == NULL || empty->size != cp->mag_size) {
+		free(empty);
+		if (cp->mag_size == 0)
+			return false;
+		empty = __mag_create(cp->mag_size);
+	}
+
+	if (vc->prev) {
+		__slab_lock(cp, &cp->depot_lock);
+		if (vc->prev->rounds)
+			SLIST_INSERT_HEAD(&cp->depot_full, vc->prev, link);
+		else
+			SLIST_INSERT_HEAD(&cp->depot_empty, vc->prev, link);
+		spin_pdr_unlock(&cp->depot_lock);
+	}
+	vc->prev = vc->loaded;
+	vc->loaded = empty;
+	vc->loaded->objs[vc->loaded->rounds++] = buf;
+	return true;
+}
+
+/* Drains every magazine in the depot back into the slab layer. */
+static void __depot_drain(struct slab_cache *cp)
+{
+	struct slab_magazine_list full, empty;
+	struct slab_magazine *mag;
+
+	spin_pdr_lock(&cp->depot_lock);
+	full = cp->depot_full;
+	empty = cp->depot_empty;
+	SLIST_INIT(&cp->depot_full);
+	SLIST_INIT(&cp->depot_empty);
+	spin_pdr_unlock(&cp->depot_lock);
+
+	spin_pdr_lock(&cp->cache_lock);
+	SLIST_FOREACH(mag, &full, link)
+		__mag_empty(cp, mag);
+	spin_pdr_unlock(&cp->cache_lock);
+
+	while ((mag = SLIST_FIRST(&full))) {
+		SLIST_REMOVE_HEAD(&full, link);
+		free(mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		free(mag);
+	}
+}
+
+void slab_cache_set_grow_policy(struct slab_cache *cp, int min_slabs,
+                                int max_slabs)
+{
+	if (cp->node_caches)
+		for (int i = 0; i < topology_nr_nodes(); i++)
+			slab_cache_set_grow_policy(cp->node_caches[i], min_slabs,
+			                           max_slabs);
+	spin_pdr_lock(&cp->cache_lock);
+	cp->grow_min = MAX(min_slabs, 1);
+	cp->grow_max = MAX(max_slabs, cp->grow_min);
+	cp->grow_next = cp->grow_min;
+	spin_pdr_unlock(&cp->cache_lock);
+}
+
+void slab_cache_set_magazine_size(struct slab_cache *cp, int size)
+{
+	/* Magazines already in circulation keep their size until they are
+	 * drained; the depot drops empty ones of the wrong size. */
+	if (cp->node_caches)
+		for (int i = 0; i < topology_nr_nodes(); i++)
+			slab_cache_set_magazine_size(cp->node_caches[i], size);
+	cp->mag_size = MAX(size, 0);
+}
+
+/* The caches of the nodes of a SLAB_NODE_LOCAL cache, or NULL while there is
+ * only one node as far as we know.  Caches usually get created before the
+ * vcores, and with them the topology, so they are only set up the first time
+ * cp gets used afterwards, with the policies cp has by then.  They stay off
+ * the list: they are only ever seen through cp. */
+static struct slab_cache **__node_caches(struct slab_cache *cp)
+{
+	if (cp->node_caches || !(cp->flags & SLAB_NODE_LOCAL))
+		return cp->node_caches;
+	int nr_nodes = topology_nr_nodes();
+	if (nr_nodes <= 1)
+		return NULL;
+
+	struct slab_cache **ncs = parlib_malloc(nr_nodes * sizeof(*ncs));
+	for (int i = 0; i < nr_nodes; i++) {
+		struct slab_cache *nc = slab_cache_alloc(&slab_cache_cache, 0);
+		__slab_cache_create(nc, cp->name, cp->obj_size, cp->align,
+		                    cp->flags & ~SLAB_NODE_LOCAL, cp->ctor, cp->dtor);
+		nc->node = i;
+		slab_cache_set_grow_policy(nc, cp->grow_min, cp->grow_max);
+		slab_cache_set_magazine_size(nc, cp->mag_size);
+		ncs[i] = nc;
+	}
+	if (!atomic_cas((atomic_t*)&cp->node_caches, 0, (long)ncs)) {
+		for (int i = 0; i < nr_nodes; i++)
+			__slab_cache_destroy(ncs[i]);
+		free(ncs);
+	}
+	return cp->node_caches;
+}
+
+/* The cache of the node we are running on.  A uthread may be on another node
+ * by the time it uses the object, which is fine: this is only about where
+ * things usually are. */
+static struct slab_cache *__node_cache(struct slab_cache *cp)
+{
+	int vcoreid = in_vcore_context() || current_uthread ? vcore_id() : 0;
+	return cp->node_caches[vcore_node(vcoreid)];
+}
+
+/* Front end: clients of caches use these */
+void *slab_cache_alloc(struct slab_cache *cp, int flags)
+{
+	void *retval = NULL;
+	if (__node_caches(cp))
+		cp = __node_cache(cp);
+	int vcoreid = __mag_enter();
+	if (vcoreid >= 0) {
+		struct slab_vcore_cache *vc = __vcore_cache(cp, vcoreid);
+		vc->allocs++;
+		retval = __mag_alloc(cp, vc);
+	}
+	__mag_exit(vcoreid);
+	if (retval)
+		return retval;
+
+	__slab_lock(cp, &cp->cache_lock);
+	if (vcoreid < 0)
+		cp->allocs++;
+	while (TAILQ_EMPTY(&cp->partial_slab_list) &&
+	       TAILQ_EMPTY(&cp->empty_slab_list)) {
+		/* Don't stall everybody else while we map and construct more. */
+		spin_pdr_unlock(&cp->cache_lock);
+		slab_cache_grow(cp);
+		__slab_lock(cp, &cp->cache_lock);
+	}
+	retval = __slab_alloc(cp);
+	spin_pdr_unlock(&cp->cache_lock);
+	return retval;
+}
+
+void slab_cache_free(struct slab_cache *cp, void *buf)
+{
+	bool done = false;
+	/* Objects handed out before cp had caches of its own came from cp. */
+	if (cp->node_caches && buf2slab(cp, buf)->node >= 0)
+		cp = cp->node_caches[buf2slab(cp, buf)->node];
+	int vcoreid = __mag_enter();
+	if (vcoreid >= 0) {
+		struct slab_vcore_cache *vc = __vcore_cache(cp, vcoreid);
+		vc->frees++;
+		done = __mag_free(cp, vc, buf);
+	}
+	__mag_exit(vcoreid);
+	if (done)
+		return;
+
+	__slab_lock(cp, &cp->cache_lock);
+	if (vcoreid < 0)
+		cp->frees++;
+	__slab_free(cp, buf);
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
 /* Back end: internal functions */
-/* When this returns, the cache has at least one slab in the empty list.  If
- * page_alloc fails, there are some serious issues.  This only grows by one slab
- * at a time.
+
+/* Size of the memory backing a single slab of the cache.  Large slabs hold at
+ * least NUM_BUF_PER_SLAB objects, plus the slab struct and free index stack at
+ * the end. */
+static size_t __slab_size(struct slab_cache *cp)
+{
+	if (cp->obj_size <= SLAB_LARGE_CUTOFF)
+		return PGSIZE;
+	size_t obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+	return ROUNDUP(NUM_BUF_PER_SLAB * (obj_size + sizeof(uint32_t)) +
+	               sizeof(struct slab), PGSIZE);
+}
+
+static struct slab *__slab_init_small(struct slab_cache *cp, void *a_page)
+{
+	// the slab struct is stored at the end of the page
+	struct slab *a_slab = (struct slab*)(a_page + PGSIZE -
+	                                     sizeof(struct slab));
+	// Need to add room for the next free item pointer in the object buffer.
+	a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+	a_slab->num_busy_obj = 0;
+	a_slab->num_total_obj = (PGSIZE - sizeof(struct slab)) /
+	                        a_slab->obj_size;
+	// TODO: consider staggering this IAW section 4.3
+	a_slab->free_small_obj = a_page;
+	/* Walk and create the free list, which is circular.  Each item stores
+	 * the location of the next one at the end of the block. */
+	void *buf = a_slab->free_small_obj;
+	for (int i = 0; i < a_slab->num_total_obj - 1; i++) {
+		// Initialize the object, if necessary
+		if (cp->ctor)
+			cp->ctor(buf, cp->obj_size);
+		*(uintptr_t**)(buf + cp->obj_size) = buf + a_slab->obj_size;
+		buf += a_slab->obj_size;
+	}
+	*((uintptr_t**)(buf + cp->obj_size)) = NULL;
+	return a_slab;
+}
+
+static struct slab *__slab_init_large(struct slab_cache *cp, void *base,
+                                      size_t size)
+{
+	size_t obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
+	size_t num_obj = (size - sizeof(struct slab)) /
+	                 (obj_size + sizeof(uint32_t));
+	// the slab struct and its free index stack are stored at the end
+	struct slab *a_slab = (struct slab*)(base + size - sizeof(struct slab));
+	a_slab->obj_size = obj_size;
+	a_slab->num_busy_obj = 0;
+	a_slab->num_total_obj = num_obj;
+	a_slab->base = base;
+	a_slab->size = size;
+	a_slab->free_idx = (uint32_t*)a_slab - num_obj;
+	void *buf = base;
+	for (int i = 0; i < num_obj; i++) {
+		// Initialize the object, if necessary
+		if (cp->ctor)
+			cp->ctor(buf, cp->obj_size);
+		*(struct slab**)(buf + cp->obj_size) = a_slab;
+		a_slab->free_idx[i] = num_obj - 1 - i;
+		buf += obj_size;
+	}
+	return a_slab;
+}
+
+/* When this returns, the cache has had at least one slab added to its empty
+ * list.  If mmap fails, there are some serious issues.  All slabs of a single
+ * grow come out of one mapping, which is set up and constructed without the
+ * cache lock held, so other vcores keep allocating and freeing meanwhile.
+ * Several vcores may end up growing the cache at the same time; the extra
+ * slabs just sit in the empty list until they are used or reaped.
  *
- * Grab the cache lock before calling this.
+ * The pages are touched right away, by the vcore that needs them, so they end
+ * up on its node.  The caches of SLAB_NODE_LOCAL bind theirs to their own node
+ * first, since anybody may be the one growing them.
  *
  * TODO: think about page colouring issues with kernel memory allocation. */
 static void slab_cache_grow(struct slab_cache *cp)
 {
-	struct slab *a_slab;
-	struct slab_bufctl *a_bufctl;
-	void *a_page;
-	if (cp->obj_size <= SLAB_LARGE_CUTOFF) {
-		// Just get a single page for small slabs
-		a_page = mmap(0, PGSIZE, PROT_READ | PROT_WRITE,
-		              MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
-		assert(a_page != MAP_FAILED);
-		// the slab struct is stored at the end of the page
-		a_slab = (struct slab*)(a_page + PGSIZE -
-		                             sizeof(struct slab));
-		// Need to add room for the next free item pointer in the object buffer.
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
-		a_slab->num_busy_obj = 0;
-		a_slab->num_total_obj = (PGSIZE - sizeof(struct slab)) /
-		                        a_slab->obj_size;
-		// TODO: consider staggering this IAW section 4.3
-		a_slab->free_small_obj = a_page;
-		/* Walk and create the free list, which is circular.  Each item stores
-		 * the location of the next one at the end of the block. */
-		void *buf = a_slab->free_small_obj;
-		for (int i = 0; i < a_slab->num_total_obj - 1; i++) {
-			// Initialize the object, if necessary
-			if (cp->ctor)
-				cp->ctor(buf, cp->obj_size);
-			*(uintptr_t**)(buf + cp->obj_size) = buf + a_slab->obj_size;
-			buf += a_slab->obj_size;
-		}
-		*((uintptr_t**)(buf + cp->obj_size)) = NULL;
-	} else {
-		a_slab = slab_cache_alloc(slab_cache, 0);
-		// TODO: hash table for back reference (BUF)
-		a_slab->obj_size = ROUNDUP(cp->obj_size + sizeof(uintptr_t), cp->align);
-		// alloc n pages, such that it can hold at least 8 items
-		size_t num_pgs = ROUNDUP(NUM_BUF_PER_SLAB * a_slab->obj_size, PGSIZE) /
-		                           PGSIZE;
-		// round up for the contiguous page allocator
-		void *buf = mmap(0, num_pgs * PGSIZE, PROT_READ | PROT_WRITE,
-		                 MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
-		assert(buf != MAP_FAILED);
-		a_slab->num_busy_obj = 0;
-		a_slab->num_total_obj = (num_pgs)*PGSIZE / a_slab->obj_size;
-		TAILQ_INIT(&a_slab->bufctl_freelist);
-		/* for each buffer, set up a bufctl and point to the buffer */
-		for (int i = 0; i < a_slab->num_total_obj; i++) {
-			// Initialize the object, if necessary
-			if (cp->ctor)
-				cp->ctor(buf, cp->obj_size);
-			a_bufctl = slab_cache_alloc(slab_bufctl_cache, 0);	
-			TAILQ_INSERT_HEAD(&a_slab->bufctl_freelist, a_bufctl, link);
-			a_bufctl->buf_addr = buf;
-			a_bufctl->my_slab = a_slab;
-			// TODO: (BUF) write the bufctl reference at the bottom of the buffer.
-			*(struct slab_bufctl**)(buf + cp->obj_size) = a_bufctl;
-			buf += a_slab->obj_size;
-		}
+	struct slab_list new_slabs = TAILQ_HEAD_INITIALIZER(new_slabs);
+	int num_slabs = cp->grow_next;
+	size_t slab_size = __slab_size(cp);
+	int populate = cp->node < 0 ? MAP_POPULATE : 0;
+	void *mem = mmap(0, num_slabs * slab_size, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | populate | MAP_ANONYMOUS, -1, 0);
+	assert(mem != MAP_FAILED);
+	if (cp->node >= 0)
+		topology_bind(mem, num_slabs * slab_size, cp->node);
+
+	for (int i = 0; i < num_slabs; i++) {
+		void *base = mem + i * slab_size;
+		struct slab *a_slab;
+		if (cp->obj_size <= SLAB_LARGE_CUTOFF)
+			a_slab = __slab_init_small(cp, base);
+		else
+			a_slab = __slab_init_large(cp, base, slab_size);
+		a_slab->node = cp->node;
+		TAILQ_INSERT_TAIL(&new_slabs, a_slab, link);
 	}
-	// add a_slab to the empty_list
-	TAILQ_INSERT_HEAD(&cp->empty_slab_list, a_slab, link);
+
+	// add the new slabs to the empty_list, and grow faster next time
+	__slab_lock(cp, &cp->cache_lock);
+	TAILQ_CONCAT(&cp->empty_slab_list, &new_slabs, link);
+	cp->grow_next = MIN(num_slabs * 2, cp->grow_max);
+	cp->grows++;
+	cp->bytes_mapped += num_slabs * slab_size;
+	spin_pdr_unlock(&cp->cache_lock);
 }
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
+ * thrashing.  See 3.4 in the paper.
+ *
+ * Magazines in the depot, and those of the calling vcore, are drained first.
+ * Other vcores hand their magazines back the next time they use the cache, so
+ * slabs whose objects are sitting in those only get freed by a later reap. */
 void slab_cache_reap(struct slab_cache *cp)
 {
 	struct slab *a_slab, *next;
+
+	if (cp->node_caches)
+		for (int i = 0; i < topology_nr_nodes(); i++)
+			slab_cache_reap(cp->node_caches[i]);
+	atomic_add(&cp->reap_gen, 1);
+	if (cp->vcore_caches) {
+		int vcoreid = __mag_enter();
+		if (vcoreid >= 0)
+			__vcore_cache_flush(cp, &cp->vcore_caches[vcoreid]);
+		__mag_exit(vcoreid);
+	}
+	__depot_drain(cp);
 	
 	// Destroy all empty slabs.  Refer to the notes about the while loop
-	spin_pdr_lock(&cp->cache_lock);
+	__slab_lock(cp, &cp->cache_lock);
+	/* The node caches count this reap themselves, see struct slab_stats. */
+	if (!cp->node_caches)
+		cp->reaps++;
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
 		slab_destroy(cp, a_slab);
 		a_slab = next;
 	}
+	TAILQ_INIT(&cp->empty_slab_list);
+	cp->grow_next = cp->grow_min;
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
-void EXPORT_SYMBOL print_slab_cache(struct slab_cache *cp)
+void slab_cache_stats(struct slab_cache *cp, struct slab_stats *stats)
 {
+	struct slab *a_slab;
+	struct slab_magazine *mag;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->name = cp->name;
+	stats->obj_size = cp->obj_size;
+
+	/* Per-vcore counters and magazines are read without stopping anybody. */
+	struct slab_vcore_cache *vcs = cp->vcore_caches;
+	if (vcs != NULL) {
+		for (int i = 0; i < vcore_capacity(); i++) {
+			struct slab_vcore_cache *vc = &vcs[i];
+			stats->allocs += vc->allocs;
+			stats->frees += vc->frees;
+			if ((mag = vc->loaded))
+				stats->magazine_objs += mag->rounds;
+			if ((mag = vc->prev))
+				stats->magazine_objs += mag->rounds;
+		}
+	}
+
+	spin_pdr_lock(&cp->depot_lock);
+	SLIST_FOREACH(mag, &cp->depot_full, link)
+		stats->magazine_objs += mag->rounds;
+	spin_pdr_unlock(&cp->depot_lock);
+
 	spin_pdr_lock(&cp->cache_lock);
+	stats->allocs += cp->allocs;
+	stats->frees += cp->frees;
+	stats->grows = cp->grows;
+	stats->reaps = cp->reaps;
+	stats->bytes_mapped = cp->bytes_mapped;
+	stats->cur_alloc = cp->nr_cur_alloc;
+	stats->max_alloc = cp->max_alloc;
+	TAILQ_FOREACH(a_slab, &cp->full_slab_list, link)
+		stats->nr_full_slabs++;
+	TAILQ_FOREACH(a_slab, &cp->partial_slab_list, link)
+		stats->nr_partial_slabs++;
+	TAILQ_FOREACH(a_slab, &cp->empty_slab_list, link)
+		stats->nr_empty_slabs++;
+	spin_pdr_unlock(&cp->cache_lock);
+	stats->lock_spins = cp->lock_spins;
+
+	if (cp->node_caches) {
+		for (int i = 0; i < topology_nr_nodes(); i++) {
+			struct slab_stats ns;
+			slab_cache_stats(cp->node_caches[i], &ns);
+			stats->allocs += ns.allocs;
+			stats->frees += ns.frees;
+			stats->grows += ns.grows;
+			stats->reaps += ns.reaps;
+			stats->lock_spins += ns.lock_spins;
+			stats->bytes_mapped += ns.bytes_mapped;
+			stats->cur_alloc += ns.cur_alloc;
+			stats->max_alloc += ns.max_alloc;
+			stats->magazine_objs += ns.magazine_objs;
+			stats->nr_full_slabs += ns.nr_full_slabs;
+			stats->nr_partial_slabs += ns.nr_partial_slabs;
+			stats->nr_empty_slabs += ns.nr_empty_slabs;
+		}
+	}
+}
+
+void slab_cache_foreach(void (*func)(struct slab_cache *cp, void *arg),
+                        void *arg)
+{
+	struct slab_cache *cp;
+	spin_pdr_lock(&slab_caches_lock);
+	SLIST_FOREACH(cp, &slab_caches, link)
+		func(cp, arg);
+	spin_pdr_unlock(&slab_caches_lock);
+}
+
+void EXPORT_SYMBOL print_slab_cache(struct slab_cache *cp)
+{
+	struct slab_stats stats;
+	slab_cache_stats(cp, &stats);
+
 	printf("\nPrinting slab_cache:\n---------------------\n");
 	printf("Name: %s\n", cp->name);
 	printf("Objsize: %zu\n", cp->obj_size);
@@ -337,11 +841,15 @@ void EXPORT_SYMBOL print_slab_cache(struct slab_cache *cp)
 	printf("Flags: 0x%08x\n", cp->flags);
 	printf("Constructor: %p\n", cp->ctor);
 	printf("Destructor: %p\n", cp->dtor);
-	printf("Slab Full: %p\n", &cp->full_slab_list);
-	printf("Slab Partial: %p\n", &cp->partial_slab_list);
-	printf("Slab Empty:%p\n", &cp->empty_slab_list);
-	printf("Current Allocations: %lu\n", cp->nr_cur_alloc);
-	spin_pdr_unlock(&cp->cache_lock);
+	printf("Slab Full: %lu\n", stats.nr_full_slabs);
+	printf("Slab Partial: %lu\n", stats.nr_partial_slabs);
+	printf("Slab Empty: %lu\n", stats.nr_empty_slabs);
+	printf("Current Allocations: %lu (max %lu, %lu in magazines)\n",
+	       stats.cur_alloc, stats.max_alloc, stats.magazine_objs);
+	printf("Allocs/Frees: %lu/%lu\n", stats.allocs, stats.frees);
+	printf("Grows/Reaps: %lu/%lu\n", stats.grows, stats.reaps);
+	printf("Lock Spins: %lu\n", stats.lock_spins);
+	printf("Bytes Mapped: %zu\n", stats.bytes_mapped);
 }
 
 void EXPORT_SYMBOL print_slab(struct slab *slab)
@@ -369,9 +877,17 @@ void EXPORT_SYMBOL print_slab(struct slab *slab)
 #undef slab_cache_free
 #undef slab_cache_init
 #undef slab_cache_reap
+#undef slab_cache_set_magazine_size
+#undef slab_cache_set_grow_policy
+#undef slab_cache_stats
+#undef slab_cache_foreach
 EXPORT_ALIAS(INTERNAL(slab_cache_create), slab_cache_create)
 EXPORT_ALIAS(INTERNAL(slab_cache_destroy), slab_cache_destroy)
 EXPORT_ALIAS(INTERNAL(slab_cache_alloc), slab_cache_alloc)
 EXPORT_ALIAS(INTERNAL(slab_cache_free), slab_cache_free)
 EXPORT_ALIAS(INTERNAL(slab_cache_init), slab_cache_init)
 EXPORT_ALIAS(INTERNAL(slab_cache_reap), slab_cache_reap)
+EXPORT_ALIAS(INTERNAL(slab_cache_set_magazine_size), slab_cache_set_magazine_size)
+EXPORT_ALIAS(INTERNAL(slab_cache_set_grow_policy), slab_cache_set_grow_policy)
+EXPORT_ALIAS(INTERNAL(slab_cache_stats), slab_cache_stats)
+EXPORT_ALIAS(INTERNAL(slab_cache_foreach), slab_cache_foreach)
@@ -10,14 +10,20 @@
  * size.  This list is sorted in order of size.  Each slab_cache has three
  * lists of slabs: full, partial, and empty.  
  *
- * For large objects, the slabs point to bufctls, which have the address
- * of their large buffers.  These slabs can consist of more than one contiguous
- * page.
+ * For large objects, the slab structure is stored at the end of the slab's
+ * memory too, followed by an array of the indexes of its free objects, which
+ * is used as a stack.  These slabs can consist of more than one contiguous
+ * page.  Every large object is followed by a pointer to its slab, so freeing
+ * one never needs to look anything up.
  *
- * For small objects, the slabs do not use the bufctls.  Instead, they point to
- * the next free object in the slab.  The free objects themselves hold the
- * address of the next free item.  The slab structure is stored at the end of
- * the page.  There is only one page per slab.
+ * For small objects, the slab structure is stored at the end of the page, and
+ * points to the next free object in the slab.  The free objects themselves
+ * hold the address of the next free item.  There is only one page per slab.
+ *
+ * Caches grow by several slabs at a time, all carved out of a single mapping
+ * that is set up (and whose objects are constructed) without holding the cache
+ * lock.  Each grow maps twice as many slabs as the one before, between the
+ * bounds set with slab_cache_set_grow_policy().
  *
  * TODO: Note, that this is a minor pain in the ass, and worth thinking about
  * before implementing.  To keep the constructor's state valid, we can't just
@@ -25,11 +31,19 @@
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
  *
+ * In front of the slabs sits a per-vcore magazine layer, as described in the
+ * follow-up paper on magazines and vmem (Bonwick and Adams, 2001).  Each vcore
+ * keeps two magazines (small stacks of constructed objects) per cache, which
+ * serve most allocations and frees without taking any lock.  Full and empty
+ * magazines are exchanged with a per-cache depot, and the slab lists are only
+ * consulted when the depot has nothing to offer either.
+ *
  * Ported directly from the Akaros kernel's slab allocator. */
 
 #ifndef PARLIB_SLAB_H
 #define PARLIB_SLAB_H
 
+#include <stdint.h>
 #include <sys/queue.h>
 #include "spinlock.h"
 #include "parlib.h"
@@ -40,36 +54,62 @@
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+/* Flags for slab_cache_create().
+ *
+ * SLAB_NODE_LOCAL: hand every vcore objects from memory on its own NUMA node.
+ * The cache gets a cache of its own per node behind the scenes, and objects
+ * freed on another node go back to the one they came from.  Only takes effect
+ * on machines with more than one node, once the vcores exist: objects handed
+ * out before that come from the cache itself. */
+#define SLAB_NODE_LOCAL 0x0001
+
 struct slab;
 typedef struct slab slab_t;
 
 typedef void (*slab_cache_ctor_t)(void *, size_t);
 typedef void (*slab_cache_dtor_t)(void *, size_t);
 
-/* Control block for buffers for large-object slabs */
-struct slab_bufctl {
-	TAILQ_ENTRY(slab_bufctl) link;
-	void *buf_addr;
-	struct slab *my_slab;
-};
-TAILQ_HEAD(slab_bufctl_list, slab_bufctl);
-
 /* Slabs contain the objects.  Can be either full, partial, or empty,
  * determined by checking the number of objects busy vs total.  For large
- * slabs, the bufctl list is used to find a free buffer.  For small, the void*
- * is used instead.*/
+ * slabs, the top (num_total_obj - num_busy_obj) entries of free_idx are the
+ * indexes of the free objects.  For small, the void* is used instead.*/
 struct slab {
 	TAILQ_ENTRY(slab) link;
 	size_t obj_size;
 	size_t num_busy_obj;
 	size_t num_total_obj;
+	int node;               /* that the slab's memory is bound to, or -1 */
 	union {
-		struct slab_bufctl_list bufctl_freelist;
+		struct {
+			void *base;
+			size_t size;
+			uint32_t *free_idx;
+		};
 		void *free_small_obj;
 	};
 };
 TAILQ_HEAD(slab_list, slab);
 
+/* A magazine is a stack of up to 'size' constructed objects. */
+struct slab_magazine {
+	SLIST_ENTRY(slab_magazine) link;
+	int size;
+	int rounds;
+	void *objs[];
+};
+SLIST_HEAD(slab_magazine_list, slab_magazine);
+
+/* The magazines a single vcore has loaded for a cache.  Only ever touched by
+ * the vcore itself (or by uthreads running on it, with notifs disabled). */
+struct slab_vcore_cache {
+	struct slab_magazine *loaded;
+	struct slab_magazine *prev;
+	unsigned long reap_gen;
+	/* Requests made to the cache from this vcore */
+	unsigned long allocs;
+	unsigned long frees;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /* Actual cache */
 typedef struct slab_cache {
 	SLIST_ENTRY(slab_cache) link;
@@ -84,8 +124,55 @@ typedef struct slab_cache {
 	slab_cache_ctor_t ctor;
 	slab_cache_dtor_t dtor;
 	unsigned long nr_cur_alloc;
+	/* SLAB_NODE_LOCAL: the caches of the nodes, indexed by node, or the node
+	 * of one of them */
+	struct slab_cache **node_caches;
+	int node;
+	/* Magazine layer: per-vcore magazines and the depot behind them */
+	int mag_size;
+	struct slab_vcore_cache *vcore_caches;
+	spin_pdr_lock_t depot_lock;
+	struct slab_magazine_list depot_full;
+	struct slab_magazine_list depot_empty;
+	unsigned long reap_gen;
+	/* Growth policy: number of slabs mapped by the next grow, and bounds */
+	int grow_next;
+	int grow_min;
+	int grow_max;
+	/* Statistics, see struct slab_stats.  Requests made from vcores are
+	 * counted in vcore_caches instead. */
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long grows;
+	unsigned long reaps;
+	unsigned long lock_spins;
+	unsigned long max_alloc;
+	size_t bytes_mapped;
 } slab_cache_t;
 
+/* Snapshot of the statistics of a cache, see slab_cache_stats().  Counters
+ * are summed over all vcores without stopping them, so a snapshot taken while
+ * the cache is in use is only approximately consistent.  For SLAB_NODE_LOCAL
+ * caches they are also summed over the caches of the nodes: a reap counts
+ * once per node, and max_alloc is the sum of the peaks of the nodes, which
+ * can be more than the cache as a whole ever had out at once. */
+struct slab_stats {
+	const char *name;
+	size_t obj_size;
+	unsigned long allocs;       /* slab_cache_alloc() calls */
+	unsigned long frees;        /* slab_cache_free() calls */
+	unsigned long grows;        /* times the cache mapped more slabs */
+	unsigned long reaps;        /* slab_cache_reap() calls */
+	unsigned long lock_spins;   /* spins waiting for the cache or depot lock */
+	size_t bytes_mapped;        /* memory currently backing the slabs */
+	unsigned long cur_alloc;    /* objects out of the slabs right now */
+	unsigned long max_alloc;    /* high-water mark of cur_alloc */
+	unsigned long magazine_objs;/* objects of cur_alloc cached in magazines */
+	unsigned long nr_full_slabs;
+	unsigned long nr_partial_slabs;
+	unsigned long nr_empty_slabs;
+};
+
 /* List of all slab_caches, sorted in order of size */
 SLIST_HEAD(slab_cache_list, slab_cache);
 extern struct slab_cache_list slab_caches;
@@ -97,6 +184,10 @@ extern struct slab_cache_list slab_caches;
 # define slab_cache_free INTERNAL(slab_cache_free)
 # define slab_cache_init INTERNAL(slab_cache_init)
 # define slab_cache_reap INTERNAL(slab_cache_reap)
+# define slab_cache_set_magazine_size INTERNAL(slab_cache_set_magazine_size)
+# define slab_cache_set_grow_policy INTERNAL(slab_cache_set_grow_policy)
+# define slab_cache_stats INTERNAL(slab_cache_stats)
+# define slab_cache_foreach INTERNAL(slab_cache_foreach)
 #endif
 
 /* Cache management */
@@ -108,10 +199,28 @@ void slab_cache_destroy(struct slab_cache *cp);
 /* Front end: clients of caches use these */
 void *slab_cache_alloc(struct slab_cache *cp, int flags);
 void slab_cache_free(struct slab_cache *cp, void *buf);
+/* Set the number of objects each magazine of the cache holds from now on.  A
+ * size of 0 turns the magazine layer off for the cache.  The default depends
+ * on the object size, and can be overridden for all caches through the
+ * PARLIB_SLAB_MAGAZINE_SIZE environment variable. */
+void slab_cache_set_magazine_size(struct slab_cache *cp, int size);
+/* Set how many slabs the cache maps at once when it needs to grow: min_slabs
+ * on the first grow (and the first one after a reap), doubling on every grow
+ * after that up to max_slabs. */
+void slab_cache_set_grow_policy(struct slab_cache *cp, int min_slabs,
+                                int max_slabs);
 /* Back end: internal functions */
 void slab_cache_init(void);
 void slab_cache_reap(struct slab_cache *cp);
 
+/* Introspection */
+/* Fill in stats with a snapshot of the statistics of cp. */
+void slab_cache_stats(struct slab_cache *cp, struct slab_stats *stats);
+/* Call func on every existing cache, in order of object size.  No cache can be
+ * created or destroyed while func runs, and func must not do so either. */
+void slab_cache_foreach(void (*func)(struct slab_cache *cp, void *arg),
+                        void *arg);
+
 /* Debug */
 void print_slab_cache(struct slab_cache *kc);
 void print_slab(struct slab *slab);
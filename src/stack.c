@@ -0,0 +1,382 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Stack allocator, see stack.h.
+ *
+ * Free stacks are linked through a node at their very top.  That page is the
+ * one every stack touches first anyway, and it is left alone when the rest of
+ * the stack is trimmed on its way to the depot.
+ *
+ * Growable stacks are told apart by the fault handler through the uthread
+ * running: its stack_low is the lowest usable address of its stack, and NULL
+ * if that stack can't grow.  The handler runs on the vcore's own signal stack
+ * (see __vcore_init()), since the stack that faulted has no room left. */
+
+#define _GNU_SOURCE
+#include "internal/parlib.h"
+#include "internal/vcore.h"
+#include "parlib.h"
+#include "stack.h"
+#include "vcore.h"
+#include "uthread.h"
+#include "spinlock.h"
+#include "atomic.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+
+#define STACK_NR_CLASSES 10  /* STACK_MIN_SIZE to STACK_MAX_CACHED_SIZE */
+/* How many bytes of free stacks of each size a vcore keeps, and how many the
+ * depot keeps on top of that.  Either always holds at least a couple. */
+#define STACK_VCORE_CACHE_BYTES (4 * 1024 * 1024)
+#define STACK_DEPOT_BYTES       (64 * 1024 * 1024)
+/* stack_trim() leaves this much below sp, and doesn't bother for less than
+ * STACK_TRIM_MIN_BYTES on top of that. */
+#define STACK_TRIM_SLACK        STACK_GROW_SIZE
+#define STACK_TRIM_MIN_BYTES    (64 * 1024)
+
+_Static_assert(STACK_MIN_SIZE << (STACK_NR_CLASSES - 1) == STACK_MAX_CACHED_SIZE,
+               "STACK_NR_CLASSES doesn't match the size range");
+
+struct stack_node {
+	SLIST_ENTRY(stack_node) next;
+};
+SLIST_HEAD(stack_list, stack_node);
+
+struct stack_cache {
+	struct stack_list list;
+	int count;
+};
+
+struct stack_vcore {
+	struct stack_cache classes[STACK_NR_CLASSES];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct stack_vcore *stack_vcores;
+static struct {
+	spin_pdr_lock_t lock;
+	struct stack_cache cache;
+} depot[STACK_NR_CLASSES];
+static bool madv_free_works = true;
+
+static int __stack_class(size_t size)
+{
+	if (size > STACK_MAX_CACHED_SIZE)
+		return -1;
+	if (size < STACK_MIN_SIZE)
+		size = STACK_MIN_SIZE;
+	return LOG2_UP(size) - LOG2_UP(STACK_MIN_SIZE);
+}
+
+static int __class_limit(int cls, size_t bytes, int min)
+{
+	int n = bytes / (STACK_MIN_SIZE << cls);
+	return n < min ? min : n;
+}
+
+static struct stack_node *__stack_node(void *stack, size_t size)
+{
+	return (struct stack_node*)((char*)stack + size) - 1;
+}
+
+static void *__node_stack(struct stack_node *node, size_t size)
+{
+	return (char*)(node + 1) - size;
+}
+
+/* Maps a stack with a guard page below it. */
+static void *__stack_map(size_t size)
+{
+	char *p = mmap(NULL, size + PGSIZE, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+	               -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	if (mprotect(p, PGSIZE, PROT_NONE)) {
+		int err = errno;
+		munmap(p, size + PGSIZE);
+		errno = err;
+		return NULL;
+	}
+	return p + PGSIZE;
+}
+
+static void __stack_unmap(void *stack, size_t size)
+{
+	munmap((char*)stack - PGSIZE, size + PGSIZE);
+}
+
+/* Lets the kernel take back everything but the top page of a cold stack.  With
+ * MADV_FREE it only does so if it needs the memory; kernels older than 4.5
+ * don't have it, and zap the pages right away instead. */
+static void __stack_trim(void *stack, size_t size)
+{
+#ifdef MADV_FREE
+	if (madv_free_works) {
+		if (madvise(stack, size - PGSIZE, MADV_FREE) == 0)
+			return;
+		if (errno == EINVAL)
+			madv_free_works = false;
+	}
+#endif
+	madvise(stack, size - PGSIZE, MADV_DONTNEED);
+}
+
+/* Returns the id of the vcore whose cache we may use, or -1 if we are neither
+ * a vcore nor a uthread.  Same as the slab magazines. */
+static inline int __stack_enter(void)
+{
+	if (in_vcore_context())
+		return vcore_id();
+	if (current_uthread == NULL)
+		return -1;
+	uth_disable_notifs();
+	return vcore_id();
+}
+
+static inline void __stack_exit(int vcoreid)
+{
+	if (vcoreid >= 0 && !in_vcore_context())
+		uth_enable_notifs();
+}
+
+static struct stack_cache *__vcore_cache(int vcoreid, int cls)
+{
+	struct stack_vcore *vcs = stack_vcores;
+	if (vcs == NULL) {
+		size_t size = sizeof(struct stack_vcore) * vcore_capacity();
+		vcs = parlib_aligned_alloc(ARCH_CL_SIZE, size);
+		memset(vcs, 0, size);
+		if (!atomic_cas((atomic_t*)&stack_vcores, 0, (long)vcs)) {
+			free(vcs);
+			vcs = stack_vcores;
+		}
+	}
+	return &vcs[vcoreid].classes[cls];
+}
+
+static struct stack_node *__cache_pop(struct stack_cache *c)
+{
+	struct stack_node *node = SLIST_FIRST(&c->list);
+	if (node) {
+		SLIST_REMOVE_HEAD(&c->list, next);
+		c->count--;
+	}
+	return node;
+}
+
+/* Trims the stacks in spill and moves them to the depot, unmapping whatever
+ * doesn't fit in there. */
+static void __depot_put(int cls, struct stack_list *spill)
+{
+	size_t size = STACK_MIN_SIZE << cls;
+	int limit = __class_limit(cls, STACK_DEPOT_BYTES, 4);
+	struct stack_node *node;
+
+	SLIST_FOREACH(node, spill, next)
+		__stack_trim(__node_stack(node, size), size);
+
+	spin_pdr_lock(&depot[cls].lock);
+	while (depot[cls].cache.count < limit && (node = SLIST_FIRST(spill))) {
+		SLIST_REMOVE_HEAD(spill, next);
+		SLIST_INSERT_HEAD(&depot[cls].cache.list, node, next);
+		depot[cls].cache.count++;
+	}
+	spin_pdr_unlock(&depot[cls].lock);
+
+	while ((node = SLIST_FIRST(spill))) {
+		SLIST_REMOVE_HEAD(spill, next);
+		__stack_unmap(__node_stack(node, size), size);
+	}
+}
+
+size_t EXPORT_SYMBOL stack_round_size(size_t size)
+{
+	int cls = __stack_class(size);
+	if (cls < 0)
+		return ROUNDUP(size, PGSIZE);
+	return STACK_MIN_SIZE << cls;
+}
+
+void EXPORT_SYMBOL *stack_alloc(size_t size)
+{
+	int cls = __stack_class(size);
+	size = stack_round_size(size);
+	if (cls < 0)
+		return __stack_map(size);
+
+	struct stack_node *node = NULL;
+	int vcoreid = __stack_enter();
+	if (vcoreid >= 0)
+		node = __cache_pop(__vcore_cache(vcoreid, cls));
+	__stack_exit(vcoreid);
+
+	if (node == NULL) {
+		spin_pdr_lock(&depot[cls].lock);
+		node = __cache_pop(&depot[cls].cache);
+		spin_pdr_unlock(&depot[cls].lock);
+	}
+	if (node)
+		return __node_stack(node, size);
+	return __stack_map(size);
+}
+
+void EXPORT_SYMBOL stack_free(void *stack, size_t size)
+{
+	int cls = __stack_class(size);
+	size = stack_round_size(size);
+	if (cls < 0) {
+		__stack_unmap(stack, size);
+		return;
+	}
+
+	struct stack_node *node = __stack_node(stack, size);
+	struct stack_list spill = SLIST_HEAD_INITIALIZER(spill);
+	int vcoreid = __stack_enter();
+	if (vcoreid >= 0) {
+		struct stack_cache *c = __vcore_cache(vcoreid, cls);
+		int limit = __class_limit(cls, STACK_VCORE_CACHE_BYTES, 2);
+		SLIST_INSERT_HEAD(&c->list, node, next);
+		if (++c->count > limit) {
+			/* Keep the warmest half, and send the rest to the depot. */
+			int keep = limit / 2;
+			struct stack_node *last = SLIST_FIRST(&c->list);
+			for (int i = 1; i < keep; i++)
+				last = SLIST_NEXT(last, next);
+			SLIST_FIRST(&spill) = SLIST_NEXT(last, next);
+			SLIST_NEXT(last, next) = NULL;
+			c->count = keep;
+		}
+	} else {
+		SLIST_INSERT_HEAD(&spill, node, next);
+	}
+	__stack_exit(vcoreid);
+
+	if (!SLIST_EMPTY(&spill))
+		__depot_put(cls, &spill);
+}
+
+static struct sigaction __prev_segv_action;
+
+static void __kill_self(int sig)
+{
+	syscall(SYS_tgkill, getpid(), syscall(SYS_gettid), sig);
+}
+
+/* Makes the stack of uthread usable down to addr.  Fails if addr isn't in
+ * its reservation. */
+static bool __stack_grow(struct uthread *uthread, char *addr)
+{
+	char *stack = uthread->stack;
+	char *low = uthread->stack_low;
+	if (addr < stack || addr >= low)
+		return false;
+	char *new_low = low - ROUNDUP(low - addr, STACK_GROW_SIZE);
+	if (new_low < stack)
+		new_low = stack;
+	if (mprotect(new_low, low - new_low, PROT_READ | PROT_WRITE))
+		return false;
+	uthread->stack_low = new_low;
+	if (new_low < (char*)uthread->stack_hwm)
+		uthread->stack_hwm = new_low;
+	return true;
+}
+
+static void __stack_fault(int sig, siginfo_t *info, void *context)
+{
+	struct uthread *uthread = current_uthread;
+	if (uthread && uthread->stack_low) {
+		if (info->si_code == SI_KERNEL) {
+			/* The kernel couldn't fit a signal frame on the stack, and dropped
+			 * the signal for this one.  If it was one of ours, grow the stack
+			 * well past the frame, and send it again. */
+			ucontext_t *uc = context;
+#ifdef __x86_64__
+			char *sp = (char*)uc->uc_mcontext.gregs[REG_RSP];
+#else
+			char *sp = (char*)uc->uc_mcontext.gregs[REG_ESP];
+#endif
+			if (sp < (char*)uthread->stack_low + STACK_GROW_SIZE
+			    && __stack_grow(uthread, sp - 2 * STACK_GROW_SIZE)) {
+				__kill_self(SIGVCORE);
+				return;
+			}
+		} else if (__stack_grow(uthread, info->si_addr)) {
+			return;
+		}
+	}
+
+	/* A real fault: put back whatever handled it before us. */
+	sigaction(SIGSEGV, &__prev_segv_action, NULL);
+	if ((__prev_segv_action.sa_flags & SA_SIGINFO)
+	    && __prev_segv_action.sa_sigaction)
+		__prev_segv_action.sa_sigaction(sig, info, context);
+	else if (__prev_segv_action.sa_handler != SIG_DFL
+	         && __prev_segv_action.sa_handler != SIG_IGN)
+		__prev_segv_action.sa_handler(sig);
+	else if (info->si_code <= 0 || info->si_code == SI_KERNEL)
+		/* Nothing will fault again once we return, so do it ourselves. */
+		__kill_self(SIGSEGV);
+}
+
+/* SIGVCORE stays blocked while we grow a stack, so the vcore doesn't leave
+ * its signal stack for a uthread in the middle of it. */
+static void __stack_set_fault_handler()
+{
+	struct sigaction act;
+	act.sa_sigaction = __stack_fault;
+	act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&act.sa_mask);
+	sigaddset(&act.sa_mask, SIGVCORE);
+	sigaction(SIGSEGV, &act, &__prev_segv_action);
+}
+
+void EXPORT_SYMBOL *stack_reserve(size_t size)
+{
+	run_once(__stack_set_fault_handler());
+
+	size = ROUNDUP(size, PGSIZE);
+	if (size < STACK_MIN_SIZE)
+		size = STACK_MIN_SIZE;
+	char *p = mmap(NULL, size + PGSIZE, PROT_NONE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+	               -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	char *stack = p + PGSIZE;
+	if (mprotect(stack + size - STACK_MIN_SIZE, STACK_MIN_SIZE,
+	             PROT_READ | PROT_WRITE)) {
+		int err = errno;
+		munmap(p, size + PGSIZE);
+		errno = err;
+		return NULL;
+	}
+	return stack;
+}
+
+void EXPORT_SYMBOL stack_release(void *stack, size_t size)
+{
+	size = ROUNDUP(size, PGSIZE);
+	if (size < STACK_MIN_SIZE)
+		size = STACK_MIN_SIZE;
+	__stack_unmap(stack, size);
+}
+
+void EXPORT_SYMBOL *stack_trim(void *low, void *sp)
+{
+	char *keep = (char*)ROUNDDOWN((uintptr_t)sp, PGSIZE) - STACK_TRIM_SLACK;
+	if (keep - (char*)low < STACK_TRIM_MIN_BYTES)
+		return low;
+	/* Drop the pages, then make them fault again, so that whatever grows
+	 * back shows up in the high-water mark. */
+	madvise(low, keep - (char*)low, MADV_DONTNEED);
+	if (mprotect(low, keep - (char*)low, PROT_NONE))
+		return low;
+	return keep;
+}
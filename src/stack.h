@@ -0,0 +1,77 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_STACK_H
+#define PARLIB_STACK_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stacks for uthreads and signal handlers.
+ *
+ * Every stack is its own mapping, with an inaccessible guard page right below
+ * it, so running off its end faults instead of trashing whatever comes next.
+ * Sizes are rounded up to a power of two, from STACK_MIN_SIZE up to
+ * STACK_MAX_CACHED_SIZE.  Freed stacks of these sizes are kept around instead
+ * of being unmapped: first on the freeing vcore, where the next allocation of
+ * the same size finds them still warm, then, once that vcore holds enough of
+ * them, in a global depot.  Stacks moving to the depot have their memory
+ * handed back to the kernel (MADV_FREE), keeping only the mapping.  Bigger
+ * stacks are mapped and unmapped every time.
+ *
+ * Can be called from anywhere.  Outside of vcores and uthreads, everything
+ * goes through the depot. */
+
+#define STACK_MIN_SIZE        (16 * 1024)
+#define STACK_MAX_CACHED_SIZE (8 * 1024 * 1024)
+
+/* Returns the lowest address of a stack of at least size bytes (see
+ * stack_round_size()), or NULL with errno set to ENOMEM if we are out of
+ * memory.  Every stack takes two mappings, its guard page and the rest, so
+ * vm.max_map_count (65530 by default) runs out at around 30000 stacks, well
+ * before the memory does.  That's ENOMEM too. */
+void *stack_alloc(size_t size);
+
+/* Gives back a stack from stack_alloc().  Size is the size asked for. */
+void stack_free(void *stack, size_t size);
+
+/* The size of the stack stack_alloc(size) actually returns. */
+size_t stack_round_size(size_t size);
+
+/* Growable stacks, for uthreads (see uthread_set_stack_reserve()).
+ *
+ * stack_reserve() only reserves address space: the top STACK_MIN_SIZE bytes
+ * are usable, the rest faults.  If the fault comes from the stack of the
+ * uthread running, and is no lower than the bottom of the reservation, the
+ * SIGSEGV handler makes the stack usable down to the faulting address,
+ * STACK_GROW_SIZE bytes at a time, and the uthread goes on.  Anything else is
+ * a real fault, and goes wherever it would have gone without us.  Growable
+ * stacks are not cached, they are unmapped as soon as they are released.
+ * Growing and trimming only move the line between the two mappings of a
+ * stack, so they count against vm.max_map_count like any other stack. */
+
+#define STACK_GROW_SIZE (16 * 1024)
+
+/* Returns the lowest address of a growable stack of size bytes, or NULL with
+ * errno set to ENOMEM, as for stack_alloc().  Its usable part starts at
+ * stack + size - STACK_MIN_SIZE. */
+void *stack_reserve(size_t size);
+
+/* Gives back a stack from stack_reserve(). */
+void stack_release(void *stack, size_t size);
+
+/* Hands back to the kernel the part of the stack between low, its lowest
+ * usable address, and a bit below sp, the stack pointer of whoever uses it,
+ * if that part is big enough to bother.  That part faults again from then on.
+ * Returns the new lowest usable address.  Must not be called on a running
+ * stack. */
+void *stack_trim(void *low, void *sp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARLIB_STACK_H
@@ -23,22 +23,18 @@ void EXPORT_SYMBOL set_syscall_timeout(uint64_t timeout_usec)
   current_uthread->sysc_timeout = timeout_usec;
 }
 
+/* Blocks the backing pthread until fd is ready.  Uses poll() rather than
+ * select(), which can't deal with fds >= FD_SETSIZE. */
 static void __select(int fd, int which)
 {
-  fd_set fdset;
-  FD_ZERO(&fdset);
-  FD_SET(fd, &fdset);
-  struct timeval timeout;
-  struct timeval *ptimeout = NULL;
-  if (current_uthread->sysc_timeout != 0) {
-    timeout.tv_sec = current_uthread->sysc_timeout / 1000000;
-    timeout.tv_usec = current_uthread->sysc_timeout % 1000000;
-    ptimeout = &timeout;
-  }
-  if (which == SELECT_READ)
-    select(fd + 1, &fdset, NULL, &fdset, ptimeout);
-  else if (which == SELECT_WRITE)
-    select(fd + 1, NULL, &fdset, &fdset, ptimeout);
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = (which == SELECT_READ) ? POLLIN : POLLOUT;
+  pfd.revents = 0;
+  int timeout = -1;
+  if (current_uthread->sysc_timeout != 0)
+    timeout = (current_uthread->sysc_timeout + 999) / 1000;
+  poll(&pfd, 1, timeout);
 }
 
 int EXPORT_SYMBOL open(const char* path, int oflag, ...)
@@ -50,12 +46,23 @@ int EXPORT_SYMBOL open(const char* path, int oflag, ...)
 
   if (current_uthread)
     oflag |= O_NONBLOCK;
-  return __internal_open(path, oflag, mode);
+  int fd = __internal_open(path, oflag, mode);
+  reactor_forget(fd);
+  return fd;
+}
+
+int EXPORT_SYMBOL close(int fd)
+{
+  reactor_forget(fd);
+  return __internal_close(fd);
 }
 
 FILE EXPORT_SYMBOL *fopen(const char *path, const char *mode)
 {
   FILE *stream = __internal_fopen(path, mode);
+  if (stream == NULL)
+    return NULL;
+  reactor_forget(fileno(stream));
   if (current_uthread) {
     int fd = fileno(stream);
     int fl = fcntl(fd, F_GETFL, 0);
@@ -73,7 +80,8 @@ ssize_t EXPORT_SYMBOL read(int fd, void* buf, size_t sz)
   }
 
   if (current_uthread)
-    return uthread_blocking_call(__internal_read, __blocking_read, fd, buf, sz);
+    return uthread_blocking_call(fd, POLLIN, __internal_read,
+                                 __blocking_read, fd, buf, sz);
   return __internal_read(fd, buf, sz);
 }
 
@@ -85,8 +93,8 @@ ssize_t EXPORT_SYMBOL write(int fd, const void* buf, size_t sz)
   }
 
   if (current_uthread)
-    return uthread_blocking_call(__internal_write, __blocking_write,
-                                 fd, buf, sz);
+    return uthread_blocking_call(fd, POLLOUT, __internal_write,
+                                 __blocking_write, fd, buf, sz);
   return __internal_write(fd, buf, sz);
 }
 
@@ -101,8 +109,8 @@ size_t EXPORT_SYMBOL fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
   }
 
   if (current_uthread)
-    return uthread_blocking_call(__internal_fread, __blocking_fread,
-                                 ptr, size, nmemb, stream);
+    return uthread_blocking_call(fileno(stream), POLLIN, __internal_fread,
+                                 __blocking_fread, ptr, size, nmemb, stream);
   return __internal_fread(ptr, size, nmemb, stream);
 }
 
@@ -118,14 +126,15 @@ size_t EXPORT_SYMBOL fwrite(const void *ptr, size_t size,
   }
 
   if (current_uthread)
-    return uthread_blocking_call(__internal_fwrite, __blocking_fwrite,
-                                 ptr, size, nmemb, stream);
+    return uthread_blocking_call(fileno(stream), POLLOUT, __internal_fwrite,
+                                 __blocking_fwrite, ptr, size, nmemb, stream);
   return __internal_fwrite(ptr, size, nmemb, stream);
 }
 
 int EXPORT_SYMBOL __wrap_socket(int sfamily, int stype, int prot)
 {
   int fd = __internal_socket(sfamily, stype, prot);
+  reactor_forget(fd);
   if (current_uthread) {
     int fl = fcntl(fd, F_GETFL, 0);
     fl |= O_NONBLOCK;
@@ -142,10 +151,14 @@ int EXPORT_SYMBOL __wrap_accept(int sockfd, struct sockaddr *addr, socklen_t *ad
     return __internal_accept(__fd, __addr, __addrlen);
   }
 
+  int fd;
   if (current_uthread)
-    return uthread_blocking_call(__internal_accept, __blocking_accept,
-                                 sockfd, addr, addrlen);
-  return __internal_accept(sockfd, addr, addrlen);
+    fd = uthread_blocking_call(sockfd, POLLIN, __internal_accept,
+                               __blocking_accept, sockfd, addr, addrlen);
+  else
+    fd = __internal_accept(sockfd, addr, addrlen);
+  reactor_forget(fd);
+  return fd;
 }
 
 #endif
@@ -24,7 +24,9 @@
 
 #ifdef __linux__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <cpuid.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
@@ -48,6 +50,34 @@ cpu_relax(void)
 	asm volatile("pause" : : : "memory");
 }
 
+/* Whether the CPU has umonitor/umwait (CPUID leaf 7, ECX bit 5). */
+static __inline bool
+cpu_has_waitpkg(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ecx & (1 << 5);
+}
+
+/* Watches the cache line of addr for writes, for the next cpu_umwait(). */
+static __inline void
+cpu_umonitor(volatile void *addr)
+{
+	asm volatile("umonitor %0" : : "r" (addr) : "memory");
+}
+
+/* Waits in the lighter of the two low power states (C0.1) until the line
+ * armed by cpu_umonitor() gets written, the TSC reaches deadline, or the OS
+ * limit on waiting runs out, whichever comes first. */
+static __inline void
+cpu_umwait(uint64_t deadline)
+{
+	asm volatile("umwait %0" : : "r" (1), "a" ((uint32_t)deadline),
+	             "d" ((uint32_t)(deadline >> 32)) : "cc", "memory");
+}
+
 static __inline uint64_t                                                                             
 read_pmc(uint32_t index)
 {                                                                                                    
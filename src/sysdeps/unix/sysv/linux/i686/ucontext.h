@@ -36,4 +36,10 @@ static inline void parlib_makecontext(struct user_context *ucp,
 	makecontext(ucp, entry, 0);
 }
 
+/* The stack pointer of a saved context. */
+static inline void *parlib_context_sp(struct user_context *ucp)
+{
+	return (void*)ucp->uc_mcontext.gregs[REG_ESP];
+}
+
 #endif // PARLIB_UCONTEXT_H
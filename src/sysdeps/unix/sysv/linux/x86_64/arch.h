@@ -24,7 +24,9 @@
 
 #ifdef __linux__
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <cpuid.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -50,6 +52,34 @@ cpu_relax(void)
 	asm volatile("pause" : : : "memory");
 }
 
+/* Whether the CPU has umonitor/umwait (CPUID leaf 7, ECX bit 5). */
+static __inline bool
+cpu_has_waitpkg(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return ecx & (1 << 5);
+}
+
+/* Watches the cache line of addr for writes, for the next cpu_umwait(). */
+static __inline void
+cpu_umonitor(volatile void *addr)
+{
+	asm volatile("umonitor %0" : : "r" (addr) : "memory");
+}
+
+/* Waits in the lighter of the two low power states (C0.1) until the line
+ * armed by cpu_umonitor() gets written, the TSC reaches deadline, or the OS
+ * limit on waiting runs out, whichever comes first. */
+static __inline void
+cpu_umwait(uint64_t deadline)
+{
+	asm volatile("umwait %0" : : "r" (1), "a" ((uint32_t)deadline),
+	             "d" ((uint32_t)(deadline >> 32)) : "cc", "memory");
+}
+
 static __inline uint64_t                                                                             
 read_pmc(uint32_t index)
 {                                                                                                    
@@ -61,32 +91,44 @@ read_pmc(uint32_t index)
 
 int arch_prctl(int code, unsigned long *addr);
 
+#ifdef PARLIB_HAVE_FSGSBASE
 /* Get the current tls base address */
 static __inline void *get_current_tls_base()
 {
   uintptr_t addr;
-#ifdef PARLIB_HAVE_FSGSBASE
 	asm volatile("rdfsbase %%rax"
 			: "=a" (addr)
 			:: "memory");
-#else
-  arch_prctl(ARCH_GET_FS, &addr);
-#endif
   return (void *)addr;
 }
 
 /* Set the current tls base address */
 static __inline void set_current_tls_base(void *tls_desc)
 {
-#ifdef PARLIB_HAVE_FSGSBASE
 	asm volatile("wrfsbase %%rax"
 			:: "a" (tls_desc)
 			: "memory");
+}
+
 #else
-  arch_prctl(ARCH_SET_FS, (uintptr_t *)tls_desc);
-#endif
+/* Use rd/wrfsbase if this CPU and kernel allow it, arch_prctl() otherwise.
+ * Resolved once at load time, see fsgsbase.c. */
+void *parlib_get_tls_base(void);
+void parlib_set_tls_base(void *tls_desc);
+
+/* Get the current tls base address */
+static __inline void *get_current_tls_base()
+{
+  return parlib_get_tls_base();
 }
 
+/* Set the current tls base address */
+static __inline void set_current_tls_base(void *tls_desc)
+{
+  parlib_set_tls_base(tls_desc);
+}
+#endif
+
 #else // !__linux__
   #error "Your architecture is not yet supported by parlib!"
 #endif 
@@ -0,0 +1,87 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Runtime selection of how to get and set the FS base, for when configure
+ * wasn't told whether the target has rd/wrfsbase.  The instructions only work
+ * if the CPU has them (CPUID leaf 7, EBX bit 0) and the kernel turned them on
+ * for user space (Linux 5.9 and up), which it tells us through AT_HWCAP2.
+ * Otherwise every switch goes through arch_prctl().  The choice is made once,
+ * by IFUNC resolvers, before anything in the process gets to run. */
+
+#include <stdbool.h>
+#include <cpuid.h>
+#include <sys/auxv.h>
+#include "internal/parlib.h"
+#include "arch.h"
+
+#ifndef PARLIB_HAVE_FSGSBASE
+
+#ifndef bit_FSGSBASE
+# define bit_FSGSBASE (1 << 0)
+#endif
+#ifndef AT_HWCAP2
+# define AT_HWCAP2 26
+#endif
+#ifndef HWCAP2_FSGSBASE
+# define HWCAP2_FSGSBASE (1 << 1)
+#endif
+
+static void *__get_tls_base_insn(void)
+{
+	uintptr_t addr;
+	asm volatile("rdfsbase %%rax"
+			: "=a" (addr)
+			:: "memory");
+	return (void *)addr;
+}
+
+static void *__get_tls_base_syscall(void)
+{
+	uintptr_t addr;
+	arch_prctl(ARCH_GET_FS, &addr);
+	return (void *)addr;
+}
+
+static void __set_tls_base_insn(void *tls_desc)
+{
+	asm volatile("wrfsbase %%rax"
+			:: "a" (tls_desc)
+			: "memory");
+}
+
+static void __set_tls_base_syscall(void *tls_desc)
+{
+	arch_prctl(ARCH_SET_FS, (uintptr_t *)tls_desc);
+}
+
+static bool __have_fsgsbase(void)
+{
+#ifndef PARLIB_NO_FSGSBASE
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return false;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (!(ebx & bit_FSGSBASE))
+		return false;
+	return getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE;
+#else
+	return false;
+#endif
+}
+
+static void *(*__resolve_get_tls_base(void))(void)
+{
+	return __have_fsgsbase() ? __get_tls_base_insn : __get_tls_base_syscall;
+}
+
+static void (*__resolve_set_tls_base(void))(void *)
+{
+	return __have_fsgsbase() ? __set_tls_base_insn : __set_tls_base_syscall;
+}
+
+void EXPORT_SYMBOL *parlib_get_tls_base(void)
+	__attribute__((ifunc("__resolve_get_tls_base")));
+void EXPORT_SYMBOL parlib_set_tls_base(void *tls_desc)
+	__attribute__((ifunc("__resolve_set_tls_base")));
+
+#endif // PARLIB_HAVE_FSGSBASE
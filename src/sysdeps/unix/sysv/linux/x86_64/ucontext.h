@@ -38,4 +38,10 @@ static inline void parlib_makecontext(struct user_context *ucp,
 	ucp->tf_fpucw = 0x037f;   /* x86 default FP CW */
 }
 
+/* The stack pointer of a saved context. */
+static inline void *parlib_context_sp(struct user_context *ucp)
+{
+	return (void*)ucp->tf_rsp;
+}
+
 #endif // PARLIB_UCONTEXT_H
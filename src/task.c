@@ -0,0 +1,132 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Stackless tasks, see task.h.
+ *
+ * A task blocks by returning, so whoever wakes it up may well get to it
+ * before it is done returning, possibly from another vcore.  run_state sorts
+ * that out: a wakeup that finds the task still running just leaves a note,
+ * and run_task() puts the task right back on the 2LS instead of blocking it.
+ *
+ * Waits on fds use the same I/O engines as blocked uthreads do, and come back
+ * as the same EV_SYSCALL events, with SC_TASK set in their struct syscall so
+ * that the 2LS knows to task_wakeup() them instead.  Unlike uthreads, tasks
+ * never fall back to a pthread: a wait neither engine takes fails right away
+ * with the reactor's -errno. */
+
+#include "internal/parlib.h"
+#include "internal/vcore.h"
+#include "internal/event.h"
+#include "internal/io.h"
+#include "internal/io_uring.h"
+#include "internal/reactor.h"
+#include "parlib.h"
+#include "vcore.h"
+#include "uthread.h"
+#include "task.h"
+#include "atomic.h"
+
+#include <errno.h>
+
+#define TASK_QUEUED   0  /* with the 2LS, or about to be */
+#define TASK_RUNNING  1
+#define TASK_WOKEN    2  /* running, and woken up already */
+#define TASK_ASLEEP   3
+
+_Static_assert(sizeof(struct io_request) <= sizeof(((struct task*)0)->io),
+               "struct task has no room for an io_request");
+
+static inline struct io_request *__task_io(struct task *task)
+{
+	return (struct io_request*)task->io;
+}
+
+void EXPORT_SYMBOL task_init(struct task *task, int (*fn)(struct task *task))
+{
+	task->fn = fn;
+	task->state = 0;
+	task->res = 0;
+	atomic_set(&task->run_state, TASK_QUEUED);
+	memset(&task->ev_msg, 0, sizeof(task->ev_msg));
+	task->ev_msg.ev_arg3 = &task->ev_msg.sysc;
+	task->ev_msg.sysc.u_data = task;
+	task->ev_msg.sysc.flags = SC_TASK;
+}
+
+void EXPORT_SYMBOL task_runnable(struct task *task)
+{
+	assert(sched_ops->task_runnable);
+	sched_ops->task_runnable(task);
+}
+
+void EXPORT_SYMBOL task_wakeup(struct task *task)
+{
+	for (;;) {
+		long state = (long)atomic_read(&task->run_state);
+		if (state == TASK_ASLEEP) {
+			if (atomic_cas(&task->run_state, TASK_ASLEEP, TASK_QUEUED)) {
+				task_runnable(task);
+				return;
+			}
+		} else if (state == TASK_RUNNING) {
+			if (atomic_cas(&task->run_state, TASK_RUNNING, TASK_WOKEN))
+				return;
+		} else {
+			return;
+		}
+	}
+}
+
+void EXPORT_SYMBOL run_task(struct task *task)
+{
+	assert(in_vcore_context());
+	atomic_set(&task->run_state, TASK_RUNNING);
+	switch (task->fn(task)) {
+		case TASK_DONE:
+			return;
+		case TASK_BLOCKED:
+			if (atomic_cas(&task->run_state, TASK_RUNNING, TASK_ASLEEP))
+				return;
+			/* Woken up already. */
+			break;
+	}
+	atomic_set(&task->run_state, TASK_QUEUED);
+	task_runnable(task);
+}
+
+/* Same as __uthread_io_complete(): back to the vcore the task waited on. */
+static void __task_io_complete(struct io_request *req)
+{
+	struct task *task = req->data;
+	task->res = req->res;
+	if (in_vcore_context() && vcore_id() == req->vcoreid)
+		dispatch_event(&task->ev_msg, EV_SYSCALL);
+	else
+		send_event(&task->ev_msg, EV_SYSCALL, req->vcoreid);
+}
+
+void EXPORT_SYMBOL task_wait_fd(struct task *task, int fd, short events,
+                                uint64_t timeout_usec)
+{
+	assert(in_vcore_context());
+	struct io_request *req = __task_io(task);
+	*req = (struct io_request) {
+		.fd = fd,
+		.events = events,
+		.vcoreid = vcore_id(),
+		.timeout_usec = timeout_usec,
+		.submitted = false,
+		.complete = __task_io_complete,
+		.data = task,
+	};
+	if (io_uring_submit(req))
+		return;
+	if (reactor_submit(req))
+		return;
+	/* Tasks have no pthread to block in: fail the wait instead, unless the
+	 * fd just can't be polled, which poll() would call always ready. */
+	req->submitted = true;
+	if (req->res == -EPERM)
+		req->res = events;
+	req->complete(req);
+}
@@ -0,0 +1,112 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_TASK_H
+#define PARLIB_TASK_H
+
+#include <stdint.h>
+#include "atomic.h"
+#include "event.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stackless tasks.
+ *
+ * A task is a function that gets called again and again until it says it is
+ * done.  It runs in vcore context, on the stack of whatever vcore the 2LS
+ * runs it on, so it needs no stack, TLS or user_context of its own: all there
+ * is to it is a struct task, normally embedded in a bigger struct holding
+ * whatever the task has to remember from one call to the next.  Local
+ * variables don't survive a TASK_YIELD(), TASK_BLOCK() or TASK_WAIT_FD().
+ *
+ *   struct rpc { struct task task; int fd; ... };
+ *
+ *   static int rpc_fn(struct task *task)
+ *   {
+ *     struct rpc *rpc = (struct rpc*)task;
+ *     TASK_BEGIN(task);
+ *     while (read(rpc->fd, ...) < 0 && errno == EAGAIN)
+ *       TASK_WAIT_FD(task, rpc->fd, POLLIN, 0);
+ *     ...
+ *     TASK_END(task);
+ *   }
+ *
+ * Like anything else in vcore context, tasks are never interrupted, and
+ * should yield every now and then if they have a lot to do.  They are handed
+ * to the 2LS with sched_ops->task_runnable, which runs them with run_task()
+ * from its sched_entry().  Wsched does so. */
+
+/* What a task function returns. */
+#define TASK_DONE     0  /* don't touch the task ever again */
+#define TASK_YIELDED  1  /* run it again later */
+#define TASK_BLOCKED  2  /* run it again after a task_wakeup() */
+
+struct task {
+	int (*fn)(struct task *task);
+	int state;              /* where fn picks up, see TASK_BEGIN() */
+	int res;                /* see TASK_WAIT_FD() */
+	atomic_t run_state;
+	struct event_msg ev_msg;
+	uint64_t io[10];        /* an io_request, while waiting on an fd */
+};
+
+/* Sets up task to run fn, from the top. */
+void task_init(struct task *task, int (*fn)(struct task *task));
+
+/* Hands a task that was just initialized, or that yielded, to the 2LS.  Can
+ * be called from uthreads and vcore context. */
+void task_runnable(struct task *task);
+
+/* Makes a task that blocked runnable again.  It may be called before the task
+ * has even returned TASK_BLOCKED, in which case it doesn't block at all.  A
+ * wakeup that comes in while the task is not blocked or about to is lost. */
+void task_wakeup(struct task *task);
+
+/* Runs task until it returns, and deals with what it returned.  For 2LSs. */
+void run_task(struct task *task);
+
+/* Waits for fd to be ready for events (POLLIN or POLLOUT), or for timeout_usec
+ * to expire (if not 0), and wakes task up.  Used by TASK_WAIT_FD().  The wait
+ * goes to io_uring or the epoll reactor, and fails if neither takes it. */
+void task_wait_fd(struct task *task, int fd, short events,
+                  uint64_t timeout_usec);
+
+/* Coroutine helpers, after Duff's device: task->state is the line the task
+ * function returned from last, which TASK_BEGIN() jumps back to.  The task
+ * function can't use a switch of its own around any of them. */
+#define TASK_BEGIN(task) \
+	switch ((task)->state) { \
+	case 0:
+
+#define TASK_END(task) \
+	} \
+	return TASK_DONE
+
+#define __TASK_RETURN(task, ret, ...) \
+	do { \
+		(task)->state = __LINE__; \
+		__VA_ARGS__; \
+		return (ret); \
+	case __LINE__:; \
+	} while (0)
+
+/* Lets the 2LS run something else. */
+#define TASK_YIELD(task) __TASK_RETURN(task, TASK_YIELDED)
+
+/* Sleeps until somebody calls task_wakeup(). */
+#define TASK_BLOCK(task) __TASK_RETURN(task, TASK_BLOCKED)
+
+/* Sleeps until fd is ready, or until timeout_usec has passed.  task->res is
+ * then the poll() events of fd, or -errno (-ECANCELED on a timeout, -EBUSY if
+ * another uthread or task already waits on the same side of fd). */
+#define TASK_WAIT_FD(task, fd, events, timeout_usec) \
+	__TASK_RETURN(task, TASK_BLOCKED, \
+	              task_wait_fd((task), (fd), (events), (timeout_usec)))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARLIB_TASK_H
@@ -30,6 +30,7 @@
 #include "internal/vcore.h"
 #include "internal/futex.h"
 #include "timing.h"
+#include "spinlock.h"
 #include "atomic.h"
 #include "tls.h"
 #include "vcore.h"
@@ -40,6 +41,12 @@ void *main_tls_desc = NULL;
 /* TLS variables used by the pthread backing each uthread. */
 __thread struct backing_pthread __backing_pthread;
 
+/* Size of the static TLS blocks of all modules, which sit right below the
+ * tcb.  This is the part of a TLS region that reinit_tls() resets: the tcb
+ * itself is glibc's struct pthread of a live (if parked) backing pthread, and
+ * is linked into glibc's own bookkeeping. */
+static size_t tls_static_size = 0;
+
 static void *__create_backing_thread(void *tls_addr)
 {
   /* This code has gone through many iterations of trying to create tls
@@ -81,11 +88,9 @@ static void *__create_backing_thread(void *tls_addr)
 
     /* Save the initial state of our tls so we can use it to reinitialize our
      * tls later. */
-    extern void _dl_get_tls_static_info(size_t*, size_t*) internal_function;
-    size_t tls_size, tls_align;
-    _dl_get_tls_static_info(&tls_size, &tls_align);
-    __backing_pthread.initial_tls = malloc(tls_size);
-    memcpy(__backing_pthread.initial_tls, tcb, tls_size);
+    __backing_pthread.initial_tls = malloc(tls_static_size);
+    memcpy(__backing_pthread.initial_tls, (char*)tcb - tls_static_size,
+           tls_static_size);
 
     /* Set it up so we can run syscalls on behalf of the uthread we are
      * backing with this pthread. */
@@ -136,11 +141,94 @@ static void *__create_backing_thread(void *tls_addr)
   return arg.tcb;
 }
 
+/* Pool of TLS regions, each with its backing pthread already up and parked,
+ * ready to be handed out by allocate_tls().  Creating a backing pthread takes
+ * a full pthread_create() plus a round trip through a futex, so we keep some
+ * around: freed regions go back into the pool (up to tls_pool_high of them),
+ * and whenever the pool drops below tls_pool_low a background thread refills
+ * it up to tls_pool_high.  Both watermarks can be set through the
+ * PARLIB_TLS_POOL_LOW and PARLIB_TLS_POOL_HIGH environment variables. */
+#define TLS_POOL_LOW_DEFAULT  8
+#define TLS_POOL_HIGH_DEFAULT 32
+
+static spin_pdr_lock_t tls_pool_lock = SPINPDR_INITIALIZER;
+static void *tls_pool = NULL;
+static int tls_pool_count = 0;
+static int tls_pool_low = TLS_POOL_LOW_DEFAULT;
+static int tls_pool_high = TLS_POOL_HIGH_DEFAULT;
+static int tls_pool_refill = 0;
+
+static void __tls_pool_push(void *tcb)
+{
+  *get_tls_addr(__backing_pthread.pool_next, tcb) = tls_pool;
+  tls_pool = tcb;
+  tls_pool_count++;
+}
+
+static void *__tls_pool_pop()
+{
+  void *tcb = tls_pool;
+  if (tcb != NULL) {
+    tls_pool = *get_tls_addr(__backing_pthread.pool_next, tcb);
+    tls_pool_count--;
+  }
+  return tcb;
+}
+
+static void *__tls_pool_refill_thread(void *arg)
+{
+  while (1) {
+    futex_wait(&tls_pool_refill, 0);
+    while (1) {
+      spin_pdr_lock(&tls_pool_lock);
+      bool full = tls_pool_count >= tls_pool_high;
+      if (full)
+        tls_pool_refill = 0;
+      spin_pdr_unlock(&tls_pool_lock);
+      if (full)
+        break;
+
+      void *tcb = __create_backing_thread(NULL);
+      spin_pdr_lock(&tls_pool_lock);
+      __tls_pool_push(tcb);
+      spin_pdr_unlock(&tls_pool_lock);
+    }
+  }
+  return NULL;
+}
+
+static void __tls_pool_init()
+{
+  char *low = getenv("PARLIB_TLS_POOL_LOW");
+  char *high = getenv("PARLIB_TLS_POOL_HIGH");
+  if (low != NULL)
+    tls_pool_low = atoi(low);
+  if (high != NULL)
+    tls_pool_high = atoi(high);
+  if (tls_pool_high < tls_pool_low)
+    tls_pool_high = tls_pool_low;
+
+  internal_pthread_create(PTHREAD_STACK_MIN, __tls_pool_refill_thread, NULL);
+}
+
 /* Get a TLS, returns 0 on failure.  Any thread created by a user-level
  * scheduler needs to create a TLS. */
 void *allocate_tls(void)
 {
-  return __create_backing_thread(NULL);
+  run_once(__tls_pool_init());
+
+  spin_pdr_lock(&tls_pool_lock);
+  void *tcb = __tls_pool_pop();
+  bool refill = tls_pool_count < tls_pool_low && tls_pool_refill == 0;
+  if (refill)
+    tls_pool_refill = 1;
+  spin_pdr_unlock(&tls_pool_lock);
+
+  if (refill)
+    futex_wakeup_one(&tls_pool_refill);
+  if (tcb == NULL)
+    tcb = __create_backing_thread(NULL);
+  return tcb;
 }
 
 /* We need a backing pthread for the main thread too so that syscalls can run
@@ -150,9 +238,21 @@ void *get_main_tls()
   return __create_backing_thread(main_tls_desc);
 }
 
-/* Free a previously allocated TLS region */
+/* Free a previously allocated TLS region.  It goes back into the pool if
+ * there is room for it, otherwise its backing pthread exits. */
 void free_tls(void *tcb)
 {
+  if (tcb != main_tls_desc) {
+    reinit_tls(tcb);
+    spin_pdr_lock(&tls_pool_lock);
+    bool pooled = tls_pool_count < tls_pool_high;
+    if (pooled)
+      __tls_pool_push(tcb);
+    spin_pdr_unlock(&tls_pool_lock);
+    if (pooled)
+      return;
+  }
+
   int *futex = get_tls_addr(__backing_pthread.futex, tcb);
   *futex = BACKING_THREAD_EXIT;
   futex_wakeup_one(futex);
@@ -163,11 +263,10 @@ void free_tls(void *tcb)
  * actually might have changed). */
 void *reinit_tls(void *tcb)
 {
-  extern void _dl_get_tls_static_info(size_t*, size_t*) internal_function;
-  size_t tls_size, tls_align;
-  _dl_get_tls_static_info(&tls_size, &tls_align);
-  void *initial_tls = *get_tls_addr(__backing_pthread.initial_tls, tcb);
-  memcpy(tcb, initial_tls, tls_size);
+  /* Our own bookkeeping lives in the static TLS too, and has to survive. */
+  struct backing_pthread bp = *get_tls_addr(__backing_pthread, tcb);
+  memcpy((char*)tcb - tls_static_size, bp.initial_tls, tls_static_size);
+  *get_tls_addr(__backing_pthread, tcb) = bp;
   return tcb;
 }
 
@@ -182,6 +281,15 @@ int tls_lib_init()
 	
 	/* Get a reference to the main program's TLS descriptor */
 	main_tls_desc = get_current_tls_base();
+
+	/* The static TLS area glibc sets up for every thread is the tcb (its
+	 * struct pthread) plus the blocks below it, including the surplus kept
+	 * for modules dlopen()ed later on. */
+	extern void _dl_get_tls_static_info(size_t*, size_t*) internal_function;
+	extern const unsigned int _thread_db_sizeof_pthread;
+	size_t size, align;
+	_dl_get_tls_static_info(&size, &align);
+	tls_static_size = size - _thread_db_sizeof_pthread;
 	return 0;
 }
 
@@ -0,0 +1,418 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Vcore placement, see topology.h.
+ *
+ * Everything is read from the main thread before any vcore exists, and the
+ * CPUs we may use again whenever vcore_set_max() creates more vcores, since
+ * the cpuset may have grown or shrunk by then.  Missing sysfs files (containers, odd architectures) just make every CPU
+ * look like a core of its own on socket 0 of node 0.
+ *
+ * Memory is bound to nodes with a raw mbind(), to spare everybody a
+ * dependency on libnuma for the two constants we need. */
+
+#define _GNU_SOURCE
+#include "internal/parlib.h"
+#include "internal/vcore.h"
+#include "internal/topology.h"
+#include "parlib.h"
+#include "topology.h"
+#include "vcore.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+
+#define SYSFS_CPU  "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+#define SYSFS_CGROUP "/sys/fs/cgroup"
+
+#define MPOL_PREFERRED 1
+#define MAX_NODES 1024
+
+enum {
+	PLACEMENT_NOSMT,
+	PLACEMENT_COMPACT,
+	PLACEMENT_SCATTER,
+	PLACEMENT_NONE,
+};
+
+struct cpu_info {
+	int cpu;
+	int node;
+	int socket;
+	int core;
+	int smt;
+	int rank;       /* of its core among the cores of its node */
+};
+
+static int __placement;
+static int __fake_nodes;
+static int __sys_nodes = 1;  /* one more than the highest node in sysfs */
+static int __nr_nodes = 1;
+static int __nr_sockets = 1;
+
+static int __read_int(const char *path, int dflt)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return dflt;
+	int val;
+	if (fscanf(f, "%d", &val) != 1)
+		val = dflt;
+	fclose(f);
+	return val;
+}
+
+/* Parses a list of CPUs like "0-3,8,10-11". */
+static void __parse_cpulist(FILE *f, cpu_set_t *set)
+{
+	int lo, hi;
+	CPU_ZERO(set);
+	while (fscanf(f, "%d", &lo) == 1) {
+		hi = lo;
+		int c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &hi) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (int i = lo; i <= hi && i < CPU_SETSIZE; i++)
+			CPU_SET(i, set);
+		if (c != ',')
+			break;
+	}
+}
+
+static void __read_nodes(struct cpu_info *cpus, int nr_cpus)
+{
+	DIR *dir = opendir(SYSFS_NODE);
+	if (dir == NULL)
+		return;
+	struct dirent *d;
+	while ((d = readdir(dir))) {
+		int node;
+		if (sscanf(d->d_name, "node%d", &node) != 1)
+			continue;
+		if (node >= __sys_nodes && node < MAX_NODES)
+			__sys_nodes = node + 1;
+		char path[128];
+		snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		cpu_set_t set;
+		__parse_cpulist(f, &set);
+		fclose(f);
+		for (int i = 0; i < nr_cpus; i++)
+			if (CPU_ISSET(cpus[i].cpu, &set))
+				cpus[i].node = node;
+	}
+	closedir(dir);
+}
+
+static int __cmp(int a, int b)
+{
+	return (a > b) - (a < b);
+}
+
+static int __cmp_compact(const void *__a, const void *__b)
+{
+	const struct cpu_info *a = __a, *b = __b;
+	int c;
+	if ((c = __cmp(a->node, b->node)) || (c = __cmp(a->socket, b->socket))
+	    || (c = __cmp(a->core, b->core)) || (c = __cmp(a->smt, b->smt)))
+		return c;
+	return __cmp(a->cpu, b->cpu);
+}
+
+static int __cmp_placement(const void *__a, const void *__b)
+{
+	const struct cpu_info *a = __a, *b = __b;
+	int c;
+	if (__placement == PLACEMENT_SCATTER) {
+		if ((c = __cmp(a->smt, b->smt)) || (c = __cmp(a->rank, b->rank)))
+			return c;
+	} else if (__placement == PLACEMENT_NOSMT) {
+		if ((c = __cmp(a->smt, b->smt)))
+			return c;
+	}
+	return __cmp_compact(a, b);
+}
+
+/* Fills in the ids of every CPU we may run on, sorted for placement.  Returns
+ * how many there are.  Only the main thread is never pinned. */
+static int __read_cpus(struct cpu_info *cpus)
+{
+	cpu_set_t allowed;
+	int nr_cpus = 0;
+	if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for (int i = 0; i < get_nprocs() && i < CPU_SETSIZE; i++)
+			CPU_SET(i, &allowed);
+	}
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed))
+			continue;
+		char path[128];
+		struct cpu_info *c = &cpus[nr_cpus++];
+		c->cpu = i;
+		c->node = 0;
+		snprintf(path, sizeof(path),
+		         SYSFS_CPU "/cpu%d/topology/physical_package_id", i);
+		c->socket = __read_int(path, 0);
+		snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/topology/core_id", i);
+		c->core = __read_int(path, i);
+	}
+	__read_nodes(cpus, nr_cpus);
+
+	/* Number the SMT threads of each core, and the cores of each node. */
+	qsort(cpus, nr_cpus, sizeof(struct cpu_info), __cmp_compact);
+	for (int i = 0; i < nr_cpus; i++) {
+		struct cpu_info *c = &cpus[i], *prev = i ? &cpus[i - 1] : NULL;
+		if (prev && prev->node == c->node && prev->socket == c->socket
+		    && prev->core == c->core) {
+			c->smt = prev->smt + 1;
+			c->rank = prev->rank;
+		} else {
+			c->smt = 0;
+			c->rank = prev && prev->node == c->node ? prev->rank + 1 : 0;
+		}
+	}
+	if (__placement != PLACEMENT_NONE)
+		qsort(cpus, nr_cpus, sizeof(struct cpu_info), __cmp_placement);
+	return nr_cpus;
+}
+
+/* Puts vcore i on CPU c, or on CPU i with no idea where that is if c is
+ * NULL. */
+static void __place(int i, struct cpu_info *c)
+{
+	struct vcore_pvc_data *vc = &vcore_pvc_data[i];
+	vc->pcore = c && __placement != PLACEMENT_NONE ? c->cpu : i;
+	vc->node = c ? c->node : 0;
+	if (__fake_nodes)
+		vc->node = i % __fake_nodes;
+	/* Nodes that only showed up later have no slab caches of their own. */
+	if (vc->node >= __nr_nodes)
+		vc->node = 0;
+	vc->socket = c ? c->socket : 0;
+	vc->core = c ? c->core : i;
+	vc->smt = c ? c->smt : 0;
+	if (vc->socket >= __nr_sockets)
+		__nr_sockets = vc->socket + 1;
+}
+
+void topology_lib_init(int nr_vcores)
+{
+	const char *placement = getenv("PARLIB_VCORE_PLACEMENT");
+	__placement = PLACEMENT_NOSMT;
+	if (placement && strcmp(placement, "compact") == 0)
+		__placement = PLACEMENT_COMPACT;
+	else if (placement && strcmp(placement, "scatter") == 0)
+		__placement = PLACEMENT_SCATTER;
+	else if (placement && strcmp(placement, "none") == 0)
+		__placement = PLACEMENT_NONE;
+
+	const char *nodes = getenv("PARLIB_TOPOLOGY_NODES");
+	__fake_nodes = nodes ? atoi(nodes) : 0;
+	if (__fake_nodes < 0 || __fake_nodes > MAX_NODES)
+		__fake_nodes = 0;
+
+	struct cpu_info *cpus = malloc(sizeof(struct cpu_info) * CPU_SETSIZE);
+	int nr_cpus = __read_cpus(cpus);
+	/* Every node we may get CPUs on later counts, not just those we have. */
+	if (!__fake_nodes)
+		__nr_nodes = __sys_nodes;
+	else
+		__nr_nodes = MIN(__fake_nodes, nr_vcores);
+
+	for (int i = 0; i < nr_vcores; i++) {
+		struct cpu_info *c = NULL;
+		if (__placement == PLACEMENT_NONE) {
+			for (int j = 0; j < nr_cpus && c == NULL; j++)
+				if (cpus[j].cpu == i)
+					c = &cpus[j];
+		} else if (nr_cpus) {
+			c = &cpus[i % nr_cpus];
+		}
+		__place(i, c);
+	}
+	free(cpus);
+}
+
+void topology_replace(int nr_created, int nr)
+{
+	if (__placement == PLACEMENT_NONE)
+		return;
+	struct cpu_info *cpus = malloc(sizeof(struct cpu_info) * CPU_SETSIZE);
+	int *load = calloc(CPU_SETSIZE, sizeof(int));
+	int nr_cpus = __read_cpus(cpus);
+	int *where = malloc(sizeof(int) * MAX(nr_created, nr));
+
+	/* The vcores that may stay where they are go first... */
+	for (int i = 0; i < nr_created; i++) {
+		where[i] = -1;
+		for (int j = 0; j < nr_cpus && where[i] < 0; j++)
+			if (cpus[j].cpu == vcore_map(i))
+				where[i] = j;
+		if (where[i] >= 0 && i < nr)
+			load[where[i]]++;
+	}
+	/* ...and the others to the least used CPUs, in order of placement. */
+	for (int i = 0; i < MAX(nr_created, nr) && nr_cpus; i++) {
+		if (i < nr_created && where[i] >= 0)
+			continue;
+		int best = 0;
+		for (int j = 1; j < nr_cpus; j++)
+			if (load[j] < load[best])
+				best = j;
+		if (i < nr)
+			load[best]++;
+		__place(i, &cpus[best]);
+	}
+	free(where);
+	free(load);
+	free(cpus);
+}
+
+void topology_bind(void *addr, size_t len, int node)
+{
+	const int bits = 8 * sizeof(unsigned long);
+	unsigned long mask[MAX_NODES / bits];
+	if (__nr_nodes <= 1 || node < 0 || node >= MAX_NODES)
+		return;
+	memset(mask, 0, sizeof(mask));
+	mask[node / bits] = 1UL << (node % bits);
+	/* The kernel takes maxnode as one more than the number of bits. */
+	syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+}
+
+void *topology_alloc_per_vcore(size_t size, int nr)
+{
+	size_t len = ROUNDUP(size * nr, PGSIZE);
+	void *mem = mmap(0, len, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	for (size_t off = 0; off < len && __nr_nodes > 1; off += PGSIZE) {
+		int vcoreid = MIN((off + PGSIZE / 2) / size, nr - 1);
+		topology_bind(mem + off, PGSIZE, vcore_node(vcoreid));
+	}
+	return mem;
+}
+
+int EXPORT_SYMBOL vcore_distance(int a, int b)
+{
+	struct vcore_pvc_data *va = &vcore_pvc_data[a], *vb = &vcore_pvc_data[b];
+	if (va->pcore == vb->pcore)
+		return VCORE_DIST_CPU;
+	if (va->socket == vb->socket) {
+		if (va->node == vb->node && va->core == vb->core)
+			return VCORE_DIST_CORE;
+		return VCORE_DIST_SOCKET;
+	}
+	if (va->node == vb->node)
+		return VCORE_DIST_NODE;
+	return VCORE_DIST_REMOTE;
+}
+
+int EXPORT_SYMBOL topology_nr_nodes()
+{
+	return __nr_nodes;
+}
+
+int EXPORT_SYMBOL topology_nr_sockets()
+{
+	return __nr_sockets;
+}
+
+/* How many CPUs worth of time our cgroups let us have, rounded up, or 0 if
+ * they don't say.  For cgroup v2, every level up from ours may have a say in
+ * cpu.max.  For v1, only the root of the cpu controller is looked at, which
+ * is what containers see of it. */
+static int __cgroup_cpus()
+{
+	char path[PATH_MAX] = "", line[PATH_MAX];
+	int cpus = 0;
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(path, sizeof(path), "%s", line + 3);
+			}
+		}
+		fclose(f);
+	}
+	for (;;) {
+		char file[PATH_MAX + 64];
+		long quota, period;
+		snprintf(file, sizeof(file), SYSFS_CGROUP "%s/cpu.max", path);
+		/* "max 100000" when there is no limit. */
+		if ((f = fopen(file, "r")) != NULL) {
+			if (fscanf(f, "%ld %ld", &quota, &period) == 2 && quota > 0
+			    && period > 0) {
+				int n = (quota + period - 1) / period;
+				if (cpus == 0 || n < cpus)
+					cpus = n;
+			}
+			fclose(f);
+		}
+		char *slash = strrchr(path, '/');
+		if (slash == NULL)
+			break;
+		*slash = '\0';
+	}
+	int quota = __read_int(SYSFS_CGROUP "/cpu/cpu.cfs_quota_us", -1);
+	int period = __read_int(SYSFS_CGROUP "/cpu/cpu.cfs_period_us", -1);
+	if (quota > 0 && period > 0) {
+		int n = (quota + period - 1) / period;
+		if (cpus == 0 || n < cpus)
+			cpus = n;
+	}
+	return cpus;
+}
+
+static uint64_t __watch_period;
+
+static void *__watch_cpus(void *arg)
+{
+	cpu_set_t last;
+	CPU_ZERO(&last);
+	for (;;) {
+		/* The main thread is never pinned, unlike the vcores. */
+		cpu_set_t allowed;
+		int nr = get_nprocs();
+		if (sched_getaffinity(getpid(), sizeof(allowed), &allowed) == 0)
+			nr = CPU_COUNT(&allowed);
+		else
+			CPU_ZERO(&allowed);
+		int quota = __cgroup_cpus();
+		if (quota && quota < nr)
+			nr = quota;
+		nr = MAX(1, MIN(nr, (int)vcore_capacity()));
+		/* Same number of CPUs, but maybe not the same ones: the vcores on
+		 * those we lost need moving all the same. */
+		if (nr != max_vcores() || !CPU_EQUAL(&allowed, &last))
+			vcore_set_max(nr);
+		last = allowed;
+		usleep(__watch_period);
+	}
+	return NULL;
+}
+
+void EXPORT_SYMBOL vcore_watch_cpus(uint64_t period_usec)
+{
+	run_once(
+		__watch_period = period_usec ? period_usec : 1000000;
+		internal_pthread_create(4 * PTHREAD_STACK_MIN, __watch_cpus, NULL);
+	)
+}
@@ -0,0 +1,62 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_TOPOLOGY_H
+#define PARLIB_TOPOLOGY_H
+
+#include <stdint.h>
+#include "vcore.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the vcores sit on the machine.
+ *
+ * When the vcores get created, the CPUs the process may run on are looked up
+ * in sysfs, with the NUMA node, socket, core and SMT thread of each of them,
+ * and every vcore is pinned to one of them (vcore_map()).  Which one depends
+ * on PARLIB_VCORE_PLACEMENT:
+ *
+ *   nosmt    (default) one vcore per core, node by node, before doubling up
+ *            on the SMT siblings of cores that already have one
+ *   compact  node by node, core by core, SMT siblings next to each other
+ *   scatter  round robin over the nodes, one core of each at a time
+ *   none     vcore i on CPU i, whatever that is
+ *
+ * There are more vcores than CPUs only with VCORE_LIMIT, in which case the
+ * placement starts over.  The ids of the node, socket, core and SMT thread of
+ * each vcore are in vcore_pvc_data (see vcore_node() and friends).
+ *
+ * PARLIB_TOPOLOGY_NODES=n makes believe there are n NUMA nodes, with vcore i
+ * on node i % n, to try out what is NUMA aware on any machine.  Memory bound
+ * to a node that doesn't exist is simply left wherever it lands. */
+
+/* How far apart two vcores are, from sharing a CPU to sharing nothing but the
+ * machine. */
+#define VCORE_DIST_CPU    0
+#define VCORE_DIST_CORE   1   /* SMT siblings */
+#define VCORE_DIST_SOCKET 2
+#define VCORE_DIST_NODE   3   /* same NUMA node, different socket */
+#define VCORE_DIST_REMOTE 4
+int vcore_distance(int a, int b);
+
+/* One more than the highest vcore_node() there can be, and than the highest
+ * vcore_socket() so far.  These are the kernel's ids, so some of them may go unused. */
+int topology_nr_nodes(void);
+int topology_nr_sockets(void);
+
+/* Starts a thread that checks every period_usec (every second if 0) how many
+ * CPUs we may use, going by our affinity mask and by the CPU quota of our
+ * cgroup, and keeps max_vcores() at that with vcore_set_max(), which also
+ * moves the vcores off of any CPUs we lost and puts new ones on those we got.
+ * Vcores are placed in order, so the ones that remain are the best spread
+ * out.  Only the first call does anything.  Started by vcore_lib_init() when
+ * PARLIB_VCORE_WATCH_USEC is set. */
+void vcore_watch_cpus(uint64_t period_usec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARLIB_TOPOLOGY_H
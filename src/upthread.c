@@ -0,0 +1,940 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Pthread-like threads and synchronization built on uthreads, see upthread.h.
+ *
+ * Every object is a spin_pdr_lock() protecting its state, plus a FIFO of the
+ * threads waiting on it.  Waiters live on the stack of the thread that waits.
+ * A uthread that has to wait queues itself and yields with the object still
+ * locked, and the object is only unlocked from vcore context once the uthread
+ * is off its vcore, so whoever dequeues it can make it runnable right away.
+ * Anybody else (plain pthreads, vcore context) queues itself the same way,
+ * but then spins on its waiter until it gets woken up.
+ *
+ * Timed waits from uthreads arm an alarm that takes the waiter back off of
+ * its queue, if nobody dequeued it first.
+ *
+ * Mutexes can be taken over by anybody as soon as they are released, and
+ * their waiters just try again when they get woken up.  Rwlocks are handed
+ * over to whoever they wake up instead.  Like glibc's, they prefer readers
+ * unless they are PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP, so that
+ * readers only ever wait for a writer that holds the lock, and taking a read
+ * lock that is already held never deadlocks. */
+
+#define _GNU_SOURCE
+#include "internal/parlib.h"
+#include "internal/time.h"
+#include "parlib.h"
+#include "upthread.h"
+#include "uthread.h"
+#include "alarm.h"
+#include "atomic.h"
+#include "internal/futex.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UPTHREAD_STACK_SIZE (1024 * 1024)
+
+/* Every object must be usable in place of its pthread counterpart. */
+_Static_assert(sizeof(upthread_mutex_t) <= sizeof(pthread_mutex_t),
+               "upthread_mutex_t doesn't fit in a pthread_mutex_t");
+_Static_assert(offsetof(upthread_mutex_t, type)
+               == offsetof(pthread_mutex_t, __data.__kind),
+               "PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP won't work");
+_Static_assert(sizeof(upthread_cond_t) <= sizeof(pthread_cond_t),
+               "upthread_cond_t doesn't fit in a pthread_cond_t");
+_Static_assert(sizeof(upthread_rwlock_t) <= sizeof(pthread_rwlock_t),
+               "upthread_rwlock_t doesn't fit in a pthread_rwlock_t");
+_Static_assert(sizeof(upthread_barrier_t) <= sizeof(pthread_barrier_t),
+               "upthread_barrier_t doesn't fit in a pthread_barrier_t");
+
+struct upthread {
+	struct uthread uthread; /* must come first */
+	void *(*start_routine)(void *);
+	void *arg;
+	void *retval;
+	spin_pdr_lock_t lock;
+	volatile bool finished;
+	bool detached;
+	/* Whoever is in upthread_join() on us, if anybody. */
+	struct upthread_waiter *joiner;
+	char name[16];
+};
+
+#define WAITER_WAITING  0
+#define WAITER_WOKEN    1
+#define WAITER_TIMEDOUT 2
+
+struct upthread_waiter {
+	struct upthread_waiter *next;
+	/* NULL if the waiter sleeps on state in the kernel instead. */
+	struct uthread *uthread;
+	volatile int state;
+	/* Set once the waker is done waking a sleeping waiter up. */
+	volatile bool wake_done;
+	/* Only used by rwlocks. */
+	bool writer;
+	void *id;
+	/* Only used by timed waits. */
+	spin_pdr_lock_t *lock;
+	struct upthread_waiter **waitq;
+	struct alarm_waiter alarm;
+	volatile bool alarm_done;
+};
+
+/* Where __wait() yields with its object locked. */
+struct block_arg {
+	spin_pdr_lock_t *lock;
+	int reason;
+	/* Released along with lock, for condition variables. */
+	upthread_mutex_t *mutex;
+};
+
+static struct upthread main_thread;
+/* Where main_thread runs, which isn't ours. */
+static void *main_stack;
+static size_t main_stack_size;
+static atomic_t nr_upthreads = ATOMIC_INITIALIZER(1);
+static __thread int __upthread_id;
+
+static void __mutex_release(upthread_mutex_t *mutex);
+
+/* Whether the caller can yield instead of spinning. */
+static inline bool __can_block()
+{
+	return !in_vcore_context() && current_uthread != NULL;
+}
+
+/* Identifies the caller as the owner of a lock. */
+static inline void *__self_id()
+{
+	if (__can_block())
+		return current_uthread;
+	return &__upthread_id;
+}
+
+/* Waiters are kept on a circular list, through a pointer to its tail. */
+static void __waitq_push(struct upthread_waiter **tail,
+                         struct upthread_waiter *w)
+{
+	if (*tail == NULL) {
+		w->next = w;
+	} else {
+		w->next = (*tail)->next;
+		(*tail)->next = w;
+	}
+	*tail = w;
+}
+
+static struct upthread_waiter *__waitq_pop(struct upthread_waiter **tail)
+{
+	struct upthread_waiter *t = *tail;
+	if (t == NULL)
+		return NULL;
+	struct upthread_waiter *h = t->next;
+	if (h == t)
+		*tail = NULL;
+	else
+		t->next = h->next;
+	return h;
+}
+
+static bool __waitq_remove(struct upthread_waiter **tail,
+                           struct upthread_waiter *w)
+{
+	struct upthread_waiter *prev = *tail;
+	if (prev == NULL)
+		return false;
+	do {
+		if (prev->next == w) {
+			if (w == prev)
+				*tail = NULL;
+			else {
+				prev->next = w->next;
+				if (*tail == w)
+					*tail = prev;
+			}
+			return true;
+		}
+		prev = prev->next;
+	} while (prev != *tail);
+	return false;
+}
+
+static void __block_cb(struct uthread *uthread, void *arg)
+{
+	struct block_arg *b = (struct block_arg*)arg;
+	uthread_has_blocked(uthread, b->reason);
+	spin_pdr_unlock(b->lock);
+	if (b->mutex)
+		__mutex_release(b->mutex);
+}
+
+/* Yields the calling uthread, and unlocks lock (which the caller holds) once
+ * it is off its vcore. */
+static void __block(spin_pdr_lock_t *lock, int reason, upthread_mutex_t *mutex)
+{
+	struct block_arg b = { lock, reason, mutex };
+	uthread_yield(true, __block_cb, &b);
+	/* spin_pdr_lock() disabled notifs for us, but we never unlocked. */
+	uth_enable_notifs();
+}
+
+/* Turns abstime, on clock, into a deadline in time_usec(). */
+static int __deadline(clockid_t clock, const struct timespec *abstime,
+                      uint64_t *deadline)
+{
+	if (clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC)
+		return EINVAL;
+	if (abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000)
+		return EINVAL;
+	struct timespec now;
+	clock_gettime(clock, &now);
+	int64_t usec = (int64_t)(abstime->tv_sec - now.tv_sec) * 1000000
+	               + (abstime->tv_nsec - now.tv_nsec) / 1000;
+	if (usec <= 0)
+		return ETIMEDOUT;
+	*deadline = time_usec() + usec;
+	return 0;
+}
+
+/* Times out a uthread waiting on some queue. */
+static void __wait_timeout(struct alarm_waiter *alarm)
+{
+	struct upthread_waiter *w = (struct upthread_waiter*)alarm->data;
+	struct uthread *uthread = w->uthread;
+
+	spin_pdr_lock(w->lock);
+	bool timedout = __waitq_remove(w->waitq, w);
+	if (timedout)
+		w->state = WAITER_TIMEDOUT;
+	spin_pdr_unlock(w->lock);
+
+	/* Unless we just woke it up, the waiter is waiting for this before it
+	 * returns, so this is the last time we can touch it. */
+	wmb();
+	w->alarm_done = true;
+	if (timedout)
+		uthread_runnable(uthread);
+}
+
+/* Queues w on waitq, whose lock the caller holds, and waits for somebody to
+ * dequeue and wake it up, or for deadline (in time_usec(), 0 for none) to
+ * pass.  Uthreads block for reason, anybody else sleeps on a futex.  Returns
+ * with lock released. */
+static int __wait(spin_pdr_lock_t *lock, struct upthread_waiter **waitq,
+                  struct upthread_waiter *w, upthread_mutex_t *mutex,
+                  uint64_t deadline, int reason)
+{
+	w->state = WAITER_WAITING;
+	w->uthread = __can_block() ? current_uthread : NULL;
+	w->wake_done = false;
+	__waitq_push(waitq, w);
+
+	if (w->uthread) {
+		/* Goes off once we are off of our vcore, lock is ours till then. */
+		if (deadline) {
+			w->lock = lock;
+			w->waitq = waitq;
+			w->alarm_done = false;
+			init_awaiter(&w->alarm, __wait_timeout);
+			w->alarm.data = w;
+			set_awaiter_abs(&w->alarm, deadline);
+			set_alarm(&w->alarm);
+		}
+		__block(lock, reason, mutex);
+		if (deadline && !unset_alarm(&w->alarm)) {
+			while (!w->alarm_done)
+				upthread_yield();
+		}
+		return w->state;
+	}
+
+	spin_pdr_unlock(lock);
+	if (mutex)
+		__mutex_release(mutex);
+	while (w->state == WAITER_WAITING) {
+		uint64_t now = deadline ? time_usec() : 0;
+		if (deadline == 0) {
+			futex_wait((void*)&w->state, WAITER_WAITING);
+		} else if (now < deadline) {
+			struct timespec ts = { (deadline - now) / 1000000,
+			                       ((deadline - now) % 1000000) * 1000 };
+			futex_timed_wait((void*)&w->state, WAITER_WAITING, &ts);
+		} else {
+			spin_pdr_lock(lock);
+			if (__waitq_remove(waitq, w))
+				w->state = WAITER_TIMEDOUT;
+			spin_pdr_unlock(lock);
+			/* Too late, somebody is waking us up already. */
+			deadline = 0;
+		}
+	}
+	/* w is on our stack, and __wake() still has to get off of it. */
+	if (w->state == WAITER_WOKEN) {
+		while (!w->wake_done)
+			cpu_relax();
+	}
+	return w->state;
+}
+
+/* Called once w is off its queue, without holding the lock of the queue. */
+static void __wake(struct upthread_waiter *w)
+{
+	struct uthread *uthread = w->uthread;
+	wmb();
+	w->state = WAITER_WOKEN;
+	if (uthread) {
+		uthread_runnable(uthread);
+	} else {
+		futex_wakeup_one((void*)&w->state);
+		wmb();
+		w->wake_done = true;
+	}
+}
+
+static void __wake_all(struct upthread_waiter **waitq)
+{
+	struct upthread_waiter *w;
+	while ((w = __waitq_pop(waitq)))
+		__wake(w);
+}
+
+/* Threads */
+
+static void __upthread_free(struct upthread *t)
+{
+	if (t == &main_thread)
+		return;
+	uthread_cleanup(&t->uthread);
+	free(t);
+}
+
+static void __upthread_start()
+{
+	struct upthread *t = (struct upthread*)current_uthread;
+	upthread_exit(t->start_routine(t->arg));
+}
+
+static void __upthread_exit_cb(struct uthread *uthread, void *arg)
+{
+	struct upthread *t = (struct upthread*)uthread;
+	spin_pdr_lock(&t->lock);
+	t->finished = true;
+	bool detached = t->detached;
+	struct upthread_waiter *joiner = __waitq_pop(&t->joiner);
+	spin_pdr_unlock(&t->lock);
+
+	if (detached)
+		__upthread_free(t);
+	else if (joiner)
+		__wake(joiner);
+
+	/* Just like with pthreads, the last one out ends the process. */
+	if ((long)atomic_add(&nr_upthreads, -1) == 1)
+		exit(0);
+}
+
+static void __upthread_yield_cb(struct uthread *uthread, void *arg)
+{
+	uthread_paused(uthread);
+}
+
+/* Turns the caller into main_thread. */
+static void __upthread_lib_init()
+{
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		pthread_attr_getstack(&attr, &main_stack, &main_stack_size);
+		pthread_attr_destroy(&attr);
+	}
+	uthread_lib_init(&main_thread.uthread);
+}
+
+int EXPORT_SYMBOL upthread_create(upthread_t *thread,
+                                  const pthread_attr_t *attr,
+                                  void *(*start_routine)(void *), void *arg)
+{
+	run_once(__upthread_lib_init());
+
+	size_t stack_size = UPTHREAD_STACK_SIZE;
+	int detachstate = PTHREAD_CREATE_JOINABLE;
+	if (attr) {
+		pthread_attr_getstacksize(attr, &stack_size);
+		pthread_attr_getdetachstate(attr, &detachstate);
+	}
+
+	struct upthread *t = calloc(1, sizeof(struct upthread));
+	if (t == NULL)
+		return EAGAIN;
+	t->start_routine = start_routine;
+	t->arg = arg;
+	t->detached = (detachstate == PTHREAD_CREATE_DETACHED);
+	spin_pdr_init(&t->lock);
+
+	uthread_init(&t->uthread);
+	if (init_uthread_tf(&t->uthread, __upthread_start, NULL, stack_size)) {
+		uthread_cleanup(&t->uthread);
+		free(t);
+		return EAGAIN;
+	}
+	atomic_add(&nr_upthreads, 1);
+	*thread = t;
+	uthread_runnable(&t->uthread);
+	return 0;
+}
+
+/* Waits for t to finish, until deadline (in time_usec(), 0 for none). */
+static int __join(upthread_t t, void **retval, uint64_t deadline)
+{
+	if (t == upthread_self())
+		return EDEADLK;
+
+	spin_pdr_lock(&t->lock);
+	if (t->detached || t->joiner) {
+		spin_pdr_unlock(&t->lock);
+		return EINVAL;
+	}
+	if (t->finished) {
+		spin_pdr_unlock(&t->lock);
+	} else {
+		struct upthread_waiter w;
+		if (__wait(&t->lock, &t->joiner, &w, NULL, deadline,
+		           UTH_EXT_BLK_JOIN) == WAITER_TIMEDOUT)
+			return ETIMEDOUT;
+	}
+
+	if (retval)
+		*retval = t->retval;
+	__upthread_free(t);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_join(upthread_t t, void **retval)
+{
+	return __join(t, retval, 0);
+}
+
+int EXPORT_SYMBOL upthread_tryjoin_np(upthread_t t, void **retval)
+{
+	if (t == upthread_self())
+		return EDEADLK;
+
+	spin_pdr_lock(&t->lock);
+	int ret = 0;
+	if (t->detached || t->joiner)
+		ret = EINVAL;
+	else if (!t->finished)
+		ret = EBUSY;
+	spin_pdr_unlock(&t->lock);
+	if (ret)
+		return ret;
+
+	if (retval)
+		*retval = t->retval;
+	__upthread_free(t);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_clockjoin_np(upthread_t t, void **retval,
+                                        clockid_t clock,
+                                        const struct timespec *abstime)
+{
+	/* A thread that is done already can be joined no matter the time. */
+	int ret = upthread_tryjoin_np(t, retval);
+	if (ret != EBUSY)
+		return ret;
+	uint64_t deadline;
+	ret = __deadline(clock, abstime, &deadline);
+	if (ret)
+		return ret;
+	return __join(t, retval, deadline);
+}
+
+int EXPORT_SYMBOL upthread_timedjoin_np(upthread_t t, void **retval,
+                                        const struct timespec *abstime)
+{
+	return upthread_clockjoin_np(t, retval, CLOCK_REALTIME, abstime);
+}
+
+int EXPORT_SYMBOL upthread_detach(upthread_t t)
+{
+	spin_pdr_lock(&t->lock);
+	if (t->detached) {
+		spin_pdr_unlock(&t->lock);
+		return EINVAL;
+	}
+	t->detached = true;
+	bool finished = t->finished;
+	spin_pdr_unlock(&t->lock);
+	if (finished)
+		__upthread_free(t);
+	return 0;
+}
+
+void EXPORT_SYMBOL upthread_exit(void *retval)
+{
+	struct upthread *t = upthread_self();
+	assert(t);
+	t->retval = retval;
+	uthread_yield(false, __upthread_exit_cb, NULL);
+	assert(0);
+	__builtin_unreachable();
+}
+
+upthread_t EXPORT_SYMBOL upthread_self()
+{
+	return (struct upthread*)current_uthread;
+}
+
+int EXPORT_SYMBOL upthread_getattr_np(upthread_t t, pthread_attr_t *attr)
+{
+	int ret = pthread_attr_init(attr);
+	if (ret)
+		return ret;
+	pthread_attr_setdetachstate(attr, t->detached ? PTHREAD_CREATE_DETACHED
+	                                              : PTHREAD_CREATE_JOINABLE);
+	if (t == &main_thread)
+		ret = pthread_attr_setstack(attr, main_stack, main_stack_size);
+	else
+		ret = pthread_attr_setstack(attr, t->uthread.stack,
+		                            t->uthread.stack_size);
+	if (ret)
+		pthread_attr_destroy(attr);
+	return ret;
+}
+
+int EXPORT_SYMBOL upthread_setname_np(upthread_t t, const char *name)
+{
+	if (strlen(name) >= sizeof(t->name))
+		return ERANGE;
+	spin_pdr_lock(&t->lock);
+	strcpy(t->name, name);
+	spin_pdr_unlock(&t->lock);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_getname_np(upthread_t t, char *name, size_t len)
+{
+	int ret = 0;
+	spin_pdr_lock(&t->lock);
+	if (strlen(t->name) >= len)
+		ret = ERANGE;
+	else
+		strcpy(name, t->name);
+	spin_pdr_unlock(&t->lock);
+	return ret;
+}
+
+int EXPORT_SYMBOL upthread_kill(upthread_t t, int sig)
+{
+	if (sig == 0)
+		return 0;
+	/* Only the caller stays on the same vcore long enough to get it. */
+	if (t != upthread_self())
+		return ENOTSUP;
+	return raise(sig) ? errno : 0;
+}
+
+void EXPORT_SYMBOL upthread_yield()
+{
+	if (__can_block())
+		uthread_yield(true, __upthread_yield_cb, NULL);
+	else
+		cpu_relax();
+}
+
+/* Mutexes */
+
+int EXPORT_SYMBOL upthread_mutex_init(upthread_mutex_t *mutex,
+                                      const pthread_mutexattr_t *attr)
+{
+	memset(mutex, 0, sizeof(upthread_mutex_t));
+	if (attr)
+		pthread_mutexattr_gettype(attr, &mutex->type);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_mutex_destroy(upthread_mutex_t *mutex)
+{
+	return mutex->owner ? EBUSY : 0;
+}
+
+/* Only times out after deadline if it has to wait for the mutex at all. */
+static int __mutex_lock(upthread_mutex_t *mutex, clockid_t clock,
+                        const struct timespec *abstime)
+{
+	void *self = __self_id();
+	uint64_t deadline = 0;
+	spin_pdr_lock(&mutex->lock);
+	while (mutex->owner) {
+		if (mutex->owner == self) {
+			int ret = EDEADLK;
+			if (mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+				mutex->count++;
+				ret = 0;
+			}
+			spin_pdr_unlock(&mutex->lock);
+			return ret;
+		}
+		if (abstime && deadline == 0) {
+			int ret = __deadline(clock, abstime, &deadline);
+			if (ret) {
+				spin_pdr_unlock(&mutex->lock);
+				return ret;
+			}
+		}
+		struct upthread_waiter w;
+		if (__wait(&mutex->lock, &mutex->waiters, &w, NULL, deadline,
+		           UTH_EXT_BLK_MUTEX) == WAITER_TIMEDOUT)
+			return ETIMEDOUT;
+		spin_pdr_lock(&mutex->lock);
+	}
+	mutex->owner = self;
+	mutex->count = 1;
+	spin_pdr_unlock(&mutex->lock);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_mutex_lock(upthread_mutex_t *mutex)
+{
+	return __mutex_lock(mutex, CLOCK_REALTIME, NULL);
+}
+
+int EXPORT_SYMBOL upthread_mutex_timedlock(upthread_mutex_t *mutex,
+                                           const struct timespec *abstime)
+{
+	return __mutex_lock(mutex, CLOCK_REALTIME, abstime);
+}
+
+int EXPORT_SYMBOL upthread_mutex_clocklock(upthread_mutex_t *mutex,
+                                           clockid_t clock,
+                                           const struct timespec *abstime)
+{
+	return __mutex_lock(mutex, clock, abstime);
+}
+
+int EXPORT_SYMBOL upthread_mutex_trylock(upthread_mutex_t *mutex)
+{
+	void *self = __self_id();
+	int ret = 0;
+	spin_pdr_lock(&mutex->lock);
+	if (mutex->owner == NULL) {
+		mutex->owner = self;
+		mutex->count = 1;
+	} else if (mutex->owner == self &&
+	           mutex->type == PTHREAD_MUTEX_RECURSIVE) {
+		mutex->count++;
+	} else {
+		ret = EBUSY;
+	}
+	spin_pdr_unlock(&mutex->lock);
+	return ret;
+}
+
+/* Releases mutex, no matter who holds it or how many times. */
+static void __mutex_release(upthread_mutex_t *mutex)
+{
+	spin_pdr_lock(&mutex->lock);
+	mutex->owner = NULL;
+	mutex->count = 0;
+	struct upthread_waiter *w = __waitq_pop(&mutex->waiters);
+	spin_pdr_unlock(&mutex->lock);
+	if (w)
+		__wake(w);
+}
+
+int EXPORT_SYMBOL upthread_mutex_unlock(upthread_mutex_t *mutex)
+{
+	spin_pdr_lock(&mutex->lock);
+	if (mutex->owner != __self_id()) {
+		spin_pdr_unlock(&mutex->lock);
+		return EPERM;
+	}
+	if (--mutex->count > 0) {
+		spin_pdr_unlock(&mutex->lock);
+		return 0;
+	}
+	spin_pdr_unlock(&mutex->lock);
+	__mutex_release(mutex);
+	return 0;
+}
+
+/* Condition variables */
+
+int EXPORT_SYMBOL upthread_cond_init(upthread_cond_t *cond,
+                                     const pthread_condattr_t *attr)
+{
+	memset(cond, 0, sizeof(upthread_cond_t));
+	cond->clock = CLOCK_REALTIME;
+	if (attr)
+		pthread_condattr_getclock(attr, &cond->clock);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_cond_destroy(upthread_cond_t *cond)
+{
+	return cond->waiters ? EBUSY : 0;
+}
+
+static int __cond_wait(upthread_cond_t *cond, upthread_mutex_t *mutex,
+                       clockid_t clock, const struct timespec *abstime)
+{
+	struct upthread_waiter w;
+	uint64_t deadline = 0;
+	unsigned int count = mutex->count;
+
+	if (abstime) {
+		int ret = __deadline(clock, abstime, &deadline);
+		if (ret)
+			return ret;
+	}
+
+	spin_pdr_lock(&cond->lock);
+	int state = __wait(&cond->lock, &cond->waiters, &w, mutex, deadline,
+	                   UTH_EXT_BLK_MUTEX);
+	upthread_mutex_lock(mutex);
+	mutex->count = count;
+	return state == WAITER_TIMEDOUT ? ETIMEDOUT : 0;
+}
+
+int EXPORT_SYMBOL upthread_cond_wait(upthread_cond_t *cond,
+                                     upthread_mutex_t *mutex)
+{
+	return __cond_wait(cond, mutex, cond->clock, NULL);
+}
+
+int EXPORT_SYMBOL upthread_cond_timedwait(upthread_cond_t *cond,
+                                          upthread_mutex_t *mutex,
+                                          const struct timespec *abstime)
+{
+	return __cond_wait(cond, mutex, cond->clock, abstime);
+}
+
+int EXPORT_SYMBOL upthread_cond_clockwait(upthread_cond_t *cond,
+                                          upthread_mutex_t *mutex,
+                                          clockid_t clock,
+                                          const struct timespec *abstime)
+{
+	return __cond_wait(cond, mutex, clock, abstime);
+}
+
+int EXPORT_SYMBOL upthread_cond_signal(upthread_cond_t *cond)
+{
+	/* Unlocked peek, just like the futex-based implementation does. */
+	if (cond->waiters == NULL)
+		return 0;
+	spin_pdr_lock(&cond->lock);
+	struct upthread_waiter *w = __waitq_pop(&cond->waiters);
+	spin_pdr_unlock(&cond->lock);
+	if (w)
+		__wake(w);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_cond_broadcast(upthread_cond_t *cond)
+{
+	if (cond->waiters == NULL)
+		return 0;
+	spin_pdr_lock(&cond->lock);
+	struct upthread_waiter *waiters = cond->waiters;
+	cond->waiters = NULL;
+	spin_pdr_unlock(&cond->lock);
+	__wake_all(&waiters);
+	return 0;
+}
+
+/* Rwlocks */
+
+int EXPORT_SYMBOL upthread_rwlock_init(upthread_rwlock_t *rwlock,
+                                       const pthread_rwlockattr_t *attr)
+{
+	memset(rwlock, 0, sizeof(upthread_rwlock_t));
+	if (attr)
+		pthread_rwlockattr_getkind_np(attr, &rwlock->kind);
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_rwlock_destroy(upthread_rwlock_t *rwlock)
+{
+	return (rwlock->writer || rwlock->readers) ? EBUSY : 0;
+}
+
+static inline bool __prefer_writers(upthread_rwlock_t *rwlock)
+{
+	return rwlock->kind == PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP;
+}
+
+static int __rwlock_lock(upthread_rwlock_t *rwlock, bool writer, bool try,
+                         clockid_t clock, const struct timespec *abstime)
+{
+	void *self = __self_id();
+	uint64_t deadline = 0;
+	spin_pdr_lock(&rwlock->lock);
+	if (rwlock->writer == self) {
+		spin_pdr_unlock(&rwlock->lock);
+		return EDEADLK;
+	}
+	/* Writers wait for anybody that waits, for whoever holds the lock to let
+	 * go.  Readers only do when writers are preferred. */
+	bool can_lock = !rwlock->writer;
+	if (writer)
+		can_lock = can_lock && !rwlock->readers && !rwlock->waiters;
+	else if (__prefer_writers(rwlock))
+		can_lock = can_lock && !rwlock->waiters;
+	if (can_lock) {
+		if (writer)
+			rwlock->writer = self;
+		else
+			rwlock->readers++;
+		spin_pdr_unlock(&rwlock->lock);
+		return 0;
+	}
+	int ret = try ? EBUSY : 0;
+	if (abstime && !try)
+		ret = __deadline(clock, abstime, &deadline);
+	if (ret) {
+		spin_pdr_unlock(&rwlock->lock);
+		return ret;
+	}
+	/* Whoever wakes us up hands us the lock. */
+	struct upthread_waiter w;
+	w.writer = writer;
+	w.id = self;
+	if (__wait(&rwlock->lock, &rwlock->waiters, &w, NULL, deadline,
+	           UTH_EXT_BLK_MUTEX) == WAITER_TIMEDOUT)
+		return ETIMEDOUT;
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_rwlock_rdlock(upthread_rwlock_t *rwlock)
+{
+	return __rwlock_lock(rwlock, false, false, CLOCK_REALTIME, NULL);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_tryrdlock(upthread_rwlock_t *rwlock)
+{
+	return __rwlock_lock(rwlock, false, true, CLOCK_REALTIME, NULL);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_timedrdlock(upthread_rwlock_t *rwlock,
+                                              const struct timespec *abstime)
+{
+	return __rwlock_lock(rwlock, false, false, CLOCK_REALTIME, abstime);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_clockrdlock(upthread_rwlock_t *rwlock,
+                                              clockid_t clock,
+                                              const struct timespec *abstime)
+{
+	return __rwlock_lock(rwlock, false, false, clock, abstime);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_wrlock(upthread_rwlock_t *rwlock)
+{
+	return __rwlock_lock(rwlock, true, false, CLOCK_REALTIME, NULL);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_trywrlock(upthread_rwlock_t *rwlock)
+{
+	return __rwlock_lock(rwlock, true, true, CLOCK_REALTIME, NULL);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_timedwrlock(upthread_rwlock_t *rwlock,
+                                              const struct timespec *abstime)
+{
+	return __rwlock_lock(rwlock, true, false, CLOCK_REALTIME, abstime);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_clockwrlock(upthread_rwlock_t *rwlock,
+                                              clockid_t clock,
+                                              const struct timespec *abstime)
+{
+	return __rwlock_lock(rwlock, true, false, clock, abstime);
+}
+
+int EXPORT_SYMBOL upthread_rwlock_unlock(upthread_rwlock_t *rwlock)
+{
+	struct upthread_waiter *woken = NULL;
+
+	spin_pdr_lock(&rwlock->lock);
+	if (rwlock->writer) {
+		if (rwlock->writer != __self_id()) {
+			spin_pdr_unlock(&rwlock->lock);
+			return EPERM;
+		}
+		rwlock->writer = NULL;
+	} else if (rwlock->readers > 0) {
+		rwlock->readers--;
+	} else {
+		spin_pdr_unlock(&rwlock->lock);
+		return EPERM;
+	}
+	/* Hand the lock over to all of the readers if we prefer them, or else
+	 * to the next writer, or to all of the readers queued before it. */
+	if (rwlock->readers == 0 && rwlock->waiters && !__prefer_writers(rwlock)) {
+		struct upthread_waiter *writers = NULL, *w;
+		while ((w = __waitq_pop(&rwlock->waiters))) {
+			if (w->writer) {
+				__waitq_push(&writers, w);
+			} else {
+				__waitq_push(&woken, w);
+				rwlock->readers++;
+			}
+		}
+		rwlock->waiters = writers;
+	}
+	if (rwlock->readers == 0 && rwlock->waiters) {
+		struct upthread_waiter *w = rwlock->waiters->next;
+		if (w->writer) {
+			__waitq_push(&woken, __waitq_pop(&rwlock->waiters));
+			rwlock->writer = w->id;
+		} else {
+			while (rwlock->waiters && !rwlock->waiters->next->writer) {
+				__waitq_push(&woken, __waitq_pop(&rwlock->waiters));
+				rwlock->readers++;
+			}
+		}
+	}
+	spin_pdr_unlock(&rwlock->lock);
+	__wake_all(&woken);
+	return 0;
+}
+
+/* Barriers */
+
+int EXPORT_SYMBOL upthread_barrier_init(upthread_barrier_t *barrier,
+                                        const pthread_barrierattr_t *attr,
+                                        unsigned int count)
+{
+	if (count == 0)
+		return EINVAL;
+	memset(barrier, 0, sizeof(upthread_barrier_t));
+	barrier->count = count;
+	return 0;
+}
+
+int EXPORT_SYMBOL upthread_barrier_destroy(upthread_barrier_t *barrier)
+{
+	return barrier->waiters ? EBUSY : 0;
+}
+
+int EXPORT_SYMBOL upthread_barrier_wait(upthread_barrier_t *barrier)
+{
+	spin_pdr_lock(&barrier->lock);
+	if (++barrier->arrived == barrier->count) {
+		struct upthread_waiter *waiters = barrier->waiters;
+		barrier->waiters = NULL;
+		barrier->arrived = 0;
+		spin_pdr_unlock(&barrier->lock);
+		__wake_all(&waiters);
+		return PTHREAD_BARRIER_SERIAL_THREAD;
+	}
+	struct upthread_waiter w;
+	__wait(&barrier->lock, &barrier->waiters, &w, NULL, 0, UTH_EXT_BLK_MUTEX);
+	return 0;
+}
@@ -0,0 +1,139 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_UPTHREAD_H
+#define PARLIB_UPTHREAD_H
+
+#include <pthread.h>
+#include <time.h>
+#include "uthread.h"
+#include "spinlock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pthread-like threads and synchronization built on uthreads.
+ *
+ * Upthreads are uthreads with a stack, a return value and join semantics,
+ * scheduled by whatever 2LS sched_ops points to (wsched by default).  The
+ * first call to upthread_create() turns the calling thread into the main
+ * upthread.  Blocking on any of the objects below yields the calling uthread
+ * to its vcore instead of blocking the vcore in the kernel, and waking it up
+ * is just a uthread_runnable().  Plain pthreads (and vcore context) can use
+ * the same objects too, they just spin instead of blocking.
+ *
+ * Attributes are regular pthread attributes, and every object fits in its
+ * pthread counterpart.  All zeroes is a valid default object, which is what
+ * PTHREAD_*_INITIALIZER expands to as well.  Rwlocks prefer readers unless
+ * their attribute asks for PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP.
+ * Upthreads have no scheduling parameters or CPU affinity of their own, since
+ * they run on whichever vcore the 2LS puts them on.
+ * Build with libupthread_preload.so in LD_PRELOAD to have existing pthread
+ * code use these instead. */
+
+typedef struct upthread *upthread_t;
+
+struct upthread_waiter;
+
+typedef struct upthread_mutex {
+	spin_pdr_lock_t lock;
+	unsigned int count;             /* recursion depth */
+	void *owner;
+	int type;                       /* at the offset of glibc's __kind */
+	struct upthread_waiter *waiters;
+} upthread_mutex_t;
+
+typedef struct upthread_cond {
+	spin_pdr_lock_t lock;
+	clockid_t clock;
+	struct upthread_waiter *waiters;
+} upthread_cond_t;
+
+typedef struct upthread_rwlock {
+	spin_pdr_lock_t lock;
+	int readers;
+	int kind;                       /* PTHREAD_RWLOCK_PREFER_*_NP */
+	void *writer;
+	struct upthread_waiter *waiters;
+} upthread_rwlock_t;
+
+#define UPTHREAD_MUTEX_INITIALIZER {SPINPDR_INITIALIZER}
+#define UPTHREAD_COND_INITIALIZER {SPINPDR_INITIALIZER}
+#define UPTHREAD_RWLOCK_INITIALIZER {SPINPDR_INITIALIZER}
+
+typedef struct upthread_barrier {
+	spin_pdr_lock_t lock;
+	unsigned int count;
+	unsigned int arrived;
+	struct upthread_waiter *waiters;
+} upthread_barrier_t;
+
+int upthread_create(upthread_t *thread, const pthread_attr_t *attr,
+                    void *(*start_routine)(void *), void *arg);
+int upthread_join(upthread_t thread, void **retval);
+int upthread_tryjoin_np(upthread_t thread, void **retval);
+int upthread_timedjoin_np(upthread_t thread, void **retval,
+                          const struct timespec *abstime);
+int upthread_clockjoin_np(upthread_t thread, void **retval, clockid_t clock,
+                          const struct timespec *abstime);
+int upthread_detach(upthread_t thread);
+void upthread_exit(void *retval) __attribute__((noreturn));
+upthread_t upthread_self(void);
+int upthread_getattr_np(upthread_t thread, pthread_attr_t *attr);
+int upthread_setname_np(upthread_t thread, const char *name);
+int upthread_getname_np(upthread_t thread, char *name, size_t len);
+/* Only signals the calling upthread, ENOTSUP for any other. */
+int upthread_kill(upthread_t thread, int sig);
+/* Lets other uthreads run on the calling vcore. */
+void upthread_yield(void);
+
+int upthread_mutex_init(upthread_mutex_t *mutex,
+                        const pthread_mutexattr_t *attr);
+int upthread_mutex_destroy(upthread_mutex_t *mutex);
+int upthread_mutex_lock(upthread_mutex_t *mutex);
+int upthread_mutex_trylock(upthread_mutex_t *mutex);
+int upthread_mutex_timedlock(upthread_mutex_t *mutex,
+                             const struct timespec *abstime);
+int upthread_mutex_clocklock(upthread_mutex_t *mutex, clockid_t clock,
+                             const struct timespec *abstime);
+int upthread_mutex_unlock(upthread_mutex_t *mutex);
+
+int upthread_cond_init(upthread_cond_t *cond, const pthread_condattr_t *attr);
+int upthread_cond_destroy(upthread_cond_t *cond);
+int upthread_cond_wait(upthread_cond_t *cond, upthread_mutex_t *mutex);
+int upthread_cond_timedwait(upthread_cond_t *cond, upthread_mutex_t *mutex,
+                            const struct timespec *abstime);
+int upthread_cond_clockwait(upthread_cond_t *cond, upthread_mutex_t *mutex,
+                            clockid_t clock, const struct timespec *abstime);
+int upthread_cond_signal(upthread_cond_t *cond);
+int upthread_cond_broadcast(upthread_cond_t *cond);
+
+int upthread_rwlock_init(upthread_rwlock_t *rwlock,
+                         const pthread_rwlockattr_t *attr);
+int upthread_rwlock_destroy(upthread_rwlock_t *rwlock);
+int upthread_rwlock_rdlock(upthread_rwlock_t *rwlock);
+int upthread_rwlock_tryrdlock(upthread_rwlock_t *rwlock);
+int upthread_rwlock_timedrdlock(upthread_rwlock_t *rwlock,
+                                const struct timespec *abstime);
+int upthread_rwlock_clockrdlock(upthread_rwlock_t *rwlock, clockid_t clock,
+                                const struct timespec *abstime);
+int upthread_rwlock_wrlock(upthread_rwlock_t *rwlock);
+int upthread_rwlock_trywrlock(upthread_rwlock_t *rwlock);
+int upthread_rwlock_timedwrlock(upthread_rwlock_t *rwlock,
+                                const struct timespec *abstime);
+int upthread_rwlock_clockwrlock(upthread_rwlock_t *rwlock, clockid_t clock,
+                                const struct timespec *abstime);
+int upthread_rwlock_unlock(upthread_rwlock_t *rwlock);
+
+int upthread_barrier_init(upthread_barrier_t *barrier,
+                          const pthread_barrierattr_t *attr,
+                          unsigned int count);
+int upthread_barrier_destroy(upthread_barrier_t *barrier);
+int upthread_barrier_wait(upthread_barrier_t *barrier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARLIB_UPTHREAD_H
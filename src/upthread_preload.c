@@ -0,0 +1,442 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* LD_PRELOAD shim routing the pthread API to upthreads, so that existing
+ * pthread code runs on vcores:
+ *
+ *   LD_PRELOAD=libupthread_preload.so ./app
+ *
+ * Synchronization objects are always upthread ones, whoever uses them, so
+ * every call that takes one of them has to be caught here.  Thread creation
+ * only goes to upthreads when called from application code that runs in a
+ * uthread, or from the main thread before it becomes one.  Parlib itself
+ * creates plain pthreads for its vcores and backing threads through the very
+ * same pthread_create(), which has to keep going to libpthread.
+ *
+ * The pthread_t of an upthread is its upthread_t with the lowest bit set,
+ * which no real pthread_t has, so every call that takes a pthread_t can tell
+ * which kind of thread it is about. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include "parlib.h"
+#include "upthread.h"
+#include "vcore.h"
+#include "export.h"
+
+static bool initialized = false;
+
+#define real(name) \
+({ \
+	static __typeof__(name) *__fn; \
+	if (__fn == NULL) \
+		__fn = (__typeof__(name)*)dlsym(RTLD_NEXT, #name); \
+	__fn; \
+})
+
+#define UPTHREAD_TAG 1UL
+
+static inline bool __is_upthread(pthread_t thread)
+{
+	return thread & UPTHREAD_TAG;
+}
+
+static inline upthread_t __upthread(pthread_t thread)
+{
+	return (upthread_t)(thread & ~UPTHREAD_TAG);
+}
+
+static inline pthread_t __pthread(upthread_t thread)
+{
+	return (pthread_t)thread | UPTHREAD_TAG;
+}
+
+/* Whether the code calling us lives in libparlib. */
+static bool __called_from_parlib(void *caller)
+{
+	static void *parlib_base;
+	Dl_info info;
+	if (parlib_base == NULL) {
+		if (!dladdr((void*)upthread_create, &info))
+			return false;
+		parlib_base = info.dli_fbase;
+	}
+	return dladdr(caller, &info) && info.dli_fbase == parlib_base;
+}
+
+/* Whether the caller is application code running in a uthread. */
+static inline bool __in_upthread()
+{
+	return initialized && !in_vcore_context() && current_uthread != NULL;
+}
+
+int EXPORT_SYMBOL pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                                 void *(*start_routine)(void *), void *arg)
+{
+	if (__called_from_parlib(__builtin_return_address(0)))
+		return real(pthread_create)(thread, attr, start_routine, arg);
+	/* Once the main thread is a uthread, plain pthreads stay plain. */
+	if (initialized && !__in_upthread())
+		return real(pthread_create)(thread, attr, start_routine, arg);
+	initialized = true;
+	upthread_t t;
+	int ret = upthread_create(&t, attr, start_routine, arg);
+	if (ret == 0)
+		*thread = __pthread(t);
+	return ret;
+}
+
+int EXPORT_SYMBOL pthread_join(pthread_t thread, void **retval)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_join)(thread, retval);
+	return upthread_join(__upthread(thread), retval);
+}
+
+int EXPORT_SYMBOL pthread_tryjoin_np(pthread_t thread, void **retval)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_tryjoin_np)(thread, retval);
+	return upthread_tryjoin_np(__upthread(thread), retval);
+}
+
+int EXPORT_SYMBOL pthread_timedjoin_np(pthread_t thread, void **retval,
+                                       const struct timespec *abstime)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_timedjoin_np)(thread, retval, abstime);
+	return upthread_timedjoin_np(__upthread(thread), retval, abstime);
+}
+
+int EXPORT_SYMBOL pthread_clockjoin_np(pthread_t thread, void **retval,
+                                       clockid_t clock,
+                                       const struct timespec *abstime)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_clockjoin_np)(thread, retval, clock, abstime);
+	return upthread_clockjoin_np(__upthread(thread), retval, clock, abstime);
+}
+
+int EXPORT_SYMBOL pthread_detach(pthread_t thread)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_detach)(thread);
+	return upthread_detach(__upthread(thread));
+}
+
+void EXPORT_SYMBOL pthread_exit(void *retval)
+{
+	if (!__in_upthread())
+		real(pthread_exit)(retval);
+	upthread_exit(retval);
+}
+
+pthread_t EXPORT_SYMBOL pthread_self(void)
+{
+	if (!__in_upthread())
+		return real(pthread_self)();
+	return __pthread(upthread_self());
+}
+
+int EXPORT_SYMBOL pthread_getattr_np(pthread_t thread, pthread_attr_t *attr)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_getattr_np)(thread, attr);
+	return upthread_getattr_np(__upthread(thread), attr);
+}
+
+int EXPORT_SYMBOL pthread_setname_np(pthread_t thread, const char *name)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_setname_np)(thread, name);
+	return upthread_setname_np(__upthread(thread), name);
+}
+
+int EXPORT_SYMBOL pthread_getname_np(pthread_t thread, char *name, size_t len)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_getname_np)(thread, name, len);
+	return upthread_getname_np(__upthread(thread), name, len);
+}
+
+int EXPORT_SYMBOL pthread_kill(pthread_t thread, int sig)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_kill)(thread, sig);
+	return upthread_kill(__upthread(thread), sig);
+}
+
+int EXPORT_SYMBOL pthread_sigqueue(pthread_t thread, int sig,
+                                   const union sigval value)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_sigqueue)(thread, sig, value);
+	if (sig == 0)
+		return 0;
+	if (__upthread(thread) != upthread_self())
+		return ENOTSUP;
+	/* We stay on this vcore until the signal is taken. */
+	return real(pthread_sigqueue)(real(pthread_self)(), sig, value);
+}
+
+int EXPORT_SYMBOL pthread_cancel(pthread_t thread)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_cancel)(thread);
+	return ENOTSUP;
+}
+
+/* Upthreads run wherever the 2LS puts them, which is on any of our CPUs, at
+ * whatever priority their vcore has. */
+
+int EXPORT_SYMBOL pthread_setaffinity_np(pthread_t thread, size_t cpusetsize,
+                                         const cpu_set_t *cpuset)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_setaffinity_np)(thread, cpusetsize, cpuset);
+	return ENOTSUP;
+}
+
+int EXPORT_SYMBOL pthread_getaffinity_np(pthread_t thread, size_t cpusetsize,
+                                         cpu_set_t *cpuset)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_getaffinity_np)(thread, cpusetsize, cpuset);
+	if (sched_getaffinity(getpid(), cpusetsize, cpuset) != 0)
+		return errno;
+	return 0;
+}
+
+int EXPORT_SYMBOL pthread_setschedparam(pthread_t thread, int policy,
+                                        const struct sched_param *param)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_setschedparam)(thread, policy, param);
+	return ENOTSUP;
+}
+
+int EXPORT_SYMBOL pthread_getschedparam(pthread_t thread, int *policy,
+                                        struct sched_param *param)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_getschedparam)(thread, policy, param);
+	*policy = SCHED_OTHER;
+	memset(param, 0, sizeof(struct sched_param));
+	return 0;
+}
+
+int EXPORT_SYMBOL pthread_setschedprio(pthread_t thread, int prio)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_setschedprio)(thread, prio);
+	return ENOTSUP;
+}
+
+int EXPORT_SYMBOL pthread_getcpuclockid(pthread_t thread, clockid_t *clock)
+{
+	if (!__is_upthread(thread))
+		return real(pthread_getcpuclockid)(thread, clock);
+	return ENOENT;
+}
+
+int EXPORT_SYMBOL sched_yield(void)
+{
+	if (!__in_upthread() || __called_from_parlib(__builtin_return_address(0)))
+		return real(sched_yield)();
+	upthread_yield();
+	return 0;
+}
+
+#define upthread_obj(type, obj) ((upthread_##type##_t*)(obj))
+
+int EXPORT_SYMBOL pthread_mutex_init(pthread_mutex_t *mutex,
+                                     const pthread_mutexattr_t *attr)
+{
+	return upthread_mutex_init(upthread_obj(mutex, mutex), attr);
+}
+
+int EXPORT_SYMBOL pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+	return upthread_mutex_destroy(upthread_obj(mutex, mutex));
+}
+
+int EXPORT_SYMBOL pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+	return upthread_mutex_lock(upthread_obj(mutex, mutex));
+}
+
+int EXPORT_SYMBOL pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+	return upthread_mutex_trylock(upthread_obj(mutex, mutex));
+}
+
+int EXPORT_SYMBOL pthread_mutex_timedlock(pthread_mutex_t *mutex,
+                                          const struct timespec *abstime)
+{
+	return upthread_mutex_timedlock(upthread_obj(mutex, mutex), abstime);
+}
+
+int EXPORT_SYMBOL pthread_mutex_clocklock(pthread_mutex_t *mutex,
+                                          clockid_t clock,
+                                          const struct timespec *abstime)
+{
+	return upthread_mutex_clocklock(upthread_obj(mutex, mutex), clock,
+	                                abstime);
+}
+
+int EXPORT_SYMBOL pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+	return upthread_mutex_unlock(upthread_obj(mutex, mutex));
+}
+
+/* Upthread mutexes are neither robust nor priority protected. */
+
+int EXPORT_SYMBOL pthread_mutex_consistent(pthread_mutex_t *mutex)
+{
+	return EINVAL;
+}
+
+int EXPORT_SYMBOL pthread_mutex_getprioceiling(const pthread_mutex_t *mutex,
+                                               int *prioceiling)
+{
+	return EINVAL;
+}
+
+int EXPORT_SYMBOL pthread_mutex_setprioceiling(pthread_mutex_t *mutex,
+                                               int prioceiling,
+                                               int *old_ceiling)
+{
+	return EINVAL;
+}
+
+int EXPORT_SYMBOL pthread_cond_init(pthread_cond_t *cond,
+                                    const pthread_condattr_t *attr)
+{
+	return upthread_cond_init(upthread_obj(cond, cond), attr);
+}
+
+int EXPORT_SYMBOL pthread_cond_destroy(pthread_cond_t *cond)
+{
+	return upthread_cond_destroy(upthread_obj(cond, cond));
+}
+
+int EXPORT_SYMBOL pthread_cond_wait(pthread_cond_t *cond,
+                                    pthread_mutex_t *mutex)
+{
+	return upthread_cond_wait(upthread_obj(cond, cond),
+	                          upthread_obj(mutex, mutex));
+}
+
+int EXPORT_SYMBOL pthread_cond_timedwait(pthread_cond_t *cond,
+                                         pthread_mutex_t *mutex,
+                                         const struct timespec *abstime)
+{
+	return upthread_cond_timedwait(upthread_obj(cond, cond),
+	                               upthread_obj(mutex, mutex), abstime);
+}
+
+int EXPORT_SYMBOL pthread_cond_clockwait(pthread_cond_t *cond,
+                                         pthread_mutex_t *mutex,
+                                         clockid_t clock,
+                                         const struct timespec *abstime)
+{
+	return upthread_cond_clockwait(upthread_obj(cond, cond),
+	                               upthread_obj(mutex, mutex), clock, abstime);
+}
+
+int EXPORT_SYMBOL pthread_cond_signal(pthread_cond_t *cond)
+{
+	return upthread_cond_signal(upthread_obj(cond, cond));
+}
+
+int EXPORT_SYMBOL pthread_cond_broadcast(pthread_cond_t *cond)
+{
+	return upthread_cond_broadcast(upthread_obj(cond, cond));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_init(pthread_rwlock_t *rwlock,
+                                      const pthread_rwlockattr_t *attr)
+{
+	return upthread_rwlock_init(upthread_obj(rwlock, rwlock), attr);
+}
+
+int EXPORT_SYMBOL pthread_rwlock_destroy(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_destroy(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_rdlock(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_rdlock(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_tryrdlock(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_tryrdlock(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_timedrdlock(pthread_rwlock_t *rwlock,
+                                             const struct timespec *abstime)
+{
+	return upthread_rwlock_timedrdlock(upthread_obj(rwlock, rwlock), abstime);
+}
+
+int EXPORT_SYMBOL pthread_rwlock_clockrdlock(pthread_rwlock_t *rwlock,
+                                             clockid_t clock,
+                                             const struct timespec *abstime)
+{
+	return upthread_rwlock_clockrdlock(upthread_obj(rwlock, rwlock), clock,
+	                                   abstime);
+}
+
+int EXPORT_SYMBOL pthread_rwlock_wrlock(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_wrlock(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_trywrlock(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_trywrlock(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_rwlock_timedwrlock(pthread_rwlock_t *rwlock,
+                                             const struct timespec *abstime)
+{
+	return upthread_rwlock_timedwrlock(upthread_obj(rwlock, rwlock), abstime);
+}
+
+int EXPORT_SYMBOL pthread_rwlock_clockwrlock(pthread_rwlock_t *rwlock,
+                                             clockid_t clock,
+                                             const struct timespec *abstime)
+{
+	return upthread_rwlock_clockwrlock(upthread_obj(rwlock, rwlock), clock,
+	                                   abstime);
+}
+
+int EXPORT_SYMBOL pthread_rwlock_unlock(pthread_rwlock_t *rwlock)
+{
+	return upthread_rwlock_unlock(upthread_obj(rwlock, rwlock));
+}
+
+int EXPORT_SYMBOL pthread_barrier_init(pthread_barrier_t *barrier,
+                                       const pthread_barrierattr_t *attr,
+                                       unsigned int count)
+{
+	return upthread_barrier_init(upthread_obj(barrier, barrier), attr, count);
+}
+
+int EXPORT_SYMBOL pthread_barrier_destroy(pthread_barrier_t *barrier)
+{
+	return upthread_barrier_destroy(upthread_obj(barrier, barrier));
+}
+
+int EXPORT_SYMBOL pthread_barrier_wait(pthread_barrier_t *barrier)
+{
+	return upthread_barrier_wait(upthread_obj(barrier, barrier));
+}
@@ -20,9 +20,11 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 
 #include "internal/parlib.h"
 #include "internal/vcore.h"
+#include "internal/wsched.h"
 #include "parlib.h"
 #include "vcore.h"
 #include "uthread.h"
@@ -30,13 +32,15 @@
 #include "arch.h"
 #include "tls.h"
 #include "event.h"
+#include "stack.h"
 
 #define printd(...)
 
 #define maybe_resignal() \
 { \
 	int vcoreid = vcore_id(); \
-	if (atomic_swap(&__vcore_sigpending(vcoreid), 0) == 1) \
+	if (!__vcore_doorbells && \
+	    atomic_swap(&__vcore_sigpending(vcoreid), 0) == 1) \
 		vcore_signal(vcoreid); \
 }
 
@@ -47,10 +51,28 @@
 		vcore_reenter(vcore_entry); \
 }
 
-/* Which operations we'll call for the 2LS.  Will change a bit with Lithe.  For
- * now, there are no defaults.  2LSs can override sched_ops. */
-static struct schedule_ops default_2ls_ops = {0};
-struct schedule_ops *sched_ops EXPORT_SYMBOL = &default_2ls_ops;
+/* If the uthread we just interrupted has used up its quantum, hand it back to
+ * the 2LS instead of letting sched_entry() resume it right away. */
+#define maybe_preempt(uthread) \
+{ \
+	int vcoreid = vcore_id(); \
+	if (atomic_swap(&__vcore_preempt_pending(vcoreid), 0) == 1) { \
+		__vcores(vcoreid).notif_stats.preemptions++; \
+		current_uthread = NULL; \
+		uthread_paused(uthread); \
+	} \
+}
+
+/* Which operations we'll call for the 2LS.  Will change a bit with Lithe.  By
+ * default, this is the work-stealing scheduler from wsched.c.  2LSs can
+ * override sched_ops before calling uthread_lib_init(). */
+struct schedule_ops *sched_ops EXPORT_SYMBOL = &wsched_ops;
+
+/* Every this many yields, a uthread with a growable stack has it trimmed. */
+#define UTHREAD_STACK_TRIM_INTERVAL 64
+
+/* See uthread_set_stack_reserve(). */
+static size_t __stack_reserve = 0;
 
 /* A pointer to the current thread running on a vcore */
 __thread struct uthread EXPORT_SYMBOL *current_uthread = 0;
@@ -118,13 +140,20 @@ void EXPORT_SYMBOL uthread_lib_init(struct uthread* uthread)
 	
 		/* Make sure the vcore subsystem is up and running */
 		assert(!vcore_lib_init());
+
+		const char *reserve = getenv("PARLIB_STACK_RESERVE");
+		if (reserve)
+			uthread_set_stack_reserve(strtoul(reserve, NULL, 0));
+
+		/* Set up the default 2LS if nobody brought their own */
+		if (sched_ops == &wsched_ops)
+			wsched_lib_init();
 	
 		/* Set current_uthread to the uthread passed in, so we have a place to
 		 * save the main thread's context when yielding */
 		current_uthread = uthread;
 		uthread->state = UT_RUNNING;
 		uthread->flags = NO_INTERRUPT;
-		uthread->sigstack = NULL;
 		uthread->disable_depth = 1;
 	
 #ifndef PARLIB_NO_UTHREAD_TLS
@@ -176,37 +205,39 @@ static void __vcore_entry() {
 }
 EXPORT_ALIAS(__vcore_entry, vcore_entry)
 
-/* Our callback after receiving a signal on the vcore */
+/* Our callback after receiving a signal on the vcore.  We are on the stack of
+ * whatever got interrupted, and SIGVCORE is not blocked, so another one may
+ * come in on top of us at any point.  Anything we looked at before that is
+ * stale once it returns, as the uthread may have moved in the meantime.  The
+ * one that gets to disable notifs first does the work. */
 void vcore_sigentry()
 {
-	int vcoreid = vcore_id();
-	struct uthread *uthread = current_uthread;
+	int vcoreid;
 	do {
 		cmb();
+		vcoreid = vcore_id();
 		if (in_vcore_context()) {
+			__vcores(vcoreid).notif_stats.deferred_vcore++;
 			atomic_set(&__vcore_sigpending(vcoreid), 1);
 			return;
 		}
 
+		struct uthread *uthread = current_uthread;
 		if (uthread->flags & NO_INTERRUPT) {
+			__vcores(vcoreid).notif_stats.deferred_uthread++;
 			atomic_set(&__vcore_sigpending(vcoreid), 1);
 			return;
 		}
 
 		void cb(struct uthread *uthread, void *arg)
 		{
-			__sigstack_swap(&uthread->sigstack);
-
-			sigset_t mask;
-			sigemptyset(&mask);
-			sigaddset(&mask, SIGVCORE);
-			pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
-
 			uthread->state = UT_RUNNING;
+			maybe_preempt(uthread);
 			uthread_vcore_entry();
 		}
 		cmb();
 		uth_disable_notifs();
+		__vcores(vcore_id()).notif_stats.interrupts++;
 		unsafe_uthread_yield(true, cb, 0);
 		__uth_enable_notifs_raw(current_uthread);
 
@@ -214,13 +245,35 @@ void vcore_sigentry()
 	} while (atomic_swap(&__vcore_sigpending(vcoreid), 0) == 1);
 }
 
+void EXPORT_SYMBOL uthread_safe_point()
+{
+	assert(!in_vcore_context());
+	assert(current_uthread);
+	if (!atomic_read(&__vcore_sigpending(vcore_id())))
+		return;
+	/* Otherwise leave it rung for the next safe point. */
+	if (current_uthread->flags & NO_INTERRUPT)
+		return;
+
+	/* Same as being interrupted by a signal, minus the signal. */
+	void cb(struct uthread *uthread, void *arg)
+	{
+		__vcores(vcore_id()).notif_stats.interrupts++;
+		uthread->state = UT_RUNNING;
+		maybe_preempt(uthread);
+		uthread_vcore_entry();
+	}
+	uthread_yield(true, cb, NULL);
+}
+
 void EXPORT_SYMBOL uthread_init(struct uthread *uthread)
 {
 	assert(uthread);
 	uthread->state = UT_NOT_RUNNING;
 	uthread->flags = NO_INTERRUPT;
-	uthread->sigstack = NULL;
 	uthread->disable_depth = 1;
+	uthread->stack = NULL;
+	uthread->stack_low = NULL;
 
 #ifndef PARLIB_NO_UTHREAD_TLS
 	/* If a tls_desc is already set for this thread, reinit it... */
@@ -237,6 +290,14 @@ void EXPORT_SYMBOL uthread_init(struct uthread *uthread)
 
 void EXPORT_SYMBOL uthread_cleanup(struct uthread *uthread)
 {
+	if (uthread->stack) {
+		if (uthread->stack_low)
+			stack_release(uthread->stack, uthread->stack_size);
+		else
+			stack_free(uthread->stack, uthread->stack_size);
+		uthread->stack = NULL;
+		uthread->stack_low = NULL;
+	}
 #ifndef PARLIB_NO_UTHREAD_TLS
 	printd("[U] thread %08p on vcore %d is DYING!\n", uthread, vcore_id());
 	/* Free the uthread's tls descriptor */
@@ -279,6 +340,16 @@ void EXPORT_SYMBOL uthread_paused(struct uthread *uthread)
     sched_ops->thread_paused(uthread);
 }
 
+/* Called in vcore context on a uthread that just stopped, before anybody gets
+ * a chance to run it again. */
+static inline void __uthread_stack_trim(struct uthread *uthread)
+{
+	if (uthread->stack_low
+	    && ++uthread->stack_yields % UTHREAD_STACK_TRIM_INTERVAL == 0)
+		uthread->stack_low = stack_trim(uthread->stack_low,
+		                                parlib_context_sp(&uthread->uc));
+}
+
 /* Need to have this as a separate, non-inlined function since we clobber the
  * stack pointer before calling it, and don't want the compiler to play games
  * with my hart. */
@@ -289,9 +360,7 @@ __uthread_yield(void)
 	assert(current_uthread);
 
 	struct uthread *uthread = current_uthread;
-
-	/* Free the uthread sigaltstack if there is one. */
-	__sigstack_free(&uthread->sigstack);
+	__uthread_stack_trim(uthread);
 
 	/* Do whatever the yielder wanted us to do */
 	assert(uthread->yield_func);
@@ -386,7 +455,6 @@ void EXPORT_SYMBOL hijack_current_uthread(struct uthread *new_uthread)
 	assert(new_uthread != old_uthread);
 	new_uthread->state = UT_NOT_RUNNING;
 	new_uthread->flags = NO_INTERRUPT;
-	new_uthread->sigstack = NULL;
 	new_uthread->disable_depth = 1;
 
 	__uth_disable_notifs(old_uthread);
@@ -431,31 +499,95 @@ void EXPORT_SYMBOL run_uthread(struct uthread *uthread)
 
 	uthread->state = UT_RUNNING;
 	current_uthread = uthread;
+	/* Starts a new quantum, see __vcore_preempt_tick(). */
+	__vcores(vcore_id()).nr_switches++;
+	atomic_set(&__vcore_preempt_pending(vcore_id()), 0);
 	run_current_uthread();
 }
 
-/* Swaps the currently running uthread for a new one, saving the state of the
- * current uthread in the process */
-void swap_uthreads(struct uthread *__old, struct uthread *__new)
+/* Runs on the stack of the uthread we are switching to, once the one we are
+ * switching from has been saved.  It is as good as vcore context: nothing can
+ * interrupt us here, and the 2LS may hand the old uthread to another vcore. */
+static void __uthread_switch_cb(void *arg)
 {
-	uthread_notif_safe(
-		volatile bool swap = true;
-#ifndef PARLIB_NO_UTHREAD_TLS
-		void *tls_desc = get_current_tls_base();
-#endif
-		struct user_context uc;
-		parlib_getcontext(&uc);
-		cmb();
-		if(swap) {
-			swap = false;
-			memcpy(&__old->uc, &uc, sizeof(struct user_context));
-			run_uthread(__new);
-		}
-		vcore_set_tls_var(current_uthread, __old);
+	struct uthread *uthread = arg;
+	extern __thread bool __in_vcore_context;
+	__in_vcore_context = true;
+	__uthread_stack_trim(uthread);
+	if (uthread->yield_func)
+		uthread->yield_func(uthread, uthread->yield_arg);
+	__in_vcore_context = false;
+}
+
+/* Switches straight from the calling uthread to next, without going through
+ * vcore context and sched_entry().  Both uthreads are kept from being
+ * interrupted all along: the calling one by disabling its notifs, and next by
+ * having been stopped with its notifs disabled, like any uthread that isn't
+ * running. */
+static void __uthread_switch(struct uthread *uthread, struct uthread *next,
+                             void (*yield_func)(struct uthread*, void*),
+                             void *yield_arg)
+{
+	assert(!in_vcore_context());
+	assert(next != uthread);
+	assert(next->state == UT_NOT_RUNNING);
+
+	__uth_disable_notifs(uthread);
+	int vcoreid = vcore_id();
+	uthread->state = UT_NOT_RUNNING;
+	uthread->yield_func = yield_func;
+	uthread->yield_arg = yield_arg;
+	next->state = UT_RUNNING;
+	/* Starts a new quantum, see __vcore_preempt_tick(). */
+	__vcores(vcoreid).nr_switches++;
+	atomic_set(&__vcore_preempt_pending(vcoreid), 0);
+
 #ifndef PARLIB_NO_UTHREAD_TLS
-		set_tls_desc(tls_desc);
+	/* We know where our TLS is, so we can poke at the vcore's one without
+	 * asking the kernel where we are first. */
+	*(struct uthread**)((char*)&current_uthread - (char*)uthread->tls_desc
+	                    + (char*)vcore_tls_descs(vcoreid)) = next;
+	__set_tls_desc(next->tls_desc, vcoreid);
+#else
+	current_uthread = next;
 #endif
-	)
+	/* No TLS variables from here on, they would be next's. */
+	parlib_switchcontext(&uthread->uc, &next->uc, __uthread_switch_cb, uthread);
+
+	/* Back in the calling uthread, possibly on another vcore. */
+	uth_enable_notifs();
+}
+
+/* Switches from the calling uthread to next, without going through the
+ * vcore.  Next must not be running or known to be runnable by the 2LS; the
+ * caller is handed to the 2LS as paused. */
+void EXPORT_SYMBOL uthread_switch_to(struct uthread *next)
+{
+	void cb(struct uthread *uthread, void *arg)
+	{
+		uthread_paused(uthread);
+	}
+	__uthread_switch(current_uthread, next, cb, NULL);
+}
+
+/* Same as uthread_switch_to(), except yield_func decides what happens to the
+ * calling uthread, just like with uthread_yield().  It runs in vcore-like
+ * context on next's stack. */
+void EXPORT_SYMBOL uthread_yield_to(struct uthread *next,
+                                    void (*yield_func)(struct uthread*, void*),
+                                    void *yield_arg)
+{
+	assert(yield_func);
+	__uthread_switch(current_uthread, next, yield_func, yield_arg);
+}
+
+/* Swaps the currently running uthread for a new one, saving the state of the
+ * current uthread in the process.  The caller is in charge of running the old
+ * one again. */
+void swap_uthreads(struct uthread *__old, struct uthread *__new)
+{
+	assert(__old == current_uthread);
+	__uthread_switch(__old, __new, NULL, NULL);
 }
 
 /* Deals with a pending preemption (checks, responds).  If the 2LS registered a
@@ -477,16 +609,51 @@ bool EXPORT_SYMBOL check_preempt_pending(uint32_t vcoreid)
 	return retval;
 }
 
-void EXPORT_SYMBOL init_uthread_tf(uthread_t *uth, void (*entry)(void),
-                                   void *stack_bottom, uint32_t size)
+int EXPORT_SYMBOL init_uthread_tf(uthread_t *uth, void (*entry)(void),
+                                  void *stack_bottom, uint32_t size)
 {
 	void cb()
 	{
 		uth_enable_notifs();
 		current_uthread->entry_func();
 	}
+	if (stack_bottom == NULL && __stack_reserve) {
+		if (size < __stack_reserve)
+			size = __stack_reserve;
+		size = ROUNDUP(size, PGSIZE);
+		stack_bottom = stack_reserve(size);
+		if (stack_bottom == NULL)
+			return -1;
+		uth->stack = stack_bottom;
+		uth->stack_size = size;
+		uth->stack_low = (char*)stack_bottom + size - STACK_MIN_SIZE;
+		uth->stack_hwm = uth->stack_low;
+		uth->stack_yields = 0;
+	} else if (stack_bottom == NULL) {
+		stack_bottom = stack_alloc(size);
+		if (stack_bottom == NULL)
+			return -1;
+		uth->stack = stack_bottom;
+		uth->stack_size = size;
+	}
 	uth->entry_func = entry;
 	parlib_makecontext(&uth->uc, cb, stack_bottom, size);
+	return 0;
+}
+
+void EXPORT_SYMBOL uthread_set_stack_reserve(size_t reserve)
+{
+	__stack_reserve = reserve ? ROUNDUP(reserve, PGSIZE) : 0;
+	if (__stack_reserve && __stack_reserve < STACK_MIN_SIZE)
+		__stack_reserve = STACK_MIN_SIZE;
+}
+
+size_t EXPORT_SYMBOL uthread_stack_hwm(struct uthread *uthread)
+{
+	if (uthread->stack_low == NULL)
+		return 0;
+	return (char*)uthread->stack + uthread->stack_size
+	       - (char*)uthread->stack_hwm;
 }
 
 #ifndef PARLIB_NO_UTHREAD_TLS
@@ -36,6 +36,7 @@
 /* Externally blocked thread reasons (for uthread_has_blocked()) */
 #define UTH_EXT_BLK_MUTEX         1
 #define UTH_EXT_BLK_JUSTICE       2   /* whatever.  might need more options */
+#define UTH_EXT_BLK_JOIN          3
 
 /* Bare necessities of a user thread.  1LSs should allocate a bigger struct and
  * cast their threads to uthreads when talking with vcore code.  Vcore/default
@@ -50,7 +51,6 @@ struct uthread {
     int flags;
     int state;
     int disable_depth;
-    void *sigstack;
 #ifndef PARLIB_NO_UTHREAD_TLS
     void *tls_desc;
 #else
@@ -58,13 +58,20 @@ struct uthread {
 #endif
     struct syscall *sysc;
     uint64_t sysc_timeout;
+    void *stack;              /* from init_uthread_tf(), if it allocated it */
+    size_t stack_size;
+    void *stack_low;          /* lowest usable address, if stack can grow */
+    void *stack_hwm;          /* lowest stack_low has ever been */
+    unsigned int stack_yields;
 };
 typedef struct uthread uthread_t;
 
 /* External reference to the current uthread running on this vcore */
 extern __thread uthread_t *current_uthread TLS_INITIAL_EXEC;
 
-/* 2L-Scheduler operations.  Can be 0.  Examples in pthread.c. */
+struct task;
+
+/* 2L-Scheduler operations.  Can be 0.  Example in wsched.c. */
 typedef struct schedule_ops {
     /* Functions supporting thread ops */
     void (*sched_entry)(void);
@@ -75,6 +82,9 @@ typedef struct schedule_ops {
     /* Functions event handling wants */
     void (*preempt_pending)(void);
     void (*spawn_thread)(uintptr_t pc_start, void *data);   /* don't run yet */
+    /* Stackless tasks (see task.h), to be run with run_task().  Tasks
+     * waiting on an fd come back as EV_SYSCALL events with SC_TASK set. */
+    void (*task_runnable)(struct task *);
 } schedule_ops_t;
 extern struct schedule_ops *sched_ops;
 
@@ -107,6 +117,17 @@ void uthread_runnable(struct uthread *uthread);
 void uthread_yield(bool save_state, void (*yield_func)(struct uthread*, void*),
                    void *yield_arg);
 
+/* Switch directly from the calling uthread to next, which the 2LS has already
+ * picked and taken off its queues.  Only the callee-saved registers are saved
+ * and the TLS is switched once, with no detour through vcore context.  The
+ * calling uthread is handed back to the 2LS as paused, or, with
+ * uthread_yield_to(), passed to yield_func, which runs on next's stack before
+ * next resumes. */
+void uthread_switch_to(struct uthread *next);
+void uthread_yield_to(struct uthread *next,
+                      void (*yield_func)(struct uthread*, void*),
+                      void *yield_arg);
+
 /* Don't allow this uthread to be interrupted by an incoming vcore
  * notification. This is the default once a uthread starts running. */
 void uth_disable_notifs();
@@ -116,6 +137,13 @@ void uth_disable_notifs();
  * uthreads to be interrupted by a vcore signal. */
 void uth_enable_notifs();
 
+/* Lets the vcore handle any notification that is pending for it, as if the
+ * calling uthread had just been interrupted.  Long-running uthreads that never
+ * yield should call this every now and then when vcores are notified through
+ * doorbells (PARLIB_VCORE_NOTIFY=doorbell), since nothing interrupts them
+ * then.  Cheap when there is nothing pending. */
+void uthread_safe_point();
+
 /* By default, all of the uthread operations are safe from interrupts.  If you
  * have other calls that you know should not be interrupted by an event, you
  * must wrap these calls in enable/disable interrupt calls.  This macro
@@ -133,8 +161,28 @@ void hijack_current_uthread(struct uthread *uthread);
 void run_current_uthread(void) __attribute((noreturn));
 void run_uthread(struct uthread *uthread) __attribute((noreturn));
 void swap_uthreads(struct uthread *__old, struct uthread *__new);
-void init_uthread_tf(uthread_t *uth, void (*entry)(void),
-                     void *stack_bottom, uint32_t size);
+/* Sets uth up to start running entry on the given stack.  With a NULL
+ * stack_bottom, a stack of size bytes comes from stack_alloc(), and goes back
+ * to it in uthread_cleanup(), unless growable stacks are on (see below).
+ * Returns 0, or -1 with errno set to ENOMEM if there was no stack to be had,
+ * in which case uth can only be cleaned up.  Mappings usually run out before
+ * memory does, see stack_alloc(). */
+int init_uthread_tf(uthread_t *uth, void (*entry)(void),
+                    void *stack_bottom, uint32_t size);
+
+/* Makes init_uthread_tf() reserve reserve bytes of address space for the
+ * stacks it allocates, of which only the top STACK_MIN_SIZE is backed to
+ * start with.  Stacks then grow on demand, and every so often, when their
+ * uthread yields, what lies well below its stack pointer is handed back to the
+ * kernel.  The size init_uthread_tf() is asked for then only matters if it is
+ * bigger than reserve.  0, the default, turns it off again.  Only affects
+ * uthreads initialized afterwards.  The PARLIB_STACK_RESERVE environment
+ * variable sets it when uthread_lib_init() runs. */
+void uthread_set_stack_reserve(size_t reserve);
+
+/* How deep the stack of uthread has ever gone, to the page, if it is growable
+ * (0 otherwise).  Never less than STACK_MIN_SIZE. */
+size_t uthread_stack_hwm(struct uthread *uthread);
 
 #ifndef PARLIB_NO_UTHREAD_TLS
   #define uthread_set_tls_var(uthread, name, val) \
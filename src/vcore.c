@@ -48,21 +48,30 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/sysinfo.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <pthread.h>
 
 #include "parlib.h"
 #include "internal/vcore.h"
 #include "internal/futex.h"
+#include "internal/event.h"
+#include "internal/topology.h"
 #include "context.h"
 #include "atomic.h"
 #include "tls.h"
 #include "vcore.h"
 #include "mcs.h"
+#include "spinlock.h"
 #include "event.h"
+#include "stack.h"
+#include "timing.h"
+
+#define VCORE_SIGSTACK_SIZE (32 * 1024)
 
 /* Per vcore data */
 struct vcore_pvc_data EXPORT_SYMBOL *vcore_pvc_data;
@@ -91,9 +100,31 @@ __thread bool EXPORT_SYMBOL __in_vcore_context = false;
 /* Number of currently allocated vcores. */
 atomic_t EXPORT_SYMBOL __num_vcores = ATOMIC_INITIALIZER(0);
 
-/* Maximum number of vcores that can ever be allocated. */
+/* Maximum number of vcores that can be allocated right now, see
+ * vcore_set_max(). */
 volatile int EXPORT_SYMBOL __max_vcores = 0;
 
+/* Number of vcores there can ever be. */
+int EXPORT_SYMBOL __vcore_capacity = 0;
+
+/* Number of vcores whose pthread has been created.  They get created the
+ * first time max_vcores() lets them exist, and never go away. */
+static volatile int __nr_created = 0;
+static spinlock_t __nr_created_lock = SPINLOCK_INITIALIZER;
+
+/* Whether vcores get notified through doorbells or signals. */
+bool __vcore_doorbells = false;
+
+/* Time slice given to uthreads before they get preempted, 0 for none. */
+static uint64_t __preempt_quantum = 0;
+
+/* See vcore_set_idle_policy().  Idle times are averaged over the last eight
+ * or so. */
+static uint64_t __idle_spin = 0;
+static uint64_t __idle_wait = 0;
+static bool __have_waitpkg = false;
+#define IDLE_AVG_SHIFT 3
+
 /* Global context associated with the main thread.  Used when swapping this
  * context over to vcore0 */
 static struct user_context main_context = { 0 };
@@ -107,43 +138,6 @@ static size_t __static_tls_align = -1;
  * __static_tls_size at runtime. */
 static size_t __min_stack_size = -1;
 
-/* Allocate a new signal stack to the vcore and save a pointer to the old one
- * in the variable passed in. If the pointer passed in is NULL, then it is not
- * assigned.  */
-void __sigstack_swap(void **sigstack)
-{
-	int vcoreid = vcore_id();
-	struct vcore_sigstack *stack = *sigstack;
-	if (!stack) {
-		stack = SLIST_FIRST(&__vcores(vcoreid).sigstacklist);
-		if (stack) {
-			SLIST_REMOVE_HEAD(&__vcores(vcoreid).sigstacklist, next);
-		} else {
-			stack = mmap(0, SIGSTKSZ, PROT_READ | PROT_WRITE,
-			                MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS, -1, 0);
-		}
-	}
-	*sigstack = __vcores(vcoreid).activesigstack;
-	__vcores(vcoreid).activesigstack = stack;
-
-	stack_t altstack;
-	altstack.ss_sp = stack;
-	altstack.ss_size = SIGSTKSZ;
-	altstack.ss_flags = SS_DISABLE;
-	int ret = sigaltstack(&altstack, NULL);
-	assert(ret == 0);
-}
-
-/* Free the signal stack */
-void __sigstack_free(void **__sigstack)
-{
-	if (*__sigstack) {
-		struct vcore_sigstack *sigstack = (struct vcore_sigstack *)(*__sigstack);
-		SLIST_INSERT_HEAD(&__vcores(vcore_id()).sigstacklist, sigstack, next);
-		*__sigstack = NULL;
-	}
-}
-
 /* Generic set affinity function */
 static void __set_affinity(int vcoreid, int cpuid)
 {
@@ -159,15 +153,70 @@ static void __set_affinity(int vcoreid, int cpuid)
 
   /* Set the entry in the vcore_map to the cpuid */
   vcore_map(vcoreid) = cpuid;
+  __vcores(vcoreid).pinned = cpuid;
 
   sched_yield();
 }
 
+/* (Re)arms the calling vcore's preemption timer to go off every usec, or
+ * disarms it if usec is 0.  The timer sends SIGVCORE to this vcore's pthread
+ * only. */
+static void __preempt_timer_set(int vcoreid, uint64_t usec)
+{
+	struct vcore *vc = &__vcores(vcoreid);
+	if (!vc->preempt_timer_valid) {
+		if (usec == 0)
+			return;
+		struct sigevent sev;
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_signo = SIGVCORE;
+		sev._sigev_un._tid = syscall(SYS_gettid);
+		if (timer_create(CLOCK_MONOTONIC, &sev, &vc->preempt_timer) != 0)
+			return;
+		vc->preempt_timer_valid = true;
+	}
+	struct itimerspec its;
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = (usec % 1000000) * 1000;
+	its.it_interval = its.it_value;
+	timer_settime(vc->preempt_timer, 0, &its, NULL);
+}
+
+/* Called on every tick of the calling vcore's preemption timer.  Ticks are
+ * periodic and not reset on every switch, so a uthread is preempted once it
+ * has had the vcore to itself for a whole tick, i.e. after one to two quanta. */
+static void __vcore_preempt_tick()
+{
+	struct vcore *vc = &__vcores(__vcore_id);
+	if (in_vcore_context() || vc->nr_switches != vc->preempt_seen) {
+		vc->preempt_seen = vc->nr_switches;
+		return;
+	}
+	/* From here on, it's just like any other notification. */
+	atomic_set(&__vcore_preempt_pending(__vcore_id), 1);
+	vcore_sigentry();
+}
+
+/* The signal frame we return through may have come in on another vcore, and
+ * sigreturn() sets up the signal stack it found when it did.  Make it ours. */
+static inline void __vcore_sigreturn_fixup(void *context)
+{
+	((ucontext_t*)context)->uc_stack = __vcores(__vcore_id).sigstack;
+}
+
 /* Wrapper function for the entry function from a vcore signal */
 static void __vcore_sigentry(int sig, siginfo_t *info, void *context)
 {
 	assert(sig == SIGVCORE);
 
+	/* Preemption ticks are not notifications, don't go requesting vcores. */
+	if (info->si_code == SI_TIMER) {
+		__vcore_preempt_tick();
+		__vcore_sigreturn_fixup(context);
+		return;
+	}
+
 	/* If I'm able to successfully do a vcore_request_specific(), then the
 	 * vcore this signal is destined for must have been offline. It will now
 	 * come back online shortly, and trigger the vcore_sigentry() then. */
@@ -176,26 +225,48 @@ static void __vcore_sigentry(int sig, siginfo_t *info, void *context)
 	/* Otherwise, if I'm in vcore context, just set vcore_sigpending and it
 	 * will be processed when next appropriate. */
 	if (in_vcore_context()) {
+		__vcores(__vcore_id).notif_stats.deferred_vcore++;
 		atomic_set(&__vcore_sigpending(__vcore_id), 1);
 		return;
 	}
 	/* Otherwise, just call out to the generic vcore_sigentry() function. */
 	vcore_sigentry();
+	__vcore_sigreturn_fixup(context);
 }
 
 /* Generic sigaction function to set up a singal handler for sending a signal
- * to a vcore */
+ * to a vcore.  The handler runs on whatever stack it interrupted, so when it
+ * interrupts a uthread, the signal frame ends up on the uthread's own stack
+ * and goes wherever the uthread goes, with nothing to swap out from under the
+ * vcore.  SIGVCORE is not blocked while handling it either, so that leaving
+ * the handler for vcore context doesn't take a sigprocmask() to unblock it;
+ * vcore_sigentry() copes with being nested. */
 static void __set_sigaction()
 {
 	struct sigaction act;
 	act.sa_sigaction = __vcore_sigentry;
-	act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	act.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(&act.sa_mask);
 	sigaction(SIGVCORE, &act, NULL);
 }
 
+void EXPORT_SYMBOL vcore_get_notif_stats(int vcoreid,
+                                         struct vcore_notif_stats *stats)
+{
+  *stats = __vcores(vcoreid).notif_stats;
+}
+
 /* Function for sending a signal to a vcore. */
 void EXPORT_SYMBOL vcore_signal(int vcoreid) {
+  if (__vcore_doorbells) {
+    /* Whoever rings the doorbell first makes sure the vcore is online to
+     * notice it.  If it's parked, this wakes it up straight into
+     * vcore_entry().  Leave the doorbell rung either way, the vcore could
+     * already be past handle_events() by the time we get here. */
+    if (atomic_swap(&__vcore_sigpending(vcoreid), 1) == 0)
+      vcore_request_specific(vcoreid);
+    return;
+  }
   if (!__vcore_sigpending(vcoreid))
 	  pthread_kill(__vcores(vcoreid).pthread, SIGVCORE);
 }
@@ -208,12 +279,108 @@ void vcore_reenter(void (*entry_func)(void))
   __vcore_reenter(entry_func, __vcore_stack);
 }
 
+/* Wakes up vcoreid, if it is a vcore that __vcore_request() marked.  Only
+ * ever called once per marking: by the request for the first two vcores it
+ * marked, and by the parent of each of the others. */
+static void __vcore_release(int vcoreid)
+{
+  if (vcoreid < 0)
+    return;
+  atomic_set(&__vcores(vcoreid).parked, VCORE_RUNNING);
+  futex_wakeup_one(&__vcores(vcoreid).parked);
+  if (in_vcore_context() || current_uthread)
+    __vcores(vcore_id()).idle_stats.wakes_sent++;
+}
+
+/* Waits for vcoreid to get requested, by spinning, waiting or parking as
+ * vcore_set_idle_policy() says. */
+static void __vcore_idle(int vcoreid)
+{
+  struct vcore *vc = &__vcores(vcoreid);
+  struct vcore_idle_stats *stats = &vc->idle_stats;
+  uint64_t budget = __idle_spin + __idle_wait;
+  uint64_t window = 0;
+  if (stats->avg_idle_cycles <= budget)
+    window = MIN(budget, 2 * stats->avg_idle_cycles);
+
+  uint64_t start = read_tsc();
+  uint64_t spin_end = start + MIN(window, __idle_spin);
+  uint64_t deadline = start + window;
+  uint64_t now = start;
+  while (now < spin_end) {
+    if (atomic_read(&vc->allocated)) {
+      stats->spin_wakeups++;
+      goto out;
+    }
+    cpu_relax();
+    now = read_tsc();
+  }
+  while (now < deadline) {
+    if (__have_waitpkg) {
+      cpu_umonitor(&vc->allocated);
+      if (!atomic_read(&vc->allocated))
+        cpu_umwait(deadline);
+    } else {
+      cpu_relax();
+    }
+    if (atomic_read(&vc->allocated)) {
+      stats->wait_wakeups++;
+      goto out;
+    }
+    now = read_tsc();
+  }
+
+  /* Whoever requests us from here on has to wake us up, unless we see that
+   * they did before going to sleep.  Once marked, we stay asleep until
+   * released, which only happens once everything we have to wake up in turn
+   * is known.  Don't tick while parked. */
+  atomic_set(&vc->parked, VCORE_PARKED);
+  mb();
+  if (__preempt_quantum)
+    __preempt_timer_set(vcoreid, 0);
+  for (;;) {
+    long parked = (long)atomic_read(&vc->parked);
+    if (parked == VCORE_RUNNING)
+      break;
+    if (parked == VCORE_PARKED && atomic_read(&vc->allocated)) {
+      if (atomic_cas(&vc->parked, VCORE_PARKED, VCORE_RUNNING))
+        break;
+      continue;
+    }
+    futex_wait(&vc->parked, parked);
+  }
+  if (__preempt_quantum)
+    __preempt_timer_set(vcoreid, __preempt_quantum);
+  stats->park_wakeups++;
+  __vcore_release(vc->wake_child[0]);
+  __vcore_release(vc->wake_child[1]);
+  vc->wake_child[0] = vc->wake_child[1] = -1;
+
+out:
+  if (budget) {
+    /* Anything much longer than we would ever spin counts the same. */
+    int64_t idle = MIN(read_tsc() - start, 2 * budget);
+    int64_t avg = stats->avg_idle_cycles;
+    stats->avg_idle_cycles = avg + ((idle - avg) >> IDLE_AVG_SHIFT);
+  }
+}
+
+/* Gets a vcore that we just set allocated for going. */
+static inline void __vcore_wake(int vcoreid)
+{
+  if (atomic_cas(&__vcores(vcoreid).parked, VCORE_PARKED, VCORE_RUNNING))
+    futex_wakeup_one(&__vcores(vcoreid).parked);
+}
+
 /* The entry gate of a vcore after it's initial creation. */
 static void vcore_entry_gate()
 {
   assert(__in_vcore_context);
   int vcoreid = __vcore_id;
 
+  /* Make sure I/O still in flight gets us back online. */
+  event_vcore_idle(vcoreid);
+
   /* Update the vcore counts and set the flag for allocated to false */
   atomic_set(&__vcores(vcoreid).allocated, false);
   atomic_add(&__num_vcores, -1);
@@ -226,7 +393,7 @@ static void vcore_entry_gate()
     vcore_request_specific(vcoreid);
 
   /* Wait for this vcore to get woken up. */
-  futex_wait(&__vcores(vcoreid).allocated, false);
+  __vcore_idle(vcoreid);
 
   /* Vcore is awake. Jump to the vcore's entry point */
   vcore_entry();
@@ -263,7 +430,7 @@ static void *get_stack_top()
 static void __vcore_init(int vcoreid)
 {
   /* Set the affinity on this vcore */
-  __set_affinity(vcoreid, vcoreid);
+  __set_affinity(vcoreid, vcore_map(vcoreid));
 
   /* Switch to the proper tls region */
   __set_tls_desc(vcore_tls_descs(vcoreid), vcoreid);
@@ -274,14 +441,24 @@ static void __vcore_init(int vcoreid)
   /* Assign the id to the tls variable */
   __vcore_id = vcoreid;
 
-  /* Initialize the sigstack stuff. */
-  __vcores(vcoreid).activesigstack = NULL;
-  SLIST_INIT(&__vcores(vcoreid).sigstacklist);
-  __sigstack_swap(&__vcores(vcoreid).activesigstack);
-
   /* Store a pointer to the backing pthread for this vcore */
   __vcores(vcoreid).pthread = pthread_self();
 
+  /* The preemption timer gets created the first time it is armed. */
+  __vcores(vcoreid).preempt_timer_valid = false;
+  __vcores(vcoreid).nr_switches = 0;
+  __vcores(vcoreid).wake_child[0] = __vcores(vcoreid).wake_child[1] = -1;
+  __vcores(vcoreid).preempt_seen = 0;
+  memset(&__vcores(vcoreid).notif_stats, 0, sizeof(struct vcore_notif_stats));
+
+  /* Give the vcore a signal stack of its own, for the SIGSEGVs of growable
+   * uthread stacks (see stack.c).  SIGVCORE never uses it. */
+  stack_t *ss = &__vcores(vcoreid).sigstack;
+  ss->ss_sp = stack_alloc(VCORE_SIGSTACK_SIZE);
+  ss->ss_size = VCORE_SIGSTACK_SIZE;
+  ss->ss_flags = ss->ss_sp ? 0 : SS_DISABLE;
+  sigaltstack(ss, NULL);
+
   /* Determine top of vcore stack */
   __vcore_stack = get_stack_top();
 }
@@ -369,13 +546,20 @@ static void cancel_vcore_reservation(int count)
 
 int vcore_request_specific(int vcoreid)
 {
+  if (vcoreid >= __nr_created)
+    return -1;
+  /* Vcores past max_vcores() still come back online for whatever got sent
+   * their way, if only to hand it over to the others and go away again (see
+   * vcore_set_max()), so they don't need a reservation. */
+  if (vcoreid >= __max_vcores)
+    atomic_add(&__num_vcores, 1);
   // Preemptively try and reserve a vcore so we can request it
-  if (!reserve_vcores(1))
+  else if (!reserve_vcores(1))
     return -1;
 
   // If we succeed, then try and allocate 'vcoreid' specifically.
   if (atomic_swap(&__vcores(vcoreid).allocated, true) == false) {
-    futex_wakeup_one(&__vcores(vcoreid).allocated);
+    __vcore_wake(vcoreid);
     return 0;
   }
 
@@ -390,19 +574,102 @@ static int __vcore_request(int requested)
   if (!reserve_vcores(requested))
     return -1;
 
-  /* Otherwise wake up exactly the number of vcores we just reserved. */
+  /* Otherwise grab exactly the number of vcores we just reserved.  The ones
+   * that went to sleep in the kernel only get marked for now, and put in a
+   * binary tree in the order we marked them: we wake up the first two, and
+   * the k-th one wakes up the (2k+2)-th and (2k+3)-th once it is up.  That
+   * spreads the system calls for a big request over the vcores it wakes. */
+  int roots[2] = { -1, -1 };
+  int nr_marked = 0, parent = -1, last = -1;
   int allocated = 0;
-  while (1) {
-    for (int i = 0; i < __max_vcores; i++) {
+  while (allocated < requested) {
+    int max = __max_vcores;
+    for (int i = 0; i < max && allocated < requested; i++) {
       if (atomic_read(&__vcores(i).allocated) == false) {
         if (atomic_swap(&__vcores(i).allocated, true) == false) {
-          futex_wakeup_one(&__vcores(i).allocated);
-          if (++allocated == requested)
-            return 0;
+          struct vcore *vc = &__vcores(i);
+          if (atomic_cas(&vc->parked, VCORE_PARKED, VCORE_MARKED)) {
+            vc->wake_next = -1;
+            if (nr_marked < 2) {
+              roots[nr_marked] = i;
+              parent = roots[0];
+            } else {
+              __vcores(parent).wake_child[nr_marked % 2] = i;
+              if (nr_marked % 2)
+                parent = __vcores(parent).wake_next;
+            }
+            if (last >= 0)
+              __vcores(last).wake_next = i;
+            last = i;
+            nr_marked++;
+          }
+          allocated++;
         }
       }
     }
+    /* vcore_set_max() may have taken away the vcores we reserved, in which
+     * case the rest of them are never coming. */
+    if (allocated < requested && atomic_read(&__num_vcores) > max) {
+      cancel_vcore_reservation(requested - allocated);
+      break;
+    }
   }
+  /* Everybody's children are known: let them go. */
+  wmb();
+  __vcore_release(roots[0]);
+  __vcore_release(roots[1]);
+  return allocated == requested ? 0 : -1;
+}
+
+int vcore_handoff()
+{
+  assert(in_vcore_context());
+  /* We are still online, so we couldn't get a reservation: briefly go one
+   * over instead, until we yield. */
+  atomic_add(&__num_vcores, 1);
+  for (int i = 0; i < __max_vcores; i++) {
+    if (atomic_read(&__vcores(i).allocated) == false) {
+      if (atomic_swap(&__vcores(i).allocated, true) == false) {
+        __vcore_wake(i);
+        return 0;
+      }
+    }
+  }
+  cancel_vcore_reservation(1);
+  return -1;
+}
+
+int vcore_set_max(int nr)
+{
+  nr = MAX(1, MIN(nr, (int)vcore_capacity()));
+  spinlock_lock(&__nr_created_lock);
+  /* Our cpuset may have changed since the vcores got placed.  The new ones
+   * go to whatever CPUs we have now, and the old ones off of those we lost. */
+  topology_replace(__nr_created, nr);
+  for (int i = 0; i < __nr_created; i++) {
+    if (vcore_map(i) != __vcores(i).pinned && __vcores(i).pthread) {
+      cpu_set_t c;
+      CPU_ZERO(&c);
+      CPU_SET(vcore_map(i), &c);
+      if (pthread_setaffinity_np(__vcores(i).pthread, sizeof(c), &c) == 0)
+        __vcores(i).pinned = vcore_map(i);
+    }
+  }
+  while (__nr_created < nr) {
+    __create_vcore(__nr_created);
+    __nr_created++;
+  }
+  int old = __max_vcores;
+  wmb();
+  __max_vcores = nr;
+  spinlock_unlock(&__nr_created_lock);
+
+  /* Tell the vcores that just ended up past the limit to go, they would
+   * otherwise only notice the next time they enter vcore context. */
+  for (int i = nr; i < old; i++)
+    if (atomic_read(&__vcores(i).allocated))
+      vcore_signal(i);
+  return nr;
 }
 
 int vcore_request(int requested)
@@ -442,6 +709,23 @@ int vcore_lib_init()
     _dl_get_tls_static_info(&__static_tls_size, &__static_tls_align);
     __min_stack_size = PTHREAD_STACK_MIN + __static_tls_size;
 
+    /* Set up preemption, if any */
+    char *quantum = getenv("PARLIB_PREEMPT_QUANTUM_USEC");
+    if (quantum != NULL)
+      vcore_set_preempt_quantum(strtoull(quantum, NULL, 0));
+
+    /* And what they do while they are offline */
+    __have_waitpkg = cpu_has_waitpkg();
+    char *spin = getenv("PARLIB_VCORE_IDLE_SPIN");
+    char *wait = getenv("PARLIB_VCORE_IDLE_WAIT");
+    vcore_set_idle_policy(spin ? strtoull(spin, NULL, 0) : 0,
+                          wait ? strtoull(wait, NULL, 0) : 0);
+
+    /* Figure out how vcores should get notified */
+    char *notify = getenv("PARLIB_VCORE_NOTIFY");
+    if (notify != NULL)
+      __vcore_doorbells = (strcmp(notify, "doorbell") == 0);
+
     /* Get the number of available vcores in the system */
     char *limit = getenv("VCORE_LIMIT");
     if (limit != NULL) {
@@ -449,28 +733,44 @@ int vcore_lib_init()
     } else {
       __max_vcores = get_nprocs();
     }
+    __max_vcores = MIN(MAX(__max_vcores, 1), MAX_VCORES);
+
+    /* And how many there could ever be, if vcore_set_max() asks for more. */
+    char *capacity = getenv("PARLIB_VCORE_CAPACITY");
+    if (capacity != NULL)
+      __vcore_capacity = atoi(capacity);
+    else
+      __vcore_capacity = get_nprocs_conf();
+    __vcore_capacity = MIN(MAX(__vcore_capacity, __max_vcores), MAX_VCORES);
 
     /* Allocate the structs containing meta data about the vcores
      * themselves. Never freed though.  Just freed automatically when the program
      * dies since vcores should be alive for the entire lifetime of the
-     * program. */
+     * program.  vcore_pvc_data is read by everybody, but the internal data is
+     * mostly touched by the vcore itself, so it goes on the vcore's node. */
     vcore_pvc_data = parlib_aligned_alloc(PGSIZE,
-                         sizeof(struct vcore_pvc_data) * __max_vcores);
-    internal_vcore_pvc_data = parlib_aligned_alloc(PGSIZE,
-                         sizeof(struct internal_vcore_pvc_data) * __max_vcores);
-
+                         sizeof(struct vcore_pvc_data) * __vcore_capacity);
     if (vcore_pvc_data == NULL) {
       fprintf(stderr, "vcore: failed to initialize vcores\n");
       exit(1);
     }
 
+    /* Pick a pcore for every vcore */
+    topology_lib_init(__vcore_capacity);
+
+    internal_vcore_pvc_data = topology_alloc_per_vcore(
+                         sizeof(struct internal_vcore_pvc_data),
+                         __vcore_capacity);
+    if (internal_vcore_pvc_data == NULL) {
+      fprintf(stderr, "vcore: failed to initialize vcores\n");
+      exit(1);
+    }
+
     /* Initialize the vcore_sigpending array */
-    for (int i=0; i<max_vcores(); i++)
+    for (int i=0; i<vcore_capacity(); i++) {
       __vcore_sigpending(i) = ATOMIC_INITIALIZER(0);
-
-    /* Initialize the vcore_map to a sentinel value */
-    for (int i=0; i < __max_vcores; i++)
-      vcore_map(i) = VCORE_UNMAPPED;
+      __vcore_preempt_pending(i) = ATOMIC_INITIALIZER(0);
+    }
 
     /* Set the hignal handler for signals sent to all vcores (inherited) */
     __set_sigaction();
@@ -482,6 +782,7 @@ int vcore_lib_init()
     for (int i = 0; i < __max_vcores; i++) {
       __create_vcore(i);
     }
+    __nr_created = __max_vcores;
 
     /* Initialize the event subsystem */
     event_lib_init();
@@ -489,6 +790,11 @@ int vcore_lib_init()
     /* Wait until they have parked. */
     while (atomic_read(&__num_vcores) > 0)
       cpu_relax();
+
+    /* Keep max_vcores() in line with the CPUs we get, if asked to */
+    char *watch = getenv("PARLIB_VCORE_WATCH_USEC");
+    if (watch != NULL)
+      vcore_watch_cpus(strtoull(watch, NULL, 0));
   )
   return 0;
 }
@@ -525,11 +831,36 @@ pthread_t internal_pthread_create(size_t stack_size,
   return pthread;
 }
 
+void vcore_set_preempt_quantum(uint64_t usec)
+{
+  __preempt_quantum = usec;
+}
+
+void vcore_set_idle_policy(uint64_t spin_cycles, uint64_t wait_cycles)
+{
+  __idle_spin = spin_cycles;
+  __idle_wait = wait_cycles;
+}
+
+void EXPORT_SYMBOL vcore_get_idle_stats(int vcoreid,
+                                        struct vcore_idle_stats *stats)
+{
+  *stats = __vcores(vcoreid).idle_stats;
+}
+
 #undef vcore_lib_init
 #undef vcore_request
 #undef vcore_request_specific
 #undef vcore_reenter
+#undef vcore_set_preempt_quantum
+#undef vcore_set_idle_policy
+#undef vcore_set_max
+#undef vcore_handoff
 EXPORT_ALIAS(INTERNAL(vcore_lib_init), vcore_lib_init)
 EXPORT_ALIAS(INTERNAL(vcore_request), vcore_request)
 EXPORT_ALIAS(INTERNAL(vcore_request_specific), vcore_request_specific)
 EXPORT_ALIAS(INTERNAL(vcore_reenter), vcore_reenter)
+EXPORT_ALIAS(INTERNAL(vcore_set_preempt_quantum), vcore_set_preempt_quantum)
+EXPORT_ALIAS(INTERNAL(vcore_set_idle_policy), vcore_set_idle_policy)
+EXPORT_ALIAS(INTERNAL(vcore_set_max), vcore_set_max)
+EXPORT_ALIAS(INTERNAL(vcore_handoff), vcore_handoff)
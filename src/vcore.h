@@ -60,6 +60,10 @@ extern "C" {
 # define vcore_request INTERNAL(vcore_request)
 # define vcore_request_specific INTERNAL(vcore_request_specific)
 # define vcore_reenter INTERNAL(vcore_reenter)
+# define vcore_set_preempt_quantum INTERNAL(vcore_set_preempt_quantum)
+# define vcore_set_idle_policy INTERNAL(vcore_set_idle_policy)
+# define vcore_set_max INTERNAL(vcore_set_max)
+# define vcore_handoff INTERNAL(vcore_handoff)
 # define clear_notif_pending INTERNAL(clear_notif_pending)
 # define enable_notifs INTERNAL(enable_notifs)
 # define disable_notifs INTERNAL(disable_notifs)
@@ -75,6 +79,15 @@ struct vcore_pvc_data {
 	 */
 	int pcore;
 
+	/**
+	 * Where that physical core is: NUMA node, socket (package), core within
+	 * the socket, and SMT thread within the core (see topology.h)
+	 */
+	int node;
+	int socket;
+	int core;
+	int smt;
+
 	/**
 	 *  Pointer to the TLS descriptor for this vcore.
 	 */
@@ -82,6 +95,8 @@ struct vcore_pvc_data {
 } __attribute((aligned(ARCH_CL_SIZE)));
 extern struct vcore_pvc_data *vcore_pvc_data;
 #define vcore_map(i) (vcore_pvc_data[i].pcore)
+#define vcore_node(i) (vcore_pvc_data[i].node)
+#define vcore_socket(i) (vcore_pvc_data[i].socket)
 #define vcore_tls_descs(i) (vcore_pvc_data[i].tls_desc)
 
 /**
@@ -124,6 +139,8 @@ void vcore_reenter(void (*entry_func)(void));
 /**
  * Requests k additional vcores. Returns -1 if the request is impossible.
  * Otherwise, blocks calling vcore until the request is granted and returns 0.
+ * If vcore_set_max() lowers the limit in the meantime, returns -1 with only
+ * the vcores granted by then.
 */
 extern int vcore_request(int k);
 
@@ -137,6 +154,88 @@ extern int vcore_request_specific(int vcoreid);
 */
 extern void vcore_yield();
 
+/**
+ * Sets max_vcores() to nr, between 1 and vcore_capacity(), and returns what it
+ * got set to.  Can be called at any time, from outside of vcore context.
+ * Vcores that end up past the new limit are told to go offline: the 2LS is
+ * expected to hand whatever they had over to the others and yield them as soon
+ * as it sees vcore_id() >= max_vcores().  Until they are all gone,
+ * num_vcores() may be over the limit, and vcore_request() fails.  The CPUs we
+ * may use get looked up again first: vcores that get created go on those, and
+ * vcores whose CPU is gone get moved.  See also vcore_watch_cpus().
+ */
+extern int vcore_set_max(int nr);
+
+/**
+ * For a vcore past max_vcores() that is about to yield: wakes up an offline
+ * vcore within the limit to take over, if there is one.  Returns 0 if it did.
+ */
+extern int vcore_handoff();
+
+/**
+ * Sets the time slice, in usec, after which a uthread that has not given up its
+ * vcore gets paused and handed back to the 2LS through sched_ops->thread_paused
+ * (0 to never preempt uthreads, the default).  Takes effect on each vcore the
+ * next time it comes online.  Defaults to PARLIB_PREEMPT_QUANTUM_USEC from the
+ * environment.
+ */
+extern void vcore_set_preempt_quantum(uint64_t usec);
+
+/**
+ * How the notifications sent to a vcore were taken.  Interrupts are the ones
+ * that found a uthread running and entered vcore context right away, deferred
+ * ones were left pending for the vcore to deal with later, either because it
+ * was in vcore context already or because the uthread running had notifs
+ * disabled.  Preemptions count the uthreads paused for using up their
+ * quantum.
+ */
+struct vcore_notif_stats {
+	unsigned long interrupts;
+	unsigned long deferred_vcore;
+	unsigned long deferred_uthread;
+	unsigned long preemptions;
+};
+
+/**
+ * Copies the notification counters of vcoreid into stats.
+ */
+extern void vcore_get_notif_stats(int vcoreid,
+                                  struct vcore_notif_stats *stats);
+
+/**
+ * Sets what a vcore does after it yields, until it gets requested again: spin
+ * with cpu_relax() for up to spin_cycles TSC cycles, then wait for up to
+ * wait_cycles more with umwait (or keep spinning, on CPUs without it), and
+ * only then park in the kernel.  Requesting a vcore that hasn't parked yet
+ * takes no system call on either side.  How long a vcore actually keeps at it
+ * adapts to how long it recently stayed offline: about twice that, and not at
+ * all once that gets longer than spin_cycles + wait_cycles.  The default, 0 and
+ * 0, parks right away.  Can be set through PARLIB_VCORE_IDLE_SPIN and
+ * PARLIB_VCORE_IDLE_WAIT.
+ */
+extern void vcore_set_idle_policy(uint64_t spin_cycles, uint64_t wait_cycles);
+
+/**
+ * What a vcore did while it was offline, by how it came back: requested while
+ * still spinning, while waiting with umwait, or after parking in the kernel.
+ * avg_idle_cycles is the running average vcore_set_idle_policy() goes by.
+ * wakes_sent counts the parked vcores that vcoreid (or the uthreads it ran)
+ * woke up for vcore_request().  A request only wakes up two of them itself,
+ * and every one of those two others, so a big request takes O(log n) steps.
+ */
+struct vcore_idle_stats {
+	unsigned long spin_wakeups;
+	unsigned long wait_wakeups;
+	unsigned long park_wakeups;
+	uint64_t avg_idle_cycles;
+	unsigned long wakes_sent;
+};
+
+/**
+ * Copies the idle counters of vcoreid into stats.
+ */
+extern void vcore_get_idle_stats(int vcoreid, struct vcore_idle_stats *stats);
+
 /**
  * Returns the id of the calling vcore.
  */
@@ -156,7 +255,8 @@ static inline size_t num_vcores(void)
 }
 
 /**
- * Returns the maximum number of allocatable vcores.
+ * Returns the maximum number of allocatable vcores.  Vcore ids below it are
+ * the ones that may be online, see vcore_set_max().
  */
 static inline size_t max_vcores(void)
 {
@@ -164,6 +264,18 @@ static inline size_t max_vcores(void)
 	return MIN(__max_vcores, MAX_VCORES);
 }
 
+/**
+ * Returns the number of vcores there can ever be, which max_vcores() never
+ * goes past.  Anything kept per vcore needs room for this many.  Defaults to
+ * the number of CPUs configured on the machine (or VCORE_LIMIT, if that is
+ * more), and can be set through PARLIB_VCORE_CAPACITY.
+ */
+static inline size_t vcore_capacity(void)
+{
+	extern int __vcore_capacity;
+	return __vcore_capacity;
+}
+
 /**
  * Returns whether you are currently running in vcore context or not.
  */
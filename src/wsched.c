@@ -0,0 +1,464 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* Work-stealing 2LS.
+ *
+ * Each vcore owns a Chase-Lev deque of runnable uthreads.  Only the owner
+ * pushes and pops at the bottom of its deque, without any atomic operation
+ * unless it is racing a thief for the last uthread in it.  Other vcores steal
+ * from the top with a single CAS.  The array backing a deque grows when it
+ * fills up.  Since a thief may still be reading from the array it replaced,
+ * old arrays are never freed; they add up to less than the current one.
+ *
+ * uthread_runnable() and uthread_paused() always go to the calling vcore.
+ * Runnable uthreads are run last in, first out, which keeps freshly woken
+ * uthreads on warm caches.  Paused uthreads go on a second deque that the
+ * owner takes from the top instead, so that uthreads that yield (or get
+ * preempted) take turns rather than getting right back on.  That one is
+ * looked at first every so often, so a vcore that keeps waking up uthreads
+ * doesn't starve the ones that yielded.
+ *
+ * An idle vcore looks at its own deques first, then at the vcore it last stole
+ * from, then at all of the others, and yields itself back once it has found
+ * nothing for a while.  Vcores on the same socket come first (see
+ * vcore_distance()), starting from a random one, then the rest the same way.  Making a uthread
+ * runnable while the calling vcore already has something to run requests
+ * another vcore to come and steal it.
+ *
+ * Stackless tasks get a third deque, run first in first out, like the paused
+ * one.  A vcore runs a batch of them every time it goes through
+ * sched_entry(), before picking a uthread, and an idle one steals them too.
+ *
+ * A vcore that finds itself past max_vcores() (see vcore_set_max()) moves
+ * everything on its deques to the orphan deques and yields.  Anybody steals
+ * from those, just like from the deques of another vcore, and busy vcores
+ * look at them every so often as well. */
+
+#include "internal/parlib.h"
+#include "internal/vcore.h"
+#include "internal/wsched.h"
+#include "parlib.h"
+#include "vcore.h"
+#include "uthread.h"
+#include "task.h"
+#include "topology.h"
+#include "event.h"
+#include "spinlock.h"
+#include "atomic.h"
+#include "arch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WSCHED_DEQUE_ORDER   8   /* initial deque size, log2 */
+#define WSCHED_IDLE_SPINS    1024
+/* Every this many uthreads, run a paused one before any runnable one. */
+#define WSCHED_FAIR_INTERVAL 61
+/* Most tasks run in a row before looking at uthreads again. */
+#define WSCHED_TASK_BATCH    64
+
+/* Which deque to push to. */
+#define WSCHED_RUNNABLE 0
+#define WSCHED_PAUSED   1
+#define WSCHED_TASKS    2
+
+struct wsched_array {
+	long mask;
+	void *buf[];
+};
+
+struct wsched_deque {
+	/* Next slot to steal from.  Written by thieves. */
+	long top __attribute__((aligned(ARCH_CL_SIZE)));
+	/* Next slot to push to.  Only written by the owner. */
+	long bottom __attribute__((aligned(ARCH_CL_SIZE)));
+	struct wsched_array *array;
+};
+
+struct wsched_vcore {
+	struct wsched_deque runnable;
+	struct wsched_deque paused;
+	struct wsched_deque tasks;
+	/* Owner-only state, used when looking for work. */
+	unsigned long nr_picks;
+	int last_victim;
+	unsigned int seed;
+	/* All the other vcores, the ones on our socket first. */
+	int *victims;
+	int nr_near;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct wsched_vcore *wsched_vcores;
+/* What vcores past max_vcores() left behind.  Pushes are serialized by the
+ * lock, which stands in for the owner. */
+static struct wsched_deque orphans;
+static struct wsched_deque orphan_tasks;
+static spin_pdr_lock_t orphans_lock;
+/* Number of vcores currently looking for something to steal. */
+static atomic_t nr_spinning = ATOMIC_INITIALIZER(0);
+
+static struct wsched_array *__array_alloc(long size)
+{
+	struct wsched_array *a = parlib_malloc(sizeof(struct wsched_array)
+	                                       + size * sizeof(void*));
+	a->mask = size - 1;
+	return a;
+}
+
+/* Called by the owner once its array is full.  The copy has to be published
+ * before any push past the end of the old array. */
+static struct wsched_array *__deque_grow(struct wsched_deque *dq, long t,
+                                         long b)
+{
+	struct wsched_array *old = dq->array;
+	struct wsched_array *a = __array_alloc(2 * (old->mask + 1));
+	for (long i = t; i < b; i++)
+		a->buf[i & a->mask] = old->buf[i & old->mask];
+	wmb();
+	dq->array = a;
+	return a;
+}
+
+static void __deque_init(struct wsched_deque *dq)
+{
+	dq->top = dq->bottom = 0;
+	dq->array = __array_alloc(1 << WSCHED_DEQUE_ORDER);
+}
+
+static long __deque_size(struct wsched_deque *dq)
+{
+	long n = *(volatile long*)&dq->bottom - *(volatile long*)&dq->top;
+	return n > 0 ? n : 0;
+}
+
+static void __deque_push(struct wsched_deque *dq, void *item)
+{
+	long b = dq->bottom;
+	long t = *(volatile long*)&dq->top;
+	struct wsched_array *a = dq->array;
+	if (b - t > a->mask)
+		a = __deque_grow(dq, t, b);
+	a->buf[b & a->mask] = item;
+	wmb();
+	*(volatile long*)&dq->bottom = b + 1;
+}
+
+static void *__deque_pop(struct wsched_deque *dq)
+{
+	long b = dq->bottom - 1;
+	struct wsched_array *a = dq->array;
+	*(volatile long*)&dq->bottom = b;
+	/* Thieves must see our claim on the bottom slot before we read top. */
+	mb();
+	long t = *(volatile long*)&dq->top;
+	if (t > b) {
+		/* Empty. */
+		*(volatile long*)&dq->bottom = b + 1;
+		return NULL;
+	}
+	void *item = a->buf[b & a->mask];
+	if (t == b) {
+		/* Last one left, race any thief for it. */
+		if (!atomic_cas((atomic_t*)&dq->top, t, t + 1))
+			item = NULL;
+		*(volatile long*)&dq->bottom = b + 1;
+	}
+	return item;
+}
+
+/* Also used by the owner to take from the top of its paused and task
+ * deques. */
+static void *__deque_steal(struct wsched_deque *dq)
+{
+	long t = *(volatile long*)&dq->top;
+	rmb();
+	long b = *(volatile long*)&dq->bottom;
+	if (t >= b)
+		return NULL;
+	struct wsched_array *a = *(struct wsched_array * volatile*)&dq->array;
+	void *item = a->buf[t & a->mask];
+	/* If we lose, somebody else got it, just move on. */
+	if (!atomic_cas((atomic_t*)&dq->top, t, t + 1))
+		return NULL;
+	return item;
+}
+
+/* Picks the next uthread to run out of our own deques. */
+static struct uthread *__pick_local(struct wsched_vcore *vc)
+{
+	struct uthread *uthread = NULL;
+	if (++vc->nr_picks % WSCHED_FAIR_INTERVAL == 0) {
+		uthread = __deque_steal(&orphans);
+		if (uthread == NULL)
+			uthread = __deque_steal(&vc->paused);
+	}
+	if (uthread == NULL)
+		uthread = __deque_pop(&vc->runnable);
+	if (uthread == NULL)
+		uthread = __deque_steal(&vc->paused);
+	return uthread;
+}
+
+static struct uthread *__steal_from(struct wsched_vcore *victim)
+{
+	struct uthread *uthread = __deque_steal(&victim->runnable);
+	if (uthread == NULL)
+		uthread = __deque_steal(&victim->paused);
+	return uthread;
+}
+
+/* The i-th vcore to steal from, out of vcore_capacity() - 1.  Each group of
+ * victims is gone through starting from a random one, at start. */
+static inline int __nth_victim(struct wsched_vcore *vc, int i,
+                               unsigned int start)
+{
+	int nr_far = vcore_capacity() - 1 - vc->nr_near;
+	if (i < vc->nr_near)
+		return vc->victims[(start + i) % vc->nr_near];
+	i -= vc->nr_near;
+	return vc->victims[vc->nr_near + (start + i) % nr_far];
+}
+
+static struct uthread *__steal(int vcoreid)
+{
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	struct uthread *uthread;
+	int nr = vcore_capacity() - 1;
+
+	if ((uthread = __deque_steal(&orphans)))
+		return uthread;
+	if (vc->last_victim != vcoreid) {
+		uthread = __steal_from(&wsched_vcores[vc->last_victim]);
+		if (uthread)
+			return uthread;
+	}
+	unsigned int start = rand_r(&vc->seed);
+	for (int i = 0; i < nr; i++) {
+		int victim = __nth_victim(vc, i, start);
+		uthread = __steal_from(&wsched_vcores[victim]);
+		if (uthread) {
+			vc->last_victim = victim;
+			return uthread;
+		}
+	}
+	return NULL;
+}
+
+/* Runs a batch of our own tasks, or, if we have none and are idle, one of
+ * somebody else's to start with.  Returns how many ran. */
+static int __run_tasks(int vcoreid, bool idle)
+{
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	struct task *task = __deque_steal(&vc->tasks);
+	if (task == NULL && (idle || vc->nr_picks % WSCHED_FAIR_INTERVAL == 0))
+		task = __deque_steal(&orphan_tasks);
+	if (task == NULL && idle) {
+		int nr = vcore_capacity() - 1;
+		unsigned int start = rand_r(&vc->seed);
+		for (int i = 0; i < nr && task == NULL; i++) {
+			int victim = __nth_victim(vc, i, start);
+			task = __deque_steal(&wsched_vcores[victim].tasks);
+		}
+	}
+	if (task == NULL)
+		return 0;
+
+	/* Don't keep others from waking up vcores while we are busy. */
+	if (idle)
+		atomic_add(&nr_spinning, -1);
+	int n = 0;
+	while (task) {
+		run_task(task);
+		if (++n == WSCHED_TASK_BATCH)
+			break;
+		task = __deque_steal(&vc->tasks);
+	}
+	if (idle)
+		atomic_add(&nr_spinning, 1);
+	return n;
+}
+
+/* Moves everything left on dq over to the orphan deque to. */
+static void __orphan_all(struct wsched_deque *dq, struct wsched_deque *to)
+{
+	if (__deque_size(dq) == 0)
+		return;
+	spin_pdr_lock(&orphans_lock);
+	while (__deque_size(dq)) {
+		void *item = __deque_steal(dq);
+		if (item)
+			__deque_push(to, item);
+	}
+	spin_pdr_unlock(&orphans_lock);
+}
+
+/* We are past max_vcores(): leave our work to the others, and go. */
+static void __retire(int vcoreid)
+{
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	if (current_uthread) {
+		struct uthread *uthread = current_uthread;
+		current_uthread = NULL;
+		uthread_paused(uthread);
+	}
+	__orphan_all(&vc->runnable, &orphans);
+	__orphan_all(&vc->paused, &orphans);
+	__orphan_all(&vc->tasks, &orphan_tasks);
+	if ((__deque_size(&orphans) || __deque_size(&orphan_tasks))
+	    && atomic_read(&nr_spinning) == 0)
+		vcore_handoff();
+	vcore_yield();
+}
+
+static void __wsched_entry(void)
+{
+	int vcoreid = vcore_id();
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	if (vcoreid >= max_vcores())
+		__retire(vcoreid);
+	if (current_uthread)
+		run_current_uthread();
+
+	__run_tasks(vcoreid, false);
+	struct uthread *uthread = __pick_local(vc);
+	if (uthread)
+		run_uthread(uthread);
+
+	atomic_add(&nr_spinning, 1);
+	for (int i = 0; i < WSCHED_IDLE_SPINS; i++) {
+		if (vcoreid >= max_vcores())
+			break;
+		uthread = __steal(vcoreid);
+		if (uthread == NULL) {
+			/* Events may well make something runnable on our own deques,
+			 * and we have the time to look for ready I/O. */
+			handle_events_idle();
+			if (__run_tasks(vcoreid, true))
+				i = 0;
+			uthread = __pick_local(vc);
+		}
+		if (uthread) {
+			atomic_add(&nr_spinning, -1);
+			run_uthread(uthread);
+		}
+		cpu_relax();
+	}
+	atomic_add(&nr_spinning, -1);
+	if (vcoreid >= max_vcores())
+		__retire(vcoreid);
+	vcore_yield();
+}
+
+static void __wsched_push(void *item, int which)
+{
+	/* Keep the vcore from running its own scheduler under our feet, or moving
+	 * us to another one, while we are using its deque. */
+	bool in_vcore = in_vcore_context();
+	if (!in_vcore)
+		uth_disable_notifs();
+
+	struct wsched_vcore *vc = &wsched_vcores[vcore_id()];
+	/* Whoever is running here, or the head of our deques, goes first.  If
+	 * there is any such thing, a newly runnable uthread or task is better off
+	 * on another vcore.  Paused ones can just wait for their turn. */
+	bool wake = which != WSCHED_PAUSED && (current_uthread != NULL
+	                                       || __deque_size(&vc->runnable)
+	                                       || __deque_size(&vc->paused)
+	                                       || __deque_size(&vc->tasks));
+	if (which == WSCHED_TASKS)
+		__deque_push(&vc->tasks, item);
+	else if (which == WSCHED_PAUSED)
+		__deque_push(&vc->paused, item);
+	else
+		__deque_push(&vc->runnable, item);
+
+	if (!in_vcore)
+		uth_enable_notifs();
+
+	if (wake && atomic_read(&nr_spinning) == 0
+	         && num_vcores() < max_vcores())
+		vcore_request(1);
+}
+
+static void __wsched_thread_runnable(struct uthread *uthread)
+{
+	__wsched_push(uthread, WSCHED_RUNNABLE);
+}
+
+static void __wsched_thread_paused(struct uthread *uthread)
+{
+	__wsched_push(uthread, WSCHED_PAUSED);
+}
+
+static void __wsched_task_runnable(struct task *task)
+{
+	__wsched_push(task, WSCHED_TASKS);
+}
+
+static void __wsched_thread_blockon_sysc(struct uthread *uthread, void *sysc)
+{
+	((struct syscall*)sysc)->u_data = uthread;
+}
+
+static void __wsched_handle_syscall(struct event_msg *ev_msg,
+                                    unsigned int ev_type)
+{
+	struct syscall *sysc = (struct syscall*)ev_msg->ev_arg3;
+	if (sysc->flags & SC_TASK)
+		task_wakeup((struct task*)sysc->u_data);
+	else
+		uthread_runnable((struct uthread*)sysc->u_data);
+}
+
+struct schedule_ops wsched_ops EXPORT_SYMBOL = {
+	.sched_entry = __wsched_entry,
+	.thread_runnable = __wsched_thread_runnable,
+	.thread_paused = __wsched_thread_paused,
+	.thread_blockon_sysc = __wsched_thread_blockon_sysc,
+	.task_runnable = __wsched_task_runnable,
+};
+
+static void __init_victims(int vcoreid)
+{
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	int n = 0;
+	vc->victims = parlib_malloc(sizeof(int) * vcore_capacity());
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < vcore_capacity(); i++) {
+			if (i == vcoreid)
+				continue;
+			bool near = vcore_distance(vcoreid, i) <= VCORE_DIST_SOCKET;
+			if (near == (pass == 0))
+				vc->victims[n++] = i;
+		}
+		if (pass == 0)
+			vc->nr_near = n;
+	}
+}
+
+void wsched_lib_init()
+{
+	size_t size = sizeof(struct wsched_vcore) * vcore_capacity();
+	wsched_vcores = parlib_aligned_alloc(PGSIZE, size);
+	memset(wsched_vcores, 0, size);
+	__deque_init(&orphans);
+	__deque_init(&orphan_tasks);
+	spin_pdr_init(&orphans_lock);
+	for (int i = 0; i < vcore_capacity(); i++) {
+		__deque_init(&wsched_vcores[i].runnable);
+		__deque_init(&wsched_vcores[i].paused);
+		__deque_init(&wsched_vcores[i].tasks);
+		wsched_vcores[i].last_victim = i;
+		wsched_vcores[i].seed = i + 1;
+		__init_victims(i);
+	}
+	if (ev_handlers[EV_SYSCALL] == NULL)
+		ev_handlers[EV_SYSCALL] = __wsched_handle_syscall;
+}
+
+long EXPORT_SYMBOL wsched_nr_runnable(int vcoreid)
+{
+	struct wsched_vcore *vc = &wsched_vcores[vcoreid];
+	return __deque_size(&vc->runnable) + __deque_size(&vc->paused)
+	       + __deque_size(&vc->tasks);
+}
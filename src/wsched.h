@@ -0,0 +1,31 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+#ifndef PARLIB_WSCHED_H
+#define PARLIB_WSCHED_H
+
+#include "uthread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Work-stealing second-level scheduler shipped with parlib.  This is what
+ * sched_ops points to unless the application installs its own before calling
+ * uthread_lib_init(), which sets it up.
+ *
+ * Every vcore runs uthreads out of its own deque.  A uthread made runnable
+ * (or paused) on a vcore goes on that vcore's deque, and vcores that run out
+ * of work steal from the others before yielding themselves back.  Uthreads
+ * are handed to it with uthread_runnable() once they have been set up with
+ * uthread_init() and init_uthread_tf(). */
+extern struct schedule_ops wsched_ops;
+
+/* Number of uthreads and tasks runnable on vcoreid, as last seen. */
+long wsched_nr_runnable(int vcoreid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // PARLIB_WSCHED_H
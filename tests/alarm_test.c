@@ -1,5 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
 #include <unistd.h>
+#include "uthread.h"
 #include "alarm.h"
 #include "internal/time.h"
 #include "timing.h"
@@ -11,8 +14,22 @@ void cb(struct alarm_waiter* awaiter) {
   __sync_fetch_and_add(&progress, 1);
 }
 
+volatile int count_c = 0, count_d = 0;
+
+void cb_c(struct alarm_waiter* awaiter) {
+  count_c++;
+}
+
+void cb_d(struct alarm_waiter* awaiter) {
+  count_d++;
+}
+
+static struct uthread main_thread;
+
 int main() {
-  struct alarm_waiter a, b;
+  struct alarm_waiter a, b, c, d;
+  setenv("VCORE_LIMIT", "1", 1);
+  uthread_lib_init(&main_thread);
   init_awaiter(&a, cb);
   init_awaiter(&b, cb);
 
@@ -33,5 +50,23 @@ int main() {
   set_alarm(&b);
   while (progress < 3);
 
+  /* Arm c again after it went off, but before its func got to run, and let it
+   * go off again along with d. */
+  init_awaiter(&c, cb_c);
+  init_awaiter(&d, cb_d);
+  uth_disable_notifs();
+  set_awaiter_rel(&c, 1000);
+  set_alarm(&c);
+  udelay(20000);
+  set_awaiter_rel(&c, 1000);
+  set_alarm(&c);
+  set_awaiter_rel(&d, 2000);
+  set_alarm(&d);
+  udelay(20000);
+  uth_enable_notifs();
+  while (count_d < 1);
+  assert(count_c == 1 && count_d == 1);
+  printf("Alarm armed again before its func ran went off once\n");
+
   return 0;
 }
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "stack.h"
+#include "atomic.h"
+
+#define NR_THREADS 100
+#define RESERVE    (8 * 1024 * 1024)
+#define DEPTH      (1024 * 1024)
+
+static struct uthread main_thread;
+static struct uthread threads[NR_THREADS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void exit_cb(struct uthread *uthread, void *arg)
+{
+  atomic_add(&done, 1);
+}
+
+/* Goes about bytes deep into the stack, yielding on the way down. */
+static int recurse(long bytes)
+{
+  volatile char buf[4096];
+  buf[0] = buf[sizeof(buf) - 1] = 1;
+  if (bytes <= (long)sizeof(buf))
+    return buf[0];
+  if (bytes % (64 * 1024) < (long)sizeof(buf))
+    uthread_yield(true, yield_cb, NULL);
+  return recurse(bytes - sizeof(buf)) + buf[sizeof(buf) - 1];
+}
+
+static void thread_func()
+{
+  recurse(DEPTH);
+  /* Back near the top: enough yields for the stack to get trimmed. */
+  for (int i = 0; i < 256; i++)
+    uthread_yield(true, yield_cb, NULL);
+  uthread_yield(false, exit_cb, NULL);
+}
+
+static void overflow_func()
+{
+  recurse(2 * RESERVE);
+}
+
+int main()
+{
+  uthread_set_stack_reserve(RESERVE);
+  uthread_lib_init(&main_thread);
+
+  /* Going past the reservation is a plain segfault. */
+  pid_t pid = fork();
+  if (pid == 0) {
+    uthread_init(&threads[0]);
+    init_uthread_tf(&threads[0], overflow_func, NULL, 0);
+    uthread_runnable(&threads[0]);
+    for (;;)
+      uthread_yield(true, yield_cb, NULL);
+  }
+  int status;
+  /* Preemption ticks may well interrupt us. */
+  while (waitpid(pid, &status, 0) < 0)
+    assert(errno == EINTR);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  printf("overflow ok\n");
+
+  /* No address space left for a reservation: an error, not an abort. */
+  struct rlimit as;
+  long pages;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  assert(statm && fscanf(statm, "%ld", &pages) == 1);
+  fclose(statm);
+  assert(getrlimit(RLIMIT_AS, &as) == 0);
+  struct rlimit tight = { pages * getpagesize() + RESERVE / 2, as.rlim_max };
+  uthread_init(&threads[0]);
+  assert(setrlimit(RLIMIT_AS, &tight) == 0);
+  int ret = init_uthread_tf(&threads[0], thread_func, NULL, 0);
+  int err = errno;
+  assert(setrlimit(RLIMIT_AS, &as) == 0);
+  assert(ret == -1 && err == ENOMEM);
+  uthread_cleanup(&threads[0]);
+  printf("out of address space ok\n");
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    uthread_init(&threads[i]);
+    assert(init_uthread_tf(&threads[i], thread_func, NULL, 0) == 0);
+    assert(threads[i].stack_size == RESERVE);
+    assert(uthread_stack_hwm(&threads[i]) == STACK_MIN_SIZE);
+    uthread_runnable(&threads[i]);
+  }
+  while (atomic_read(&done) < NR_THREADS)
+    uthread_yield(true, yield_cb, NULL);
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    struct uthread *uth = &threads[i];
+    size_t hwm = uthread_stack_hwm(uth);
+    size_t used = (char*)uth->stack + uth->stack_size - (char*)uth->stack_low;
+    assert(hwm >= DEPTH && hwm < DEPTH + 256 * 1024);
+    assert(used < hwm / 4);
+    if (i == 0)
+      printf("hwm %zu KB, %zu KB left after trimming\n", hwm / 1024,
+             used / 1024);
+    uthread_cleanup(uth);
+  }
+  return 0;
+}
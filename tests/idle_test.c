@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "atomic.h"
+#include "timing.h"
+
+#define NR_ROUNDS  100
+#define NR_THREADS 10
+#define STACK_SIZE (64 * 1024)
+#define SPIN       2000000
+#define WAIT       2000000
+
+static struct uthread main_thread;
+static struct uthread threads[NR_THREADS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void exit_cb(struct uthread *uthread, void *arg)
+{
+  /* Only now are we off of the stack the next round hands out again. */
+  atomic_add(&done, 1);
+}
+
+/* The vcore we are not on.  We don't yield in the tests below, so it stays
+ * that way. */
+static int other;
+
+/* Lets the other vcore go offline, leaves it there for usec, and requests it
+ * back. */
+static void idle_other(uint64_t usec)
+{
+  while (num_vcores() > 1)
+    cpu_relax();
+  udelay(usec);
+  assert(vcore_request(1) == 0);
+}
+
+/* Waits for the other vcore to come back from whatever idle_other() it is
+ * in. */
+static void wait_for_wakeup(struct vcore_idle_stats *before)
+{
+  struct vcore_idle_stats stats;
+  do {
+    cpu_relax();
+    vcore_get_idle_stats(other, &stats);
+  } while (stats.spin_wakeups + stats.wait_wakeups + stats.park_wakeups ==
+           before->spin_wakeups + before->wait_wakeups + before->park_wakeups);
+  *before = stats;
+}
+
+/* The other vcore stays offline for 20ms at a time, well within a 50ms spin
+ * budget, so it comes to spin for about twice that, and catches a request made
+ * right after it goes offline without parking.  Then it stays offline for much
+ * longer than the budget, and stops spinning at all. */
+static void test_spin_window(void)
+{
+  uint64_t budget = msec2tsc(50);
+  struct vcore_idle_stats stats;
+  other = 1 - vcore_id();
+  vcore_set_idle_policy(budget, 0);
+  vcore_get_idle_stats(other, &stats);
+
+  for (int i = 0; i < 8; i++) {
+    idle_other(20000);
+    wait_for_wakeup(&stats);
+  }
+  assert(stats.avg_idle_cycles > 0 && stats.avg_idle_cycles <= budget);
+  unsigned long spins = stats.spin_wakeups;
+  for (int i = 0; i < 10; i++) {
+    idle_other(0);
+    wait_for_wakeup(&stats);
+  }
+  printf("short idles: spin %lu of 10, avg %llu cycles\n",
+         stats.spin_wakeups - spins,
+         (unsigned long long)stats.avg_idle_cycles);
+  assert(stats.spin_wakeups > spins);
+
+  for (int i = 0; i < 8; i++) {
+    idle_other(200000);
+    wait_for_wakeup(&stats);
+  }
+  assert(stats.avg_idle_cycles > budget);
+  spins = stats.spin_wakeups;
+  unsigned long parks = stats.park_wakeups;
+  idle_other(0);
+  wait_for_wakeup(&stats);
+  printf("long idles: avg %llu cycles, parked right away\n",
+         (unsigned long long)stats.avg_idle_cycles);
+  assert(stats.spin_wakeups == spins && stats.park_wakeups == parks + 1);
+  vcore_set_idle_policy(0, 0);
+}
+
+static void thread_func()
+{
+  for (int i = 0; i < 10; i++)
+    uthread_yield(true, yield_cb, NULL);
+  uthread_yield(false, exit_cb, NULL);
+}
+
+int main()
+{
+  setenv("VCORE_LIMIT", "2", 1);
+  uthread_lib_init(&main_thread);
+  vcore_set_idle_policy(SPIN, WAIT);
+
+  /* Bursts of work with nothing in between, so that vcore 1 keeps going
+   * offline and getting requested again. */
+  void *stacks[NR_THREADS];
+  for (int i = 0; i < NR_THREADS; i++)
+    stacks[i] = malloc(STACK_SIZE);
+  for (int r = 0; r < NR_ROUNDS; r++) {
+    atomic_set(&done, 0);
+    for (int i = 0; i < NR_THREADS; i++) {
+      uthread_init(&threads[i]);
+      init_uthread_tf(&threads[i], thread_func, stacks[i], STACK_SIZE);
+      uthread_runnable(&threads[i]);
+    }
+    while ((long)atomic_read(&done) < NR_THREADS)
+      uthread_yield(true, yield_cb, NULL);
+  }
+
+  struct vcore_idle_stats stats;
+  vcore_get_idle_stats(1, &stats);
+  printf("spin %lu, wait %lu, park %lu, avg %llu cycles\n",
+         stats.spin_wakeups, stats.wait_wakeups, stats.park_wakeups,
+         (unsigned long long)stats.avg_idle_cycles);
+  assert(stats.spin_wakeups + stats.wait_wakeups + stats.park_wakeups > 0);
+  assert(stats.avg_idle_cycles <= 2 * (SPIN + WAIT));
+
+  test_spin_window();
+  return 0;
+}
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
 #include "internal/pthread_pool.h"
 #include "spinlock.h"
+#include "atomic.h"
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -26,6 +31,40 @@ void *func(void *arg)
   return 0;
 }
 
+/* Stands in for the pool's pthread_create(), to count the pthreads it starts
+ * and make the next few of them fail. */
+static atomic_t nr_created = ATOMIC_INITIALIZER(0);
+static atomic_t nr_failures = ATOMIC_INITIALIZER(0);
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                   void *(*start_routine)(void*), void *arg)
+{
+  static int (*real_create)(pthread_t*, const pthread_attr_t*,
+                            void *(*)(void*), void*);
+  if (real_create == NULL)
+    real_create = dlsym(RTLD_NEXT, "pthread_create");
+  long failures = (long)atomic_read(&nr_failures);
+  if (failures > 0 && atomic_cas(&nr_failures, failures, failures - 1))
+    return EAGAIN;
+  atomic_add(&nr_created, 1);
+  return real_create(thread, attr, start_routine, arg);
+}
+
+static atomic_t nr_ran = ATOMIC_INITIALIZER(0);
+
+void *count_func(void *arg)
+{
+  atomic_add(&nr_ran, 1);
+  return 0;
+}
+
+static void wait_for_ran(long n)
+{
+  for (int i = 0; i < 5000 && (long)atomic_read(&nr_ran) < n; i++)
+    usleep(1000);
+  assert((long)atomic_read(&nr_ran) == n);
+}
+
 int main() {
   int i;
   main_thread = pthread_self();
@@ -37,5 +76,28 @@ int main() {
     if (i % 10 == 0)
       usleep(10000);
   }
+
+  /* Let everybody retire, then have the pool fail to start a pthread for a
+   * job while it has none left: the job must run nonetheless. */
+  pthread_pool_set_idle_timeout(1000);
+  usleep(1100000);
+  atomic_set(&nr_failures, 3);
+  pooled_pthread_start(&count_func, NULL);
+  wait_for_ran(1);
+  assert(atomic_read(&nr_failures) == 0);
+  printf("job ran despite failed pthread_creates\n");
+
+  /* Pthreads up to min are started up front, and stay. */
+  usleep(100000);
+  long created = (long)atomic_read(&nr_created);
+  pthread_pool_set_size(4, 0);
+  assert((long)atomic_read(&nr_created) - created == 4);
+  usleep(100000);
+  created = (long)atomic_read(&nr_created);
+  for (i = 0; i < 4; i++)
+    pooled_pthread_start(&count_func, NULL);
+  wait_for_ran(5);
+  assert((long)atomic_read(&nr_created) == created);
+  printf("min pthreads started up front\n");
   return -1 + 1;
 }
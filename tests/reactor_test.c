@@ -0,0 +1,73 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "event.h"
+#include "timing.h"
+
+static struct uthread main_thread;
+static int write_fd;
+
+static void *writer(void *arg)
+{
+  usleep(50000);
+  assert(write(write_fd, "x", 1) == 1);
+  return NULL;
+}
+
+/* Blocks on reading fds[0] until some pthread writes to fds[1]. */
+static void read_one(int fds[2])
+{
+  pthread_t pthread;
+  char c;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  write_fd = fds[1];
+  pthread_create(&pthread, NULL, writer, NULL);
+  assert(read(fds[0], &c, 1) == 1 && c == 'x');
+  pthread_join(pthread, NULL);
+}
+
+/* Reads from an empty pipe with a timeout of 50ms, which nobody writes to. */
+static void time_out(int fds[2])
+{
+  char c;
+  uint64_t start = read_tsc();
+  set_syscall_timeout(50000);
+  assert(read(fds[0], &c, 1) == -1 && errno == EAGAIN);
+  uint64_t msec = tsc2msec(read_tsc() - start);
+  printf("timed out after %llu ms\n", (unsigned long long)msec);
+  assert(msec >= 40 && msec < 1000);
+}
+
+int main()
+{
+  setenv("PARLIB_IO_ENGINE", "epoll", 1);
+  uthread_lib_init(&main_thread);
+
+  int fds[2], again[2];
+  assert(pipe(fds) == 0);
+  read_one(fds);
+
+  /* fclose() closes the fd from within libc, where parlib doesn't see it.
+   * The next pipe gets the same fd number, and must not be mistaken for the
+   * one that was in the reactor before. */
+  fclose(fdopen(fds[0], "r"));
+  fclose(fdopen(fds[1], "w"));
+  assert(pipe(again) == 0);
+  assert(again[0] == fds[0]);
+  read_one(again);
+  printf("reused fd %d woke up\n", again[0]);
+
+  /* A timeout that doesn't run out leaves nothing behind to go off later. */
+  set_syscall_timeout(1000000);
+  read_one(again);
+  time_out(again);
+  time_out(again);
+  return 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "task.h"
+#include "atomic.h"
+
+#define NR_THREADS 32
+#define NR_TASKS   8
+#define NR_FLIPS   1000
+#define STACK_SIZE (64 * 1024)
+
+static struct uthread main_thread;
+static struct uthread threads[NR_THREADS];
+static struct task tasks[NR_TASKS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+static volatile bool stop = false;
+static volatile bool flipped = false;
+static volatile int ran_on[MAX_VCORES];
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void exit_cb(struct uthread *uthread, void *arg)
+{
+}
+
+static void thread_func()
+{
+  while (!stop) {
+    ran_on[vcore_id()] = 1;
+    for (volatile int i = 0; i < 1000; i++);
+    uthread_yield(true, yield_cb, NULL);
+  }
+  atomic_add(&done, 1);
+  uthread_yield(false, exit_cb, NULL);
+}
+
+static int task_fn(struct task *task)
+{
+  TASK_BEGIN(task);
+  while (!stop) {
+    ran_on[vcore_id()] = 1;
+    TASK_YIELD(task);
+  }
+  atomic_add(&done, 1);
+  TASK_END(task);
+}
+
+/* Takes the limit up and down while the 2LS keeps requesting vcores, the way
+ * vcore_watch_cpus() would, and leaves it down. */
+static void *flip_func(void *arg)
+{
+  for (int i = 0; i < NR_FLIPS; i++) {
+    vcore_set_max(i % 2 ? 1 : 6);
+    usleep(i % 10);
+  }
+  vcore_set_max(1);
+  flipped = true;
+  return NULL;
+}
+
+/* Lets everybody run for a while, and returns how many vcores they ran on,
+ * and the highest one of them. */
+static int run_for_a_while(int *highest)
+{
+  memset((void*)ran_on, 0, sizeof(ran_on));
+  for (int i = 0; i < 2000; i++)
+    uthread_yield(true, yield_cb, NULL);
+  int n = 0;
+  *highest = -1;
+  for (int i = 0; i < MAX_VCORES; i++) {
+    if (ran_on[i]) {
+      n++;
+      *highest = i;
+    }
+  }
+  return n;
+}
+
+int main()
+{
+  /* We are the ones changing max_vcores() here. */
+  unsetenv("PARLIB_VCORE_WATCH_USEC");
+  setenv("VCORE_LIMIT", "2", 1);
+  setenv("PARLIB_VCORE_CAPACITY", "6", 1);
+  uthread_lib_init(&main_thread);
+  assert(max_vcores() == 2 && vcore_capacity() == 6);
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    uthread_init(&threads[i]);
+    init_uthread_tf(&threads[i], thread_func, malloc(STACK_SIZE), STACK_SIZE);
+    uthread_runnable(&threads[i]);
+  }
+  for (int i = 0; i < NR_TASKS; i++) {
+    task_init(&tasks[i], task_fn);
+    task_runnable(&tasks[i]);
+  }
+
+  int highest;
+  int n = run_for_a_while(&highest);
+  printf("2 vcores: ran on %d, highest %d\n", n, highest);
+  assert(highest < 2);
+
+  assert(vcore_set_max(100) == 6);
+  n = run_for_a_while(&highest);
+  printf("6 vcores: ran on %d, highest %d\n", n, highest);
+  assert(highest < 6);
+
+  assert(vcore_set_max(1) == 1);
+  while (num_vcores() > 1)
+    uthread_yield(true, yield_cb, NULL);
+  n = run_for_a_while(&highest);
+  printf("1 vcore: ran on %d, highest %d\n", n, highest);
+  assert(n == 1 && highest == 0);
+
+  assert(vcore_set_max(3) == 3);
+  n = run_for_a_while(&highest);
+  printf("3 vcores: ran on %d, highest %d\n", n, highest);
+  assert(highest < 3);
+
+  pthread_t flipper;
+  assert(pthread_create(&flipper, NULL, flip_func, NULL) == 0);
+  while (!flipped)
+    uthread_yield(true, yield_cb, NULL);
+  pthread_join(flipper, NULL);
+  while (num_vcores() > 1)
+    uthread_yield(true, yield_cb, NULL);
+  n = run_for_a_while(&highest);
+  printf("%d flips, then 1 vcore: ran on %d, highest %d\n", NR_FLIPS, n,
+         highest);
+  assert(n == 1 && highest == 0);
+
+  stop = true;
+  while ((long)atomic_read(&done) < NR_THREADS + NR_TASKS)
+    uthread_yield(true, yield_cb, NULL);
+  printf("all done\n");
+  return 0;
+}
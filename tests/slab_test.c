@@ -1,5 +1,12 @@
 #include <slab.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "topology.h"
+#include "uthread_fixture.h"
+
+#define NR_THREADS 16
+#define NR_ALLOCS  100
 
 static void test_single_cache(int iters, size_t size, int align, int flags,
                               void (*ctor)(void *, size_t),
@@ -30,9 +37,84 @@ void a_dtor(void *buf, size_t size)
 	printf("destructin tests\n");
 }
 
+/* Every uthread allocates from whatever vcore it is on, and notes its node. */
+static struct slab_cache *node_cache;
+static struct uthread threads[NR_THREADS];
+static void *objs[NR_THREADS][NR_ALLOCS];
+static int obj_node[NR_THREADS][NR_ALLOCS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+
+static void node_alloc_func()
+{
+	int me = (struct uthread*)current_uthread - threads;
+	for (int i = 0; i < NR_ALLOCS; i++) {
+		/* Stay on this vcore until the allocation is done. */
+		uth_disable_notifs();
+		obj_node[me][i] = vcore_node(vcore_id());
+		objs[me][i] = slab_cache_alloc(node_cache, 0);
+		uth_enable_notifs();
+		test_yield();
+	}
+	test_exit(&done);
+}
+
+static unsigned long node_stat(int node, bool frees)
+{
+	struct slab_stats stats;
+	slab_cache_stats(node_cache->node_caches[node], &stats);
+	return frees ? stats.frees : stats.allocs;
+}
+
+/* Caches get created before the vcores, and with them the topology. */
+static void test_node_local(void)
+{
+	unsigned long per_node[2] = {0, 0};
+
+	node_cache = slab_cache_create("node_local", 1024, 16, SLAB_NODE_LOCAL,
+	                               0, 0);
+	void *early = slab_cache_alloc(node_cache, 0);
+	assert(node_cache->node_caches == NULL);
+
+	setenv("PARLIB_TOPOLOGY_NODES", "2", 1);
+	setenv("VCORE_LIMIT", "2", 1);
+	test_init();
+	assert(topology_nr_nodes() == 2);
+	for (int i = 0; i < NR_THREADS; i++)
+		test_spawn(&threads[i], node_alloc_func, TEST_STACK_SIZE);
+	test_wait_for(&done, NR_THREADS);
+	assert(node_cache->node_caches != NULL);
+
+	for (int i = 0; i < NR_THREADS; i++)
+		for (int j = 0; j < NR_ALLOCS; j++)
+			per_node[obj_node[i][j]]++;
+	printf("node 0: %lu allocs, node 1: %lu allocs\n", per_node[0],
+	       per_node[1]);
+	assert(per_node[0] > 0 && per_node[1] > 0);
+	for (int n = 0; n < 2; n++)
+		assert(node_stat(n, false) == per_node[n]);
+
+	/* Frees go back to the node the object came from, from wherever. */
+	for (int i = 0; i < NR_THREADS; i++)
+		for (int j = 0; j < NR_ALLOCS; j++)
+			slab_cache_free(node_cache, objs[i][j]);
+	slab_cache_free(node_cache, early);
+	for (int n = 0; n < 2; n++)
+		assert(node_stat(n, true) == per_node[n]);
+
+	/* The stats of the cache add up those of its nodes. */
+	struct slab_stats stats;
+	slab_cache_reap(node_cache);
+	slab_cache_stats(node_cache, &stats);
+	assert(stats.reaps == 2);
+	assert(stats.max_alloc >= per_node[0] && stats.max_alloc >= per_node[1]);
+	slab_cache_destroy(node_cache);
+}
+
 int main(void)
 {
 	test_single_cache(10, 128, 512, 0, 0, 0);
 	test_single_cache(10, 128, 4, 0, a_ctor, a_dtor);
 	test_single_cache(10, 1024, 16, 0, 0, 0);
+	test_single_cache(10, 1024, 16, SLAB_NODE_LOCAL, 0, 0);
+	test_node_local();
 }
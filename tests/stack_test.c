@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "stack.h"
+#include "atomic.h"
+
+#define NR_ROUNDS  100
+#define NR_THREADS 100
+
+static struct uthread main_thread;
+static struct uthread threads[NR_THREADS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+static void *stack_seen[NR_THREADS];
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void exit_cb(struct uthread *uthread, void *arg)
+{
+  /* Off of our stack now, main() can clean us up. */
+  atomic_add(&done, 1);
+}
+
+static void thread_func()
+{
+  /* Use up some of it. */
+  volatile char buf[8192];
+  buf[0] = buf[sizeof(buf) - 1] = 1;
+  uthread_yield(false, exit_cb, NULL);
+}
+
+int main()
+{
+  assert(stack_round_size(1) == STACK_MIN_SIZE);
+  assert(stack_round_size(STACK_MIN_SIZE + 1) == 2 * STACK_MIN_SIZE);
+  assert(stack_round_size(STACK_MAX_CACHED_SIZE) == STACK_MAX_CACHED_SIZE);
+
+  /* Running off the end of a stack hits its guard page. */
+  char *stack = stack_alloc(STACK_MIN_SIZE);
+  stack[0] = stack[STACK_MIN_SIZE - 1] = 1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    stack[-1] = 1;
+    exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  stack_free(stack, STACK_MIN_SIZE);
+  printf("guard page ok\n");
+
+  /* Same for the ones that are too big to be cached. */
+  stack = stack_alloc(2 * STACK_MAX_CACHED_SIZE);
+  stack[0] = 1;
+  stack_free(stack, 2 * STACK_MAX_CACHED_SIZE);
+
+  /* Uthreads that come and go keep reusing the same few stacks. */
+  uthread_lib_init(&main_thread);
+  int reused = 0;
+  for (int r = 0; r < NR_ROUNDS; r++) {
+    atomic_set(&done, 0);
+    for (int i = 0; i < NR_THREADS; i++) {
+      uthread_init(&threads[i]);
+      init_uthread_tf(&threads[i], thread_func, NULL, 64 * 1024);
+      if (r > 0) {
+        for (int j = 0; j < NR_THREADS; j++) {
+          if (threads[i].stack == stack_seen[j]) {
+            reused++;
+            break;
+          }
+        }
+      }
+      uthread_runnable(&threads[i]);
+    }
+    while (atomic_read(&done) < NR_THREADS)
+      uthread_yield(true, yield_cb, NULL);
+    for (int i = 0; i < NR_THREADS; i++) {
+      if (r == 0)
+        stack_seen[i] = threads[i].stack;
+      uthread_cleanup(&threads[i]);
+    }
+  }
+  printf("%d of %d stacks reused\n", reused, (NR_ROUNDS - 1) * NR_THREADS);
+  assert(reused == (NR_ROUNDS - 1) * NR_THREADS);
+  return 0;
+}
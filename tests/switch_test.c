@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "atomic.h"
+
+#define NR_SWITCHES 1000000
+#define NR_THREADS  100
+#define STACK_SIZE  (64 * 1024)
+
+static struct uthread main_thread;
+static struct uthread peer;
+static struct uthread threads[NR_THREADS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+static volatile long nr_pongs = 0;
+
+static void blocked_cb(struct uthread *uthread, void *arg)
+{
+  /* Whoever we switched to runs us again. */
+  uthread_has_blocked(uthread, UTH_EXT_BLK_JUSTICE);
+}
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void exit_cb(struct uthread *uthread, void *arg)
+{
+  /* Nobody ever runs us again. */
+}
+
+static void peer_func()
+{
+  while (1) {
+    nr_pongs++;
+    uthread_yield_to(&main_thread, blocked_cb, NULL);
+  }
+}
+
+/* Every thread in the chain switches to the next one, and gets run again by
+ * the 2LS later on. */
+static void chain_func()
+{
+  struct uthread *next = current_uthread + 1;
+  if (next < &threads[NR_THREADS])
+    uthread_switch_to(next);
+  atomic_add(&done, 1);
+  uthread_yield(false, exit_cb, NULL);
+}
+
+static double usec_since(struct timeval *start)
+{
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) * 1000000.0
+         + (end.tv_usec - start->tv_usec);
+}
+
+int main()
+{
+  struct timeval start;
+  uthread_lib_init(&main_thread);
+
+  uthread_init(&peer);
+  init_uthread_tf(&peer, peer_func, malloc(STACK_SIZE), STACK_SIZE);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < NR_SWITCHES; i++)
+    uthread_yield_to(&peer, blocked_cb, NULL);
+  printf("%ld ping-pongs, %.1f nsec per switch\n", nr_pongs,
+         usec_since(&start) * 1000 / (2 * NR_SWITCHES));
+  if (nr_pongs != NR_SWITCHES)
+    return 1;
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < NR_SWITCHES; i++)
+    uthread_yield(true, yield_cb, NULL);
+  printf("%d yields, %.1f nsec per yield\n", NR_SWITCHES,
+         usec_since(&start) * 1000 / NR_SWITCHES);
+
+  for (int i = 0; i < NR_THREADS; i++) {
+    uthread_init(&threads[i]);
+    init_uthread_tf(&threads[i], chain_func, malloc(STACK_SIZE), STACK_SIZE);
+  }
+  uthread_switch_to(&threads[0]);
+  while (atomic_read(&done) < NR_THREADS)
+    uthread_yield(true, yield_cb, NULL);
+  printf("%d chained uthreads done\n", NR_THREADS);
+  return 0;
+}
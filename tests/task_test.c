@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "task.h"
+#include "atomic.h"
+
+#define NR_PARENTS  100
+#define NR_CHILDREN 1000
+#define NR_YIELDS   1000
+
+static struct uthread main_thread;
+static atomic_t done = ATOMIC_INITIALIZER(0);
+
+static void yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void wait_for(long n)
+{
+  while ((long)atomic_read(&done) < n)
+    uthread_yield(true, yield_cb, NULL);
+}
+
+/* Fan-out: every parent starts a bunch of children, and blocks until the
+ * last one of them is done. */
+struct parent {
+  struct task task;
+  atomic_t pending;
+  struct child *children;
+};
+
+struct child {
+  struct task task;
+  struct parent *parent;
+};
+
+static int child_fn(struct task *task)
+{
+  struct parent *parent = ((struct child*)task)->parent;
+  if ((long)atomic_add(&parent->pending, -1) == 1)
+    task_wakeup(&parent->task);
+  return TASK_DONE;
+}
+
+static int parent_fn(struct task *task)
+{
+  struct parent *p = (struct parent*)task;
+  TASK_BEGIN(task);
+  atomic_set(&p->pending, NR_CHILDREN);
+  for (int i = 0; i < NR_CHILDREN; i++) {
+    p->children[i].parent = p;
+    task_init(&p->children[i].task, child_fn);
+    task_runnable(&p->children[i].task);
+  }
+  while (atomic_read(&p->pending))
+    TASK_BLOCK(task);
+  atomic_add(&done, 1);
+  TASK_END(task);
+}
+
+struct yielder {
+  struct task task;
+  int count;
+};
+
+static int yielder_fn(struct task *task)
+{
+  struct yielder *y = (struct yielder*)task;
+  TASK_BEGIN(task);
+  for (y->count = 0; y->count < NR_YIELDS; y->count++)
+    TASK_YIELD(task);
+  atomic_add(&done, 1);
+  TASK_END(task);
+}
+
+struct reader {
+  struct task task;
+  int fd;
+  uint64_t timeout;
+  char c;
+  int res;
+};
+
+static int reader_fn(struct task *task)
+{
+  struct reader *r = (struct reader*)task;
+  TASK_BEGIN(task);
+  while (read(r->fd, &r->c, 1) < 0 && errno == EAGAIN) {
+    TASK_WAIT_FD(task, r->fd, POLLIN, r->timeout);
+    r->res = task->res;
+    if (r->res < 0)
+      break;
+  }
+  atomic_add(&done, 1);
+  TASK_END(task);
+}
+
+struct waiter {
+  struct task task;
+  int fd;
+  int res;
+};
+
+static int waiter_fn(struct task *task)
+{
+  struct waiter *w = (struct waiter*)task;
+  TASK_BEGIN(task);
+  TASK_WAIT_FD(task, w->fd, POLLIN, 0);
+  w->res = task->res;
+  atomic_add(&done, 1);
+  TASK_END(task);
+}
+
+int main()
+{
+  uthread_lib_init(&main_thread);
+
+  struct timeval start, end;
+  static struct parent parents[NR_PARENTS];
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < NR_PARENTS; i++) {
+    parents[i].children = malloc(NR_CHILDREN * sizeof(struct child));
+    task_init(&parents[i].task, parent_fn);
+    task_runnable(&parents[i].task);
+  }
+  wait_for(NR_PARENTS);
+  gettimeofday(&end, NULL);
+  long usec = (end.tv_sec - start.tv_sec) * 1000000
+              + end.tv_usec - start.tv_usec;
+  printf("%d tasks in %ld usec, %.1f nsec per task\n",
+         NR_PARENTS * NR_CHILDREN, usec,
+         usec * 1000.0 / (NR_PARENTS * NR_CHILDREN));
+  for (int i = 0; i < NR_PARENTS; i++)
+    free(parents[i].children);
+
+  atomic_set(&done, 0);
+  static struct yielder yielders[10];
+  for (int i = 0; i < 10; i++) {
+    task_init(&yielders[i].task, yielder_fn);
+    task_runnable(&yielders[i].task);
+  }
+  wait_for(10);
+  for (int i = 0; i < 10; i++)
+    assert(yielders[i].count == NR_YIELDS);
+  printf("yielders done\n");
+
+  /* Waiting on an fd, once until it is ready and once until we give up. */
+  int fds[2];
+  assert(pipe2(fds, O_NONBLOCK) == 0);
+  atomic_set(&done, 0);
+  struct reader reader = { .fd = fds[0], .timeout = 0 };
+  task_init(&reader.task, reader_fn);
+  task_runnable(&reader.task);
+  for (int i = 0; i < 100; i++)
+    uthread_yield(true, yield_cb, NULL);
+  /* Tasks have no pthread to fall back to. */
+  if (atomic_read(&done) && reader.res == -ENOSYS) {
+    printf("no I/O engine for tasks\n");
+    return 0;
+  }
+  assert(atomic_read(&done) == 0);
+  assert(write(fds[1], "x", 1) == 1);
+  wait_for(1);
+  assert(reader.c == 'x' && (reader.res & POLLIN));
+
+  atomic_set(&done, 0);
+  reader.timeout = 10000;
+  reader.res = 0;
+  task_init(&reader.task, reader_fn);
+  task_runnable(&reader.task);
+  wait_for(1);
+  assert(reader.res == -ECANCELED);
+
+  /* Regular files can't be waited on, but are always ready anyway. */
+  char path[] = "/tmp/task_test.XXXXXX";
+  atomic_set(&done, 0);
+  struct waiter waiter = { .fd = mkstemp(path) };
+  assert(waiter.fd >= 0);
+  unlink(path);
+  task_init(&waiter.task, waiter_fn);
+  task_runnable(&waiter.task);
+  wait_for(1);
+  assert(waiter.res > 0 && (waiter.res & POLLIN));
+  close(waiter.fd);
+  printf("fd waits done\n");
+  return 0;
+}
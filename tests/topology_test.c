@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <assert.h>
+#include <sched.h>
+#include "parlib.h"
+#include "uthread.h"
+#include "topology.h"
+
+static struct uthread main_thread;
+
+/* No doubling up on a CPU among the n vcores from first on. */
+static void check_spread(int first, int n)
+{
+  for (int i = first; i < max_vcores() && i < first + n; i++)
+    for (int j = first; j < i; j++)
+      assert(vcore_map(i) != vcore_map(j));
+}
+
+int main()
+{
+  cpu_set_t allowed;
+  assert(sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+  uthread_lib_init(&main_thread);
+
+  for (int i = 0; i < max_vcores(); i++) {
+    printf("vcore %d: cpu %d, node %d, socket %d, core %d, smt %d\n", i,
+           vcore_map(i), vcore_node(i), vcore_socket(i),
+           vcore_pvc_data[i].core, vcore_pvc_data[i].smt);
+    assert(CPU_ISSET(vcore_map(i), &allowed));
+    assert(vcore_node(i) < topology_nr_nodes());
+    assert(vcore_socket(i) < topology_nr_sockets());
+    assert(vcore_distance(i, i) == VCORE_DIST_CPU);
+    for (int j = 0; j < max_vcores(); j++)
+      assert(vcore_distance(i, j) == vcore_distance(j, i));
+  }
+  /* No doubling up on a CPU until they have all been used. */
+  int nr_cpus = CPU_COUNT(&allowed);
+  check_spread(0, nr_cpus);
+
+  /* Lose all CPUs but one: every vcore moves there. */
+  int nr = max_vcores();
+  cpu_set_t one;
+  CPU_ZERO(&one);
+  for (int i = 0; i < CPU_SETSIZE && !CPU_COUNT(&one); i++)
+    if (CPU_ISSET(i, &allowed))
+      CPU_SET(i, &one);
+  assert(sched_setaffinity(getpid(), sizeof(one), &one) == 0);
+  vcore_set_max(nr);
+  for (int i = 0; i < nr; i++)
+    assert(CPU_ISSET(vcore_map(i), &one));
+
+  /* And get them back: new vcores go to the ones we got first. */
+  assert(sched_setaffinity(getpid(), sizeof(allowed), &allowed) == 0);
+  vcore_set_max(vcore_capacity());
+  for (int i = 0; i < max_vcores(); i++)
+    assert(CPU_ISSET(vcore_map(i), &allowed));
+  for (int i = nr; i < max_vcores() && i < nr + nr_cpus - 1; i++)
+    assert(!CPU_ISSET(vcore_map(i), &one));
+  check_spread(nr, nr_cpus - 1);
+  printf("replaced %d vcores on %d cpus\n", (int)max_vcores(), nr_cpus);
+  return 0;
+}
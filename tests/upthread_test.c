@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "upthread.h"
+
+#define NR_THREADS 16
+#define NR_ITERS   10000
+
+static upthread_mutex_t mutex = UPTHREAD_MUTEX_INITIALIZER;
+static upthread_cond_t cond = UPTHREAD_COND_INITIALIZER;
+static upthread_rwlock_t rwlock = UPTHREAD_RWLOCK_INITIALIZER;
+static upthread_barrier_t barrier;
+static long counter = 0;
+static long shared[2];
+static int turn = 0;
+
+static void *mutex_func(void *arg)
+{
+  for (int i = 0; i < NR_ITERS; i++) {
+    upthread_mutex_lock(&mutex);
+    counter++;
+    if (i % 100 == 0)
+      upthread_yield();
+    upthread_mutex_unlock(&mutex);
+  }
+  return arg;
+}
+
+/* Threads take turns in order, through a single condition variable. */
+static void *cond_func(void *arg)
+{
+  long me = (long)arg;
+  for (int i = 0; i < 100; i++) {
+    upthread_mutex_lock(&mutex);
+    while (turn % NR_THREADS != me)
+      upthread_cond_wait(&cond, &mutex);
+    turn++;
+    upthread_cond_broadcast(&cond);
+    upthread_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+static void *rwlock_func(void *arg)
+{
+  for (int i = 0; i < NR_ITERS / 10; i++) {
+    if (i % 4 == 0) {
+      upthread_rwlock_wrlock(&rwlock);
+      shared[0]++;
+      upthread_yield();
+      shared[1]++;
+      upthread_rwlock_unlock(&rwlock);
+    } else {
+      upthread_rwlock_rdlock(&rwlock);
+      assert(shared[0] == shared[1]);
+      upthread_rwlock_unlock(&rwlock);
+    }
+  }
+  return NULL;
+}
+
+static void *barrier_func(void *arg)
+{
+  int serial = 0;
+  for (int i = 0; i < 100; i++) {
+    upthread_mutex_lock(&mutex);
+    counter++;
+    upthread_mutex_unlock(&mutex);
+    if (upthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+      serial++;
+    assert(counter >= (i + 1) * NR_THREADS);
+    upthread_barrier_wait(&barrier);
+  }
+  return (void*)(long)serial;
+}
+
+static struct timespec in_50ms(clockid_t clock)
+{
+  struct timespec abstime;
+  clock_gettime(clock, &abstime);
+  abstime.tv_nsec += 50000000;
+  if (abstime.tv_nsec >= 1000000000) {
+    abstime.tv_sec++;
+    abstime.tv_nsec -= 1000000000;
+  }
+  return abstime;
+}
+
+static void *writer_func(void *arg)
+{
+  upthread_rwlock_wrlock(&rwlock);
+  upthread_rwlock_unlock(&rwlock);
+  return NULL;
+}
+
+static void *timedlock_func(void *arg)
+{
+  struct timespec abstime = in_50ms(CLOCK_MONOTONIC);
+  assert(upthread_mutex_clocklock(&mutex, CLOCK_MONOTONIC, &abstime)
+         == ETIMEDOUT);
+  abstime = in_50ms(CLOCK_REALTIME);
+  assert(upthread_rwlock_timedwrlock(&rwlock, &abstime) == ETIMEDOUT);
+  return NULL;
+}
+
+static volatile bool release = false;
+static volatile bool outsider_done = false;
+
+static void *sleeper_func(void *arg)
+{
+  while (!release)
+    upthread_yield();
+  return arg;
+}
+
+/* Spends about 100ms yielding. */
+static void yield_100ms()
+{
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    upthread_yield();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000 +
+           (now.tv_nsec - start.tv_nsec) / 1000000 < 100);
+}
+
+/* A pthread of our own rather than an upthread, which has to sleep in the
+ * kernel while it waits on the mutex and the sleeper, not burn its CPU. */
+static void *outsider_func(void *arg)
+{
+  upthread_t t = arg;
+  struct timespec start, end;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+  upthread_mutex_lock(&mutex);
+  upthread_mutex_unlock(&mutex);
+  struct timespec abstime = in_50ms(CLOCK_REALTIME);
+  assert(upthread_timedjoin_np(t, NULL, &abstime) == ETIMEDOUT);
+  assert(upthread_join(t, NULL) == 0);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+  long usec = (end.tv_sec - start.tv_sec) * 1000000 +
+              (end.tv_nsec - start.tv_nsec) / 1000;
+  outsider_done = true;
+  return (void*)usec;
+}
+
+static void run(void *(*func)(void *), const char *what)
+{
+  upthread_t threads[NR_THREADS];
+  long total = 0;
+  void *ret;
+  for (long i = 0; i < NR_THREADS; i++)
+    assert(upthread_create(&threads[i], NULL, func, (void*)i) == 0);
+  for (int i = 0; i < NR_THREADS; i++) {
+    assert(upthread_join(threads[i], &ret) == 0);
+    total += (long)ret;
+  }
+  printf("%s done, counter = %ld, total = %ld\n", what, counter, total);
+}
+
+int main()
+{
+  run(mutex_func, "mutex");
+  assert(counter == NR_THREADS * NR_ITERS);
+
+  run(cond_func, "cond");
+  assert(turn == NR_THREADS * 100);
+
+  run(rwlock_func, "rwlock");
+  assert(shared[0] == shared[1]);
+
+  counter = 0;
+  upthread_barrier_init(&barrier, NULL, NR_THREADS);
+  run(barrier_func, "barrier");
+  assert(counter == NR_THREADS * 100);
+
+  struct timespec abstime = in_50ms(CLOCK_REALTIME);
+  upthread_mutex_lock(&mutex);
+  assert(upthread_cond_timedwait(&cond, &mutex, &abstime) == ETIMEDOUT);
+  upthread_mutex_unlock(&mutex);
+  printf("timedwait timed out\n");
+
+  /* Both held by us, the other thread's timed locks give up. */
+  upthread_t t;
+  upthread_mutex_lock(&mutex);
+  upthread_rwlock_rdlock(&rwlock);
+  upthread_create(&t, NULL, timedlock_func, NULL);
+  assert(upthread_join(t, NULL) == 0);
+  upthread_rwlock_unlock(&rwlock);
+  upthread_mutex_unlock(&mutex);
+  printf("timed locks timed out\n");
+
+  /* The sleeper is still going when the outsider gets the mutex. */
+  pthread_t outsider;
+  void *usec;
+  upthread_mutex_lock(&mutex);
+  upthread_create(&t, NULL, sleeper_func, NULL);
+  assert(pthread_create(&outsider, NULL, outsider_func, t) == 0);
+  yield_100ms();
+  upthread_mutex_unlock(&mutex);
+  yield_100ms();
+  release = true;
+  while (!outsider_done)
+    upthread_yield();
+  pthread_join(outsider, &usec);
+  printf("outsider waited with %ld usec of cpu time\n", (long)usec);
+  assert((long)usec < 20000);
+
+  /* Readers don't wait behind a writer that waits, so read locks nest. */
+  upthread_rwlock_rdlock(&rwlock);
+  upthread_create(&t, NULL, writer_func, NULL);
+  for (int i = 0; i < 100; i++)
+    upthread_yield();
+  assert(rwlock.waiters != NULL);
+  assert(upthread_rwlock_rdlock(&rwlock) == 0);
+  upthread_rwlock_unlock(&rwlock);
+  upthread_rwlock_unlock(&rwlock);
+  assert(upthread_join(t, NULL) == 0);
+
+  /* Unless writers are preferred. */
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  upthread_rwlock_init(&rwlock, &attr);
+  upthread_rwlock_rdlock(&rwlock);
+  upthread_create(&t, NULL, writer_func, NULL);
+  for (int i = 0; i < 100; i++)
+    upthread_yield();
+  assert(upthread_rwlock_tryrdlock(&rwlock) == EBUSY);
+  upthread_rwlock_unlock(&rwlock);
+  assert(upthread_join(t, NULL) == 0);
+  printf("rwlock preferences ok\n");
+
+  char name[16];
+  pthread_attr_t tattr;
+  void *stack;
+  size_t stack_size;
+  assert(upthread_setname_np(upthread_self(), "main upthread") == 0);
+  assert(upthread_getname_np(upthread_self(), name, sizeof(name)) == 0);
+  assert(strcmp(name, "main upthread") == 0);
+  assert(upthread_getname_np(upthread_self(), name, 4) == ERANGE);
+  assert(upthread_getattr_np(upthread_self(), &tattr) == 0);
+  assert(pthread_attr_getstack(&tattr, &stack, &stack_size) == 0);
+  assert((char*)stack < (char*)&tattr && (char*)&tattr < (char*)stack
+                                                          + stack_size);
+  pthread_attr_destroy(&tattr);
+  return 0;
+}
@@ -0,0 +1,64 @@
+/* See COPYING.LESSER for copyright information. */
+/* Kevin Klues <klueska@cs.berkeley.edu>	*/
+
+/* What the tests that drive uthreads by hand all need: main() turned into a
+ * uthread, and ways for uthreads to yield, exit and wait on each other. */
+
+#ifndef PARLIB_TESTS_UTHREAD_FIXTURE_H
+#define PARLIB_TESTS_UTHREAD_FIXTURE_H
+
+#include "uthread.h"
+#include "atomic.h"
+
+#define TEST_STACK_SIZE (64 * 1024)
+
+/* The uthread main() runs as once test_init() returns. */
+static struct uthread main_thread;
+
+static void __test_yield_cb(struct uthread *uthread, void *arg)
+{
+  uthread_paused(uthread);
+}
+
+static void __test_exit_cb(struct uthread *uthread, void *arg)
+{
+  /* Nobody ever runs us again, and we are off of our stack. */
+  if (arg)
+    atomic_add((atomic_t*)arg, 1);
+}
+
+static inline void test_init(void)
+{
+  uthread_lib_init(&main_thread);
+}
+
+/* Hands the calling uthread back to the 2LS, to be run again later. */
+static inline void test_yield(void)
+{
+  uthread_yield(true, __test_yield_cb, NULL);
+}
+
+/* Ends the calling uthread, and then bumps done, unless it is NULL. */
+static inline void test_exit(atomic_t *done)
+{
+  uthread_yield(false, __test_exit_cb, done);
+}
+
+/* Yields until done gets to n. */
+static inline void test_wait_for(atomic_t *done, long n)
+{
+  while ((long)atomic_read(done) < n)
+    test_yield();
+}
+
+/* Makes a runnable uthread out of func, on a stack of stack_size that the
+ * library allocates, and hands back in uthread_cleanup(). */
+static inline void test_spawn(struct uthread *uthread, void (*func)(void),
+                              uint32_t stack_size)
+{
+  uthread_init(uthread);
+  init_uthread_tf(uthread, func, NULL, stack_size);
+  uthread_runnable(uthread);
+}
+
+#endif // PARLIB_TESTS_UTHREAD_FIXTURE_H
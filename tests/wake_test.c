@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include "parlib.h"
+#include "uthread_fixture.h"
+
+#define NR_VCORES 16
+
+/* Waits for all but our own vcore to go offline, and to park or to be on
+ * the way there, so that they count a park wakeup whenever they come back. */
+static void wait_for_offline(void)
+{
+  while (num_vcores() > 1)
+    cpu_relax();
+}
+
+int main()
+{
+  setenv("VCORE_LIMIT", "16", 1);
+  test_init();
+  assert(max_vcores() == NR_VCORES);
+  /* Park as soon as there is nothing to do. */
+  vcore_set_idle_policy(0, 0);
+
+  /* Batches of 1 to all of the others, each of which has to wake up every
+   * vcore it got, whoever ends up doing it.  We only do two of the system
+   * calls for that ourselves, and so does everybody we wake. */
+  for (int k = 1; k < NR_VCORES; k++) {
+    struct vcore_idle_stats stats;
+    unsigned long before[NR_VCORES], sent[NR_VCORES];
+    wait_for_offline();
+    for (int i = 0; i < NR_VCORES; i++) {
+      vcore_get_idle_stats(i, &stats);
+      before[i] = stats.park_wakeups;
+      sent[i] = stats.wakes_sent;
+    }
+    assert(vcore_request(k) == 0);
+
+    int woken = 0;
+    for (int tries = 0; tries < 5000 && woken < k; tries++) {
+      woken = 0;
+      for (int i = 1; i < NR_VCORES; i++) {
+        vcore_get_idle_stats(i, &stats);
+        woken += stats.park_wakeups > before[i];
+      }
+      usleep(1000);
+    }
+    unsigned long total = 0;
+    for (int i = 0; i < NR_VCORES; i++) {
+      vcore_get_idle_stats(i, &stats);
+      assert(stats.wakes_sent - sent[i] <= 2);
+      total += stats.wakes_sent - sent[i];
+    }
+    printf("requested %d, woken %d, %lu by futex\n", k, woken, total);
+    assert(woken == k && total <= k);
+  }
+  return 0;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include "parlib.h"
+#include "wsched.h"
+#include "uthread_fixture.h"
+
+#define NR_THREADS 100
+#define NR_YIELDS  100
+
+static struct uthread threads[NR_THREADS];
+static atomic_t done = ATOMIC_INITIALIZER(0);
+static volatile int ran_on[MAX_VCORES];
+
+static void thread_func()
+{
+  for (int i = 0; i < NR_YIELDS; i++) {
+    ran_on[vcore_id()] = 1;
+    test_yield();
+  }
+  test_exit(&done);
+}
+
+int main()
+{
+  test_init();
+  for (int i = 0; i < NR_THREADS; i++)
+    test_spawn(&threads[i], thread_func, TEST_STACK_SIZE);
+  test_wait_for(&done, NR_THREADS);
+
+  int nr_vcores = 0;
+  for (int i = 0; i < MAX_VCORES; i++)
+    nr_vcores += ran_on[i];
+  printf("%d uthreads done, ran on %d vcores\n", NR_THREADS, nr_vcores);
+  return 0;
+}